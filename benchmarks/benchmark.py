@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+# Timings of the stages of a CIPSI run, over the determinant ladders of `data/`
+#
+#    ./benchmarks/benchmark.py --dataset f2_631g --output f2.json
+#    mpirun -n 4 ./benchmarks/benchmark.py --dataset c2_eq_hf_dz --max_det 2000 --scaling strong
+#    mpirun -n 4 ./benchmarks/benchmark.py --dataset c2_eq_hf_dz --scaling weak --det_per_rank 250
+#
+# Each stage is timed between two barriers (so the time is the one of the slowest rank);
+# the peak RSS is the high-water mark of the processes at the end of the stage, the running
+# workers included (max and sum over the ranks).
+# Results go to a JSON file, one record per (wave function, driven_by, stage).
+
+import argparse
+import glob
+import json
+import os
+import platform
+import re
+import resource
+import sys
+import time
+
+sys.path.insert(0, os.path.abspath(os.path.join(os.path.dirname(__file__), "..")))
+from qe.drivers import Hamiltonian_generator, Powerplant_manager, selection_step
+from qe.io import load_integrals, load_wf
+from mpi4py import MPI
+import numpy as np
+
+DATA = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", "data"))
+
+STAGES = ["load", "cache", "matvec", "davidson", "pt2", "selection"]
+
+
+def ladder(dataset):
+    """(fcidump path, [(N_det, wf path)] sorted by N_det) of a dataset of `data/`
+    >>> fcidump, wfs = ladder("f2_631g")
+    >>> os.path.basename(fcidump), [N_det for N_det, _ in wfs][:3]
+    ('f2_631g.FCIDUMP', [1, 2, 10])
+    """
+    if dataset == "f2_631g":
+        (fcidump,) = glob.glob(f"{DATA}/f2_631g.FCIDUMP")
+        pattern = re.compile(r"f2_631g\.(\d+)det\.wf$")
+    else:
+        (fcidump,) = glob.glob(f"{DATA}/{dataset}.fcidump*")
+        pattern = re.compile(rf"{dataset}_\d+\.(\d+)det\.wf(\.gz|\.bz2)?$")
+    wfs = []
+    for path in glob.glob(f"{DATA}/*"):
+        m = pattern.search(os.path.basename(path))
+        if m:
+            wfs.append((int(m.group(1)), path))
+    return fcidump, sorted(wfs)
+
+
+def weak_scaling_ladder(wfs, det_per_rank, world_size):
+    """Weak scaling: the wave function with the closest N_det to `det_per_rank` per rank
+    >>> weak_scaling_ladder([(10, "a"), (30, "b"), (60, "c")], 15, 2)
+    [(30, 'b')]
+    """
+    target = det_per_rank * world_size
+    return [min(wfs, key=lambda w: abs(w[0] - target))]
+
+
+def live_children_hwm_kB(pid=None):
+    """Sum of the peak RSS (VmHWM, in kB) of the running children of `pid` (default: this
+    process), from /proc; 0 where /proc doesn't list the children
+    >>> live_children_hwm_kB() >= 0
+    True
+    """
+    pid = os.getpid() if pid is None else pid
+    children = []
+    # (children of all the threads: the pools are forked from the one which first maps)
+    for path in glob.glob(f"/proc/{pid}/task/*/children"):
+        with open(path) as f:
+            children += f.read().split()
+    kB = 0
+    for child in children:
+        try:
+            with open(f"/proc/{child}/status") as f:
+                kB += sum(int(line.split()[1]) for line in f if line.startswith("VmHWM:"))
+        except FileNotFoundError:
+            # (exited in the meantime)
+            pass
+    return kB
+
+
+class Benchmark(object):
+    def __init__(self, comm, meta):
+        self.comm = comm
+        self.meta = meta
+        self.results = []
+
+    def peak_rss_MB(self):
+        """(max, sum) over the ranks of the peak resident set size of the processes, in MB"""
+        # ru_maxrss is in kB on Linux. The forked workers (`n_workers') are still running:
+        # RUSAGE_CHILDREN only knows the reaped children, their high-water marks are read live
+        kB = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss + live_children_hwm_kB()
+        return (
+            self.comm.allreduce(kB, op=MPI.MAX) / 1024,
+            self.comm.allreduce(kB, op=MPI.SUM) / 1024,
+        )
+
+    def time(self, stage, f, **record):
+        """Run f() on all the ranks, record its time, and return its value"""
+        self.comm.Barrier()
+        start = MPI.Wtime()
+        value = f()
+        self.comm.Barrier()
+        elapsed = self.comm.allreduce(MPI.Wtime() - start, op=MPI.MAX)
+        rss_max, rss_sum = self.peak_rss_MB()
+        self.results.append(
+            dict(
+                record,
+                stage=stage,
+                time=elapsed,
+                peak_rss_MB_max=rss_max,
+                peak_rss_MB_sum=rss_sum,
+                ranks=self.comm.Get_size(),
+            )
+        )
+        if self.comm.Get_rank() == 0:
+            N_det, driven_by = record["N_det"] or "", record["driven_by"] or ""
+            print(f"{record['dataset']:<14} {N_det:>7} {driven_by:<12} {stage:<14} {elapsed:.4f}s")
+        return value
+
+    def run_wf(self, dataset, integrals, N_det, wf_path, driven_by, stages, n_workers):
+        n_orb, E0, d_one_e_integral, d_two_e_integral = integrals
+        record = dict(dataset=dataset, wf=os.path.basename(wf_path), N_det=N_det, driven_by=None)
+        if "load" in stages:
+            psi_coef, psi_det = self.time("load_wf", lambda: load_wf(wf_path), **record)
+        else:
+            psi_coef, psi_det = load_wf(wf_path)
+        record.update(driven_by=driven_by)
+
+        lewis = Hamiltonian_generator(
+            self.comm,
+            E0,
+            d_one_e_integral,
+            d_two_e_integral,
+            psi_det,
+            driven_by=driven_by,
+            n_workers=n_workers,
+        )
+        # The workers (`n_workers') of each generator are stopped before the next wave function
+        generators = [lewis]
+        try:
+            # The other stages need the cached H anyway
+            self.time("cache", lambda: (lewis.D_i, lewis.H_i_sparse), **record)
+            if "matvec" in stages:
+                V = np.array(psi_coef, dtype="float").reshape(-1, 1)
+                self.time("matvec", lambda: lewis.H_i_implicit_matrix_product(V), **record)
+            if "davidson" in stages:
+                PP_manager = Powerplant_manager(self.comm, lewis)
+                E, psi_coef = self.time("davidson", lambda: PP_manager.E_and_psi_coef, **record)
+            if "pt2" in stages:
+                PP_manager = Powerplant_manager(self.comm, lewis)
+                self.time("pt2", lambda: PP_manager.E_pt2(psi_coef), **record)
+            if "selection" in stages:
+                # (the extended generator has workers of its own)
+                *_, lewis_new = self.time(
+                    "selection",
+                    lambda: selection_step(
+                        self.comm, lewis, n_orb, psi_coef, psi_det, N_det, return_generator=True
+                    ),
+                    **record,
+                )
+                generators.append(lewis_new)
+        finally:
+            for generator in generators:
+                generator.close()
+
+    def run(self, dataset, wfs, driven_bys, stages, n_workers):
+        fcidump, _ = ladder(dataset)
+        record = dict(dataset=dataset, wf=None, N_det=None, driven_by=None)
+        if "load" in stages:
+            integrals = self.time(
+                "load_integrals", lambda: load_integrals(fcidump, "packed"), **record
+            )
+        else:
+            integrals = load_integrals(fcidump, "packed")
+        for N_det, wf_path in wfs:
+            for driven_by in driven_bys:
+                self.run_wf(dataset, integrals, N_det, wf_path, driven_by, stages, n_workers)
+
+    def write(self, path):
+        if self.comm.Get_rank() == 0:
+            with open(path, "w") as f:
+                json.dump({"meta": self.meta, "results": self.results}, f, indent=1)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark the stages of a CIPSI run")
+    parser.add_argument(
+        "--dataset",
+        action="append",
+        choices=["f2_631g", "c2_eq_hf_dz", "c2_eq_hf_tz", "c2_eq_hf_qz"],
+        help="Determinant ladder(s) of data/ to run. Default: f2_631g",
+    )
+    parser.add_argument(
+        "--max_det", type=int, default=1000, help="Skip the wave functions larger than this"
+    )
+    parser.add_argument(
+        "--driven_by",
+        action="append",
+        choices=["integral", "determinant", "compiled"],
+        help="Hamiltonian engine(s). Default: integral and determinant",
+    )
+    parser.add_argument(
+        "--stages",
+        default=",".join(STAGES),
+        help=f"Comma separated subset of {','.join(STAGES)} (the H cache is always built)",
+    )
+    parser.add_argument(
+        "--scaling",
+        choices=["strong", "weak"],
+        default="strong",
+        help="Strong: the whole ladder, whatever the number of ranks. Weak: the wave function of "
+        "about --det_per_rank determinants per rank",
+    )
+    parser.add_argument("--det_per_rank", type=int, default=100)
+    parser.add_argument("--n_workers", type=int, default=1)
+    parser.add_argument("--output", default="benchmark.json", help="JSON file of the results")
+    args = parser.parse_args()
+
+    comm = MPI.COMM_WORLD
+    stages = args.stages.split(",")
+    for stage in stages:
+        if stage not in STAGES:
+            parser.error(f"unknown stage {stage}")
+    datasets = args.dataset or ["f2_631g"]
+    driven_bys = args.driven_by or ["integral", "determinant"]
+
+    meta = dict(
+        date=time.strftime("%Y-%m-%dT%H:%M:%S"),
+        host=platform.node(),
+        python=platform.python_version(),
+        numpy=np.__version__,
+        ranks=comm.Get_size(),
+        scaling=args.scaling,
+        args=vars(args),
+    )
+    benchmark = Benchmark(comm, meta)
+    for dataset in datasets:
+        _, wfs = ladder(dataset)
+        wfs = [(N_det, path) for N_det, path in wfs if N_det <= args.max_det]
+        if args.scaling == "weak" and wfs:
+            wfs = weak_scaling_ladder(wfs, args.det_per_rank, comm.Get_size())
+        benchmark.run(dataset, wfs, driven_bys, stages, args.n_workers)
+    benchmark.write(args.output)
@@ -1,6 +1,8 @@
 #!/usr/bin/env python3
 from qe.drivers import *
 from qe.io import *
+from qe.instrumentation import profiler, Instrumented_comm
+from qe.compiled import HAS_NUMBA
 import sys
 import argparse
 
@@ -14,7 +16,7 @@ if __name__ == "__main__":
     )
     parser.add_argument(
         "--wf_path",
-        help="path/filename of the wf file containing the wf coefficients and determinant list to begin with",
+        help="path/filename of the wf file containing the wf coefficients and determinant list to begin with. Can be a binary wf file (see `qe.io.convert_wf`), that each rank reads itself.",
     )
 
     parser.add_argument(
@@ -27,45 +29,312 @@ if __name__ == "__main__":
 
     parser.add_argument(
         "-driven_by",
-        choices=["integral", "determinant"],
+        choices=["integral", "determinant", "compiled"],
         default="integral",
         required=False,
-        help="Way in which Hamiltonian is generated. Integral driven: local set of integrals, determinants are found on each node. Determinant driven: local set of determinants, all integrals are on each node.",
+        help="Way in which Hamiltonian is generated. Integral driven: local set of integrals, determinants are found on each node. Determinant driven: local set of determinants, all integrals are on each node. Compiled: determinant driven (every pair of determinants is screened), with the matrix elements computed by a compiled loop over packed determinants (needs Numba, see requirements-compiled.txt).",
     )
 
+    parser.add_argument(
+        "-det_representation",
+        choices=["tuple", "bitstring"],
+        default="tuple",
+        required=False,
+        help="Representation of the spin determinants. Tuple: occupied orbitals. Bitstring: occupation numbers, as integers.",
+    )
+    parser.add_argument(
+        "-integral_eps",
+        type=float,
+        default=0.0,
+        required=False,
+        help="Integral driven and compiled only: two-electron integrals smaller than this (in absolute value) are skipped",
+    )
+    parser.add_argument(
+        "-integral_distribution",
+        choices=["shared", "bcast"],
+        default="shared",
+        required=False,
+        help="Shared: one copy of the two-electron integrals per node, in MPI shared memory. Bcast: one copy per rank.",
+    )
+    parser.add_argument(
+        "-memory_budget",
+        type=float,
+        default=None,
+        required=False,
+        help="Memory (in MB, per rank) for the cached matrix elements of H. The part of H which doesn't fit is recomputed at each product. Default: everything is cached.",
+    )
+    parser.add_argument(
+        "-pt2",
+        choices=["none", "deterministic", "semistochastic"],
+        default="none",
+        required=False,
+        help="PT2 correction of the final wave function. Semistochastic: sampled until -pt2_relative_error is reached, with an error bar.",
+    )
+    parser.add_argument(
+        "-pt2_relative_error",
+        type=float,
+        default=1e-3,
+        required=False,
+        help="Semistochastic PT2 only: target relative error",
+    )
+    parser.add_argument(
+        "-E_pt2_threshold",
+        type=float,
+        default=0.0,
+        required=False,
+        help="Stop the selection once |E_pt2| of the wave function is below this threshold",
+    )
+    parser.add_argument(
+        "-n_workers",
+        type=int,
+        default=1,
+        required=False,
+        help="Number of worker processes per MPI rank, for the matrix elements of H and the PT2. Run a few ranks per node with several workers each, to share the integrals and determinants of a rank between its workers. The workers are forked (once per CIPSI iteration) after MPI_Init: only safe with transports that are not RDMA-based (TCP, shared memory), or fork-safe ones.",
+    )
+    parser.add_argument(
+        "-backend",
+        choices=["numpy", "cupy"],
+        default="numpy",
+        required=False,
+        help="Where the Davidson diagonalizations run. Numpy: on the host. Cupy: on the GPU of each rank (needs CuPy); H and the trial vectors stay on the device, only small matrices go through MPI.",
+    )
+    parser.add_argument(
+        "-device_aware_mpi",
+        action="store_true",
+        help="Cupy backend only: MPI is CUDA-aware, device buffers are communicated directly (instead of through host memory)",
+    )
+    parser.add_argument(
+        "-checkpoint_path",
+        default=None,
+        required=False,
+        help="path/filename of the checkpoint written (in the background) after each selection step: determinants, coefficients, energies and distribution over the ranks",
+    )
+    parser.add_argument(
+        "-restart",
+        action="store_true",
+        help="Resume the run saved in -checkpoint_path (instead of starting from --wf_path)",
+    )
+    parser.add_argument(
+        "-checkpoint_hamiltonian",
+        action="store_true",
+        help="Also checkpoint the cached rows of H of each rank (one file per rank, not with -memory_budget), so that a restart on the same number of ranks doesn't recompute them",
+    )
+    parser.add_argument(
+        "-det_storage",
+        choices=["replicated", "distributed"],
+        default="replicated",
+        required=False,
+        help="Replicated: every rank has all the determinants. Distributed: each rank only has its block of determinants; H is generated against the blocks of the other ranks going around a ring, the products only exchange the entries of the vectors that are needed, and the PT2 contributions are summed by the rank owning each connected determinant. With a binary wf file sorted by alpha string (`qe.io.convert_wf(..., sort_by_alpha=True)`), each rank reads its own block, of whole alpha strings. The PT2 sweep is then in lockstep, over the constraints sorted by cost and batched by total cost: each rank only works on its own determinants, with no dynamic scheduling and no worker pool (-n_workers is only used for H). Not with -memory_budget nor -pt2 semistochastic.",
+    )
+    parser.add_argument(
+        "-symmetric",
+        action="store_true",
+        help="Only generate and cache the upper triangle of H (J >= I, about half of the elements); the products add its transpose, reduce-scattered over the ranks, and the rows are distributed so that the ranks have the same share of the triangle. Not with -memory_budget nor -det_storage distributed.",
+    )
+    parser.add_argument(
+        "-preconditioner",
+        choices=["diagonal", "block"],
+        default="diagonal",
+        required=False,
+        help="Davidson preconditioner. Diagonal: 1 / (H_II - E), element-wise. Block: (H - E) inverted exactly on the 256 leading determinants of each rank (from the cached H), diagonal elsewhere; more setup, fewer iterations. With -profile, the iterations are counted per preconditioner",
+    )
+    parser.add_argument(
+        "-point_group",
+        action="store_true",
+        help="Use the orbital symmetries (ORBSYM of the FCIDUMP, abelian point groups): the PT2 and the selection only generate the excitations which keep the irrep of their determinant, and the integral-driven H skips the integrals which are zero by symmetry",
+    )
+    parser.add_argument(
+        "-profile",
+        nargs="?",
+        const="time",
+        choices=["time", "bytes"],
+        help="Print, after each selection step, the time spent in each phase, the work done (integrals visited and elements emitted per category, constraints, connected determinants, Davidson iterations...), the sizes of the caches and the time and bytes of the MPI collectives; min / avg / max over the ranks. The bytes of the pickled (lower-case) collectives are only measured with `-profile bytes', at the cost of pickling their payloads once more",
+    )
     args = parser.parse_args()
+    if args.driven_by == "compiled" and not HAS_NUMBA:
+        parser.error("-driven_by compiled needs numba (pip install -r requirements-compiled.txt)")
+    if args.restart and args.checkpoint_path is None:
+        parser.error("-restart needs -checkpoint_path")
+    distributed = args.det_storage == "distributed"
+    if distributed and (args.memory_budget is not None or args.pt2 == "semistochastic"):
+        parser.error("-det_storage distributed: no -memory_budget, no semistochastic -pt2")
+    if args.symmetric and (distributed or args.memory_budget is not None):
+        parser.error("-symmetric: no -memory_budget, no -det_storage distributed")
     # Load integrals
     comm = MPI.COMM_WORLD
+    if args.profile:
+        profiler.enabled = True
+        profiler.pickled_bytes = args.profile == "bytes"
+        comm = Instrumented_comm(comm)
     # Initialize rank
     rank = comm.Get_rank()
-    # Only master will load integrals and wave functions
+    # Only master will load integrals and (text) wave functions
     if rank == 0:
-        n_ord, E0, d_one_e_integral, d_two_e_integral = load_integrals(args.fcidump_path)
-        # Load wave function
-        psi_coef, psi_det = load_wf(args.wf_path)
-
-        # pack into tuple so it can be sent with bcast
-        load_tup = (n_ord, E0, d_one_e_integral, d_two_e_integral, psi_coef, psi_det)
+        n_ord, E0, d_one_e_integral, d_two_e_integral = load_integrals(
+            args.fcidump_path, two_e_representation="packed"
+        )
     else:
-        load_tup = None
+        n_ord, E0, d_one_e_integral, d_two_e_integral = None, None, None, None
+    orbsym = load_orbsym(args.fcidump_path) if rank == 0 and args.point_group else None
+    orbsym = comm.bcast(orbsym, 0)
+    psi_coef, psi_det, psi_det_packed = None, None, None
+    E, distribution, step = None, None, 0
+    # Load wave function
+    if rank == 0 and args.restart:
+        psi_coef, psi_det, E, _, distribution, step = load_checkpoint(args.checkpoint_path)
+        psi_coef = psi_coef[:, 0]
+    elif rank == 0 and not args.wf_path.endswith(BINARY_WF_SUFFIX):
+        # Streamed into packed words, broadcasted as raw buffers
+        psi_coef, psi_det_packed = read_wf_packed(args.wf_path, n_orb=n_ord)
 
     # broadcast variables to all ranks
-    n_ord, E0, d_one_e_integral, d_two_e_integral, psi_coef, psi_det = comm.bcast(load_tup, 0)
+    if args.integral_distribution == "shared":
+        n_ord, E0, d_one_e_integral, d_two_e_integral = bcast_integrals_shared(
+            comm, n_ord, E0, d_one_e_integral, d_two_e_integral
+        )
+    else:
+        n_ord, E0, d_one_e_integral, d_two_e_integral = comm.bcast(
+            (n_ord, E0, d_one_e_integral, d_two_e_integral), 0
+        )
+    if args.restart:
+        psi_coef, psi_det, E, distribution, step = comm.bcast(
+            (psi_coef, psi_det, E, distribution, step), 0
+        )
+    elif distributed and args.wf_path.endswith(BINARY_WF_SUFFIX):
+        # Each rank reads its own block of determinants, cut between alpha strings
+        blocks = alpha_block_distribution(load_wf_binary_alpha(args.wf_path), comm.Get_size())
+        begin = int(blocks[:rank].sum())
+        psi_coef_local, psi_det_packed = load_wf_binary(args.wf_path, begin, begin + blocks[rank])
+        psi_coef = np.concatenate(comm.allgather(psi_coef_local))
+        psi_det = unpack_psi_det(psi_det_packed, args.det_representation)
+    else:
+        if args.wf_path.endswith(BINARY_WF_SUFFIX):
+            # Every rank reads the (replicated) wave function, no broadcast
+            psi_coef, psi_det_packed = load_wf_binary(args.wf_path)
+        else:
+            psi_coef, psi_det_packed = bcast_wf(comm, psi_coef, psi_det_packed)
+        psi_det = unpack_psi_det(psi_det_packed, args.det_representation)
+    if distributed and (args.restart or not args.wf_path.endswith(BINARY_WF_SUFFIX)):
+        # Each rank keeps its block (the one of the checkpoint, on the same number of ranks)
+        if distribution is None or len(distribution) != comm.Get_size():
+            distribution = Hamiltonian_generator.even_distribution(len(psi_det), comm.Get_size())
+        begin = int(np.sum(distribution[:rank]))
+        psi_det = psi_det[begin : begin + distribution[rank]]
 
     # Hamiltonian engine
     lewis = Hamiltonian_generator(
-        comm, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by=args.driven_by
+        comm,
+        E0,
+        d_one_e_integral,
+        d_two_e_integral,
+        psi_det,
+        driven_by=args.driven_by,
+        integral_eps=args.integral_eps,
+        memory_budget=None if args.memory_budget is None else int(args.memory_budget * 1e6),
+        n_workers=args.n_workers,
+        backend=Array_backend(args.backend, device_aware_mpi=args.device_aware_mpi),
+        det_storage=args.det_storage,
+        symmetric=args.symmetric,
+        orbsym=orbsym,
+        preconditioner=args.preconditioner,
+    )
+    if args.driven_by == "integral" and rank == 0:
+        n_screened = lewis.Hamiltonian_2e_driver.n_screened_integrals
+        print(f"{n_screened} two-electron integrals smaller than {args.integral_eps} are skipped")
+    # What the checkpointed rows of H depend on, besides the wave function
+    H_settings = dict(
+        symmetric=args.symmetric, point_group=args.point_group, integral_eps=args.integral_eps
     )
+    if distribution is not None and len(distribution) == comm.Get_size():
+        # Restart on the same number of ranks: same local determinants, and rows of H if saved
+        lewis.distribution = np.array(distribution, dtype="i")
+        if args.restart and args.memory_budget is None:
+            # (only the one of the same step as the wave function, and of the same H)
+            H_i = load_checkpoint_H(
+                args.checkpoint_path,
+                rank,
+                (lewis.local_size, lewis.full_problem_size),
+                step,
+                **H_settings,
+            )
+            if H_i is not None:
+                lewis.H_i_sparse = H_i
 
-    while len(psi_det) < args.N_det_target:
-        E, psi_coef, psi_det = selection_step(comm, lewis, n_ord, psi_coef, psi_det, len(psi_det))
-        # Update Hamiltonian engine
-        lewis = Hamiltonian_generator(
+    def save_checkpoint(psi_coef, psi_det, E, E_pt2, distribution, H_i, step):
+        if H_i is not None:
+            write_checkpoint_H(args.checkpoint_path, rank, H_i, step, **H_settings)
+        if rank == 0:
+            write_checkpoint(
+                args.checkpoint_path, n_ord, psi_coef, psi_det, E, E_pt2, distribution, step
+            )
+
+    checkpoint_writer = Checkpoint_writer()
+
+    # Variational energy of psi_coef; known after the first selection (from its Davidson),
+    # or from the checkpoint
+    # (psi_det: the determinants of this rank only, with distributed determinants)
+    while lewis.full_problem_size < args.N_det_target:
+        # The Hamiltonian engine is extended with the selected determinants (not rebuilt)
+        # E_pt2 is the one of the wave function before this selection, from the same sweep
+        E_previous, N_det_previous = E, lewis.full_problem_size
+        E, psi_coef, psi_det, lewis, E_pt2 = selection_step(
             comm,
-            E0,
-            d_one_e_integral,
-            d_two_e_integral,
+            lewis,
+            n_ord,
+            psi_coef,
             psi_det,
-            driven_by=args.driven_by,
+            N_det_previous,
+            return_generator=True,
+            E_var=E,
+            return_pt2=True,
+            E_pt2_threshold=args.E_pt2_threshold,
         )
-        print(f"N_det: {len(psi_det)}, E {E}")
+        step += 1
+        if args.checkpoint_path is not None:
+            # (E_pt2 is the one of the previous wave function)
+            H_i = lewis.__dict__.get("H_i_sparse") if args.checkpoint_hamiltonian else None
+            psi_det_all = lewis.gather_psi_internal() if distributed else psi_det
+            checkpoint_writer.submit(
+                save_checkpoint, psi_coef, psi_det_all, E, E_pt2, lewis.distribution, H_i, step
+            )
+        if rank == 0 and E_previous is not None:
+            print(f"N_det: {N_det_previous}, E {E_previous}, E_pt2 {E_pt2}")
+        if abs(E_pt2) < args.E_pt2_threshold:
+            # (selection_step returned psi as is: nothing was selected, nor diagonalized)
+            break
+        if args.memory_budget is not None:
+            report = lewis.memory_report()
+            if rank == 0:
+                cached_MB, direct_MB = report["cached_bytes"] / 1e6, report["direct_bytes"] / 1e6
+                print(
+                    f"H cached: {report['cached_blocks']} blocks, {cached_MB} MB;",
+                    f"recomputed: {report['direct_blocks']} blocks, {direct_MB} MB",
+                )
+        print(f"N_det: {lewis.full_problem_size}, E {E}")
+        if args.profile:
+            report = profiler.report(comm, f"Selection step, N_det: {N_det_previous}")
+            if rank == 0:
+                print(report)
+    checkpoint_writer.wait()
+
+    if args.pt2 != "none":
+        PP_manager = Powerplant_manager(comm, lewis)
+        E = PP_manager.E(psi_coef)
+        if args.pt2 == "deterministic":
+            E_pt2, error = PP_manager.E_pt2(psi_coef), 0.0
+        else:
+            E_pt2, error = PP_manager.E_pt2_semistochastic(
+                psi_coef, relative_error=args.pt2_relative_error
+            )
+        if rank == 0:
+            N_det = lewis.full_problem_size
+            print(f"N_det: {N_det}, E {E}, E_pt2 {E_pt2} +/- {error}, E+PT2 {E + E_pt2}")
+        if args.profile:
+            report = profiler.report(comm, f"PT2, N_det: {lewis.full_problem_size}")
+            if rank == 0:
+                print(report)
+    # (Forked at the first parallel loop of the last generator, if n_workers > 1)
+    lewis.close()
+    if args.integral_distribution == "shared":
+        # Frees the window, nothing reads the integrals past this point
+        d_two_e_integral.close()
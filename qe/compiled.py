@@ -0,0 +1,181 @@
+import numpy as np
+
+#   _____                       _ _          _
+#  /  __ \                     (_) |        | |
+#  | /  \/ ___  _ __ ___  _ __  _| | ___  __| |
+#  | |    / _ \| '_ ` _ \| '_ \| | |/ _ \/ _` |
+#  | \__/\ (_) | | | | | | |_) | | |  __/ (_| |
+#   \____/\___/|_| |_| |_| .__/|_|_|\___|\__,_|
+#                        | |
+#                        |_|
+#
+# Two-electron matrix elements <I|H|J> of whole arrays of (I, J) pairs, on packed determinants
+# (`Psi_det_packed` words) and packed integrals (`Two_electron_integral_packed.data`).
+# One loop per pair, written in the subset of Python that Numba compiles; the values go
+# straight into a preallocated buffer (no tuple per integral, no dictionary).
+# The pairs themselves still come from the determinant-driven screening of the whole block
+# (`Psi_det_packed.connected_pairs`): nothing here loops over the integral categories.
+# Numba is optional (`requirements-compiled.txt`): without it, the same functions run as plain
+# (very slow) Python, with a warning when the compiled driver is created.
+
+try:
+    from numba import njit
+
+    HAS_NUMBA = True
+except ImportError:
+    HAS_NUMBA = False
+
+    def njit(*args, **kwargs):
+        if len(args) == 1 and callable(args[0]):
+            return args[0]
+        return lambda f: f
+
+
+@njit(cache=True)
+def compound_idx2(i, j):
+    """Same as `integral_indexing_utils.compound_idx2`
+    >>> compound_idx2(1, 2), compound_idx2(2, 1)
+    (4, 4)
+    """
+    p, q = min(i, j), max(i, j)
+    return (q * (q + 1)) // 2 + p
+
+
+@njit(cache=True)
+def integral(data, i, j, k, l):
+    """<ij|kl>, from the packed integrals"""
+    return data[compound_idx2(compound_idx2(i, k), compound_idx2(j, l))]
+
+
+@njit(cache=True)
+def is_occupied(words, I, o):
+    # Words are viewed as int64, so that the shifts stay integer operations in Numba
+    return (words[I, o >> 6] >> (o & 63)) & 1
+
+
+@njit(cache=True)
+def single_phase(occ, n_occ, h, p):
+    """Phase of the h -> p excitation: parity of the occupied orbitals between h and p
+    >>> single_phase(np.array([0, 1, 4, 7, 8]), 5, 1, 17)
+    -1
+    """
+    lo, hi = min(h, p), max(h, p)
+    parity = 0
+    for x in range(n_occ):
+        if lo < occ[x] < hi:
+            parity ^= 1
+    return -1 if parity else 1
+
+
+@njit(cache=True)
+def two_electron_pair_elements(alpha_I, beta_I, alpha_J, beta_J, I, J, data, n_orb, out):
+    """
+    out[t] = two-electron part of <I[t]|H|J[t]>, for determinants |I> (rows of alpha_I, beta_I)
+    and |J> (rows of alpha_J, beta_J) of excitation degree <= 2, with the Slater-Condon rules
+    (and the phase conventions) of `Hamiltonian_two_electrons_determinant_driven.H_ij_indices`.
+    Pairs of higher excitation degree get 0.
+
+    :param alpha_I, beta_I, alpha_J, beta_J: packed determinants, uint64 words viewed as int64
+    :param data: `Two_electron_integral_packed.data`
+
+    >>> words = lambda *dets: np.array([[sum(1 << o for o in det)] for det in dets], dtype=np.int64)
+    >>> data = np.arange(1.0, 1.0 + ((3 * 4 // 2) * (3 * 4 // 2 + 1)) // 2)
+    >>> out = np.zeros(2)
+    >>> two_electron_pair_elements(
+    ...     words((0, 1)), words((0,)), words((0, 1), (0, 2)), words((0,), (0,)),
+    ...     np.array([0, 0]), np.array([0, 1]), data, 3, out
+    ... )
+    >>> float(out[0]) == integral(data, 0, 1, 0, 1) - integral(data, 0, 1, 1, 0) + integral(
+    ...     data, 0, 0, 0, 0) + integral(data, 1, 0, 1, 0)
+    True
+    >>> float(out[1]) == sum(
+    ...     integral(data, 1, x, 2, x) - integral(data, 1, x, x, 2) for x in (0, 1)
+    ... ) + integral(data, 1, 0, 2, 0)
+    True
+    """
+    occ_a = np.empty(n_orb, dtype=np.int64)
+    occ_b = np.empty(n_orb, dtype=np.int64)
+    # Holes and particles (2 at most), in increasing order
+    holes_a = np.empty(2, dtype=np.int64)
+    holes_b = np.empty(2, dtype=np.int64)
+    particles_a = np.empty(2, dtype=np.int64)
+    particles_b = np.empty(2, dtype=np.int64)
+    for t in range(len(I)):
+        a, b = I[t], J[t]
+        n_a, n_b, nh_a, nh_b, np_a, np_b = 0, 0, 0, 0, 0, 0
+        for o in range(n_orb):
+            i_a, j_a = is_occupied(alpha_I, a, o), is_occupied(alpha_J, b, o)
+            i_b, j_b = is_occupied(beta_I, a, o), is_occupied(beta_J, b, o)
+            if i_a:
+                occ_a[n_a] = o
+                n_a += 1
+            if i_b:
+                occ_b[n_b] = o
+                n_b += 1
+            if i_a and not j_a:
+                if nh_a < 2:
+                    holes_a[nh_a] = o
+                nh_a += 1
+            if j_a and not i_a:
+                if np_a < 2:
+                    particles_a[np_a] = o
+                np_a += 1
+            if i_b and not j_b:
+                if nh_b < 2:
+                    holes_b[nh_b] = o
+                nh_b += 1
+            if j_b and not i_b:
+                if np_b < 2:
+                    particles_b[np_b] = o
+                np_b += 1
+
+        value = 0.0
+        if nh_a == 0 and nh_b == 0:
+            # Diagonal
+            for x in range(n_a):
+                for y in range(x + 1, n_a):
+                    i, j = occ_a[x], occ_a[y]
+                    value += integral(data, i, j, i, j) - integral(data, i, j, j, i)
+            for x in range(n_b):
+                for y in range(x + 1, n_b):
+                    i, j = occ_b[x], occ_b[y]
+                    value += integral(data, i, j, i, j) - integral(data, i, j, j, i)
+            for x in range(n_a):
+                for y in range(n_b):
+                    i, j = occ_a[x], occ_b[y]
+                    value += integral(data, i, j, i, j)
+        elif (nh_a == 1 and nh_b == 0) or (nh_a == 0 and nh_b == 1):
+            # Single excitation, in the `same' spin
+            if nh_a == 1:
+                h, p = holes_a[0], particles_a[0]
+                occ_same, n_same, occ_opp, n_opp = occ_a, n_a, occ_b, n_b
+            else:
+                h, p = holes_b[0], particles_b[0]
+                occ_same, n_same, occ_opp, n_opp = occ_b, n_b, occ_a, n_a
+            for x in range(n_same):
+                i = occ_same[x]
+                value += integral(data, h, i, p, i) - integral(data, h, i, i, p)
+            for x in range(n_opp):
+                i = occ_opp[x]
+                value += integral(data, h, i, p, i)
+            value *= single_phase(occ_same, n_same, h, p)
+        elif (nh_a == 2 and nh_b == 0) or (nh_a == 0 and nh_b == 2):
+            # Double excitation, same spin
+            if nh_a == 2:
+                h1, h2, p1, p2 = holes_a[0], holes_a[1], particles_a[0], particles_a[1]
+                occ, n_occ = occ_a, n_a
+            else:
+                h1, h2, p1, p2 = holes_b[0], holes_b[1], particles_b[0], particles_b[1]
+                occ, n_occ = occ_b, n_b
+            phase = single_phase(occ, n_occ, h1, p1) * single_phase(occ, n_occ, h2, p2)
+            if h2 < p1:
+                phase = -phase
+            if p2 < h1:
+                phase = -phase
+            value = phase * (integral(data, h1, h2, p1, p2) - integral(data, h1, h2, p2, p1))
+        elif nh_a == 1 and nh_b == 1:
+            # Double excitation, opposite spins
+            h1, p1, h2, p2 = holes_a[0], particles_a[0], holes_b[0], particles_b[0]
+            phase = single_phase(occ_a, n_a, h1, p1) * single_phase(occ_b, n_b, h2, p2)
+            value = phase * integral(data, h1, h2, p1, p2)
+        out[t] = value
@@ -0,0 +1,80 @@
+from dataclasses import dataclass
+from functools import cached_property
+import numpy as np
+
+#  ______           _
+#  |  _  \         (_)
+#  | | | |_____   ___  ___ ___
+#  | | | / _ \ \ / / |/ __/ _ \
+#  | |/ /  __/\ V /| | (_|  __/
+#  |___/ \___| \_/ |_|\___\___|
+#
+# Where the (big) arrays of Davidson's method live: host memory (NumPy) or a GPU (CuPy).
+# With a device backend, H_i, the trial vectors V_ik and their products W_ik = H_i * V_k stay on
+# the GPU for the whole solve; only small matrices (Gram blocks, norms, the projected Hamiltonian)
+# go back to the host, for the MPI reductions and the dense eigensolver.
+# CuPy is optional: without it, only the "numpy" backend is available.
+
+try:
+    import cupy
+    import cupyx.scipy.sparse
+
+    HAS_CUPY = True
+except ImportError:
+    HAS_CUPY = False
+
+
+@dataclass
+class Array_backend(object):
+    """
+    :param name: "numpy" (host) or "cupy" (GPU)
+    :param device_aware_mpi: MPI takes device buffers directly (CUDA-aware MPI);
+        else the few large arrays which are communicated (trial vectors, Ritz vectors)
+        are staged through host memory
+
+    >>> backend = Array_backend("numpy")
+    >>> backend.xp is np
+    True
+    >>> A = np.ones(3)
+    >>> backend.asarray(A) is A, backend.asnumpy(A) is A
+    (True, True)
+    """
+
+    name: str = "numpy"
+    device_aware_mpi: bool = False
+
+    def __post_init__(self):
+        if self.name not in ("numpy", "cupy"):
+            raise NotImplementedError(self.name)
+        if self.name == "cupy" and not HAS_CUPY:
+            raise ImportError('backend="cupy" needs CuPy')
+
+    @property
+    def on_device(self):
+        return self.name != "numpy"
+
+    @cached_property
+    def xp(self):
+        """Array module (NumPy API) of the backend"""
+        return cupy if self.on_device else np
+
+    def asarray(self, A, dtype="float"):
+        """Host (or device) array -> backend array; no copy if already there"""
+        return self.xp.asarray(A, dtype=dtype)
+
+    def asnumpy(self, A):
+        """Backend array -> host array; no copy for the numpy backend"""
+        return cupy.asnumpy(A) if self.on_device else A
+
+    def synchronize(self):
+        """Wait for the device computations, before handing a device buffer to MPI"""
+        if self.on_device:
+            cupy.cuda.get_current_stream().synchronize()
+
+    def csr(self, A):
+        """`CSR_matrix` -> sparse matrix of the backend; both have `dot(M)` (W = A * M)"""
+        if not self.on_device:
+            return A
+        return cupyx.scipy.sparse.csr_matrix(
+            (cupy.asarray(A.data), cupy.asarray(A.indices), cupy.asarray(A.indptr)), shape=A.shape
+        )
@@ -1,8 +1,16 @@
 # Yes, I like itertools
 from dataclasses import dataclass
-from itertools import chain, product, combinations, takewhile, permutations, accumulate
-from functools import partial, cached_property, cache
+from itertools import chain, product, combinations, takewhile, permutations, accumulate, compress
+from itertools import islice
+from functools import partial, cached_property, cache, reduce
 from collections import defaultdict
+import multiprocessing
+import heapq
+import os
+import pickle
+import queue
+import tempfile
+import warnings
 import numpy as np
 
 # Import mpi4py and utilities
@@ -18,9 +26,22 @@ from qe.fundamental_types import (
     Two_electron_integral,
     Two_electron_integral_index,
     Two_electron_integral_index_phase,
+    Two_electron_integral_packed,
+    Psi_det_packed,
 )
 from typing import Iterator, Set, Tuple, List, Dict
-from qe.integral_indexing_utils import compound_idx4_reverse, compound_idx4, canonical_idx4
+from qe.integral_indexing_utils import (
+    compound_idx4_reverse,
+    compound_idx4,
+    canonical_idx4,
+    compound_idx4_array,
+    compound_idx4_reverse_array,
+)
+from qe.sparse_matrix import CSR_matrix
+from qe.compiled import two_electron_pair_elements, HAS_NUMBA
+from qe.device import Array_backend
+from qe.instrumentation import profiler
+from qe.io import unpack_psi_det
 
 #  _____      _                       _   _
 # |_   _|    | |                     | | | |
@@ -79,6 +100,254 @@ def integral_category(i, j, k, l):
         return "G"
 
 
+def integral_category_array(i, j, k, l) -> np.ndarray:
+    """`integral_category` for arrays of canonical indices
+    >>> idx = np.array([(1, 1, 1, 1), (1, 2, 1, 3), (1, 1, 2, 2), (1, 2, 3, 4)])
+    >>> integral_category_array(*idx.T)
+    array(['A', 'C', 'F', 'G'], dtype='<U1')
+    """
+    conditions = [
+        i == l,
+        (i == k) & (j == l),
+        ((i == k) | (j == l)) & (j == k),
+        (i == k) | (j == l),
+        j == k,
+        (i == j) & (k == l),
+        (i == j) | (k == l),
+    ]
+    return np.select(conditions, ["A", "B", "D", "C", "E", "F", "E"], default="G")
+
+
+def symmetry_allowed_array(irreps: np.ndarray, i, j, k, l) -> np.ndarray:
+    """Can the integrals <ij|kl> be non-zero by symmetry: is the product (XOR, see
+    `Determinant.irrep`) of the irreps of their orbitals the totally symmetric one?
+    >>> irreps = np.array([0, 0, 1, 1])
+    >>> symmetry_allowed_array(irreps, *np.array([(0, 2, 0, 3), (0, 1, 1, 2)]).T)
+    array([ True, False])
+    """
+    return (irreps[i] ^ irreps[j] ^ irreps[k] ^ irreps[l]) == 0
+
+
+# ~
+# Node-level shared integrals
+# ~
+# A pickled `comm.bcast` of the integrals gives every rank its private copy.
+# Instead, the ranks of a node map the same MPI-3 shared window, filled by the node leader;
+# only the leaders take part in the broadcast, as a raw buffer.
+
+
+def bcast_integrals_shared(
+    comm, n_orb, E0, d_one_e_integral, d_two_e_integral: Two_electron_integral_packed, root=0
+):
+    """Broadcast the integrals loaded on `root` (`n_orb`, ... are ignored on the other ranks).
+    Returns (n_orb, E0, d_one_e_integral, d_two_e_integral) with d_two_e_integral a
+    |Two_electron_integral_packed| whose data lives in a window shared by the ranks of the node.
+    The window is kept as `d_two_e_integral.win`: free it with `d_two_e_integral.close()`
+    (collectively, once nothing uses the integrals anymore), or use them as a context manager."""
+    # The one-electron integrals are tiny, they can be pickled
+    n_orb, E0, d_one_e_integral = comm.bcast((n_orb, E0, d_one_e_integral), root)
+
+    # Ranks are ordered starting from root, so that root leads its node and the leaders
+    key = (comm.rank - root) % comm.size
+    node_comm = comm.Split_type(MPI.COMM_TYPE_SHARED, key=key)
+    is_leader = node_comm.rank == 0
+    leader_comm = comm.Split(0 if is_leader else MPI.UNDEFINED, key=key)
+
+    n_pair = (n_orb * (n_orb + 1)) // 2
+    size = (n_pair * (n_pair + 1)) // 2
+    itemsize = MPI.DOUBLE.Get_size()
+    win = MPI.Win.Allocate_shared(size * itemsize if is_leader else 0, itemsize, comm=node_comm)
+    buf, _ = win.Shared_query(0)
+    data = np.ndarray(buffer=buf, dtype=np.float64, shape=(size,))
+
+    if is_leader:
+        if comm.rank == root:
+            data[:] = d_two_e_integral.data
+        # Chunked, so that counts stay below 2**31
+        chunk = 1 << 27
+        for start in range(0, size, chunk):
+            leader_comm.Bcast(data[start : start + chunk], root=0)
+        leader_comm.Free()
+    node_comm.Barrier()
+    # (The window holds its own reference to the group)
+    node_comm.Free()
+
+    d_two_e_integral = Two_electron_integral_packed(n_orb, data)
+    d_two_e_integral.win = win
+    return n_orb, E0, d_one_e_integral, d_two_e_integral
+
+
+def bcast_wf(comm, psi_coef, psi_det: Psi_det_packed, root=0):
+    """Broadcast a wave function loaded on `root` (e.g. by `qe.io.read_wf_packed`; the arguments
+    are ignored on the other ranks). Returns (psi_coef, psi_det), a numpy vector and a
+    |Psi_det_packed|: the coefficients and the words go as raw buffers,
+    instead of a pickled list of |Determinant|."""
+    shape = comm.bcast(psi_det.alpha.shape if comm.rank == root else None, root)
+    if comm.rank != root:
+        psi_coef = np.empty(shape[0], dtype=np.float64)
+        psi_det = Psi_det_packed(np.empty(shape, dtype=np.uint64), np.empty(shape, dtype=np.uint64))
+    comm.Bcast([psi_coef, MPI.DOUBLE], root=root)
+    comm.Bcast([psi_det.alpha, MPI.UINT64_T], root=root)
+    comm.Bcast([psi_det.beta, MPI.UINT64_T], root=root)
+    return psi_coef, psi_det
+
+
+# ~
+# Intra-rank parallelism
+# ~
+# The workers are forked processes: they share the inputs of the rank (integrals, determinants,
+# cached drivers...) copy-on-write, and never call MPI. Each worker fills its own buffers, which
+# are returned to, and merged by, the rank (no locks).
+#
+# Forking a process after MPI_Init is only safe if the child never touches MPI, and with the
+# TCP / shared-memory transports. With RDMA transports (InfiniBand, Omni-Path; `pinned' memory
+# registered with the network card) fork() can corrupt the registered pages of the parent
+# (Open MPI warns about it, see `mpi_warn_on_fork'; some need e.g. RDMAV_FORK_SAFE=1).
+# So the workers are forked once, lazily, per pool (one per Hamiltonian_generator), and not
+# once per parallel loop; n_workers > 1 has to be asked for (`-n_workers').
+
+# In a worker: the copy of the owner of the pool (inherited at fork),
+# and (map number, per-item function) of the current map
+_worker_owner = None
+_worker_map = None
+
+
+def _init_worker(owner):
+    global _worker_owner
+    _worker_owner = owner
+    # (the workers start with an empty profiler: what the rank recorded is not theirs)
+    profiler.reset()
+
+
+def _run_worker_task(n_map, args_path, factory, index, item):
+    # The arguments of a map are loaded once per worker (closures can't be pickled, and the
+    # workers are forked before the map: the per-item function is made in the worker)
+    global _worker_map
+    if _worker_map is None or _worker_map[0] != n_map:
+        _worker_map = None  # (free the previous one first)
+        with open(args_path, "rb") as f:
+            args = pickle.load(f)
+        _worker_map = n_map, factory(_worker_owner, *args)
+    # What the worker records goes back with the result, to the profiler of the rank
+    return index, _worker_map[1](item), profiler.drain()
+
+
+class Worker_pool(object):
+    """
+    Pool of `n_workers' processes per MPI rank, to run a few fat ranks per node
+    (one copy of the integrals and of the determinants per rank, instead of per core).
+    n_workers == 1: everything runs in the rank itself.
+
+    The workers are forked at the first parallel `map', with a copy of `owner', and live until
+    `close' (a later `map' forks them again).
+
+    >>> list(Worker_pool(1, 10).map(lambda owner, k: lambda x: owner + k * x, (2,), range(4)))
+    [10, 12, 14, 16]
+    """
+
+    def __init__(self, n_workers=1, owner=None, prefetch=2):
+        self.n_workers = n_workers
+        self.owner = owner
+        # Number of items in flight, per worker
+        self.prefetch = prefetch
+        self.pool = None
+        self.n_maps = 0
+
+    @property
+    def parallel(self) -> bool:
+        # (Serial inside a worker: no nested pools)
+        return self.n_workers > 1 and not multiprocessing.current_process().daemon
+
+    def start(self):
+        # What the workers would all compute (e.g. the integral streams) is done once, before
+        if hasattr(self.owner, "prepare_workers"):
+            self.owner.prepare_workers()
+        context = multiprocessing.get_context("fork")
+        self.pool = context.Pool(self.n_workers, initializer=_init_worker, initargs=(self.owner,))
+
+    def close(self):
+        if self.pool is not None:
+            self.pool.close()
+            self.pool.join()
+            self.pool = None
+
+    def map(self, factory, args, items, ordered=True) -> Iterator:
+        """
+        f(item) for each item, with f = factory(owner, *args) (e.g. factory an unbound method
+        of the owner). In the workers, f is made from their copy of the owner, forked before:
+        factory has to be picklable (module-level function, or method), and args are pickled
+        (once per map). Anything collective needed by f (e.g. a cached_property doing MPI
+        calls) has to be computed by the rank, and given in args.
+
+        Items are fetched by the rank (so that they can come from MPI, e.g.
+        `dynamic_constraints') as the workers are done with the previous ones, with at most
+        `prefetch' * n_workers of them in flight: a slow item doesn't stall the others.
+        They should be small (e.g. indices, constraints): the data goes in args.
+        Results are in order if `ordered', else as soon as they are ready.
+        """
+        if not self.parallel:
+            yield from map(factory(self.owner, *args), items)
+            return
+        if self.pool is None:
+            self.start()
+        self.n_maps += 1
+        with tempfile.NamedTemporaryFile(prefix="qe_worker_args_", delete=False) as f:
+            pickle.dump(args, f, protocol=pickle.HIGHEST_PROTOCOL)
+        # (Results, and errors, are queued by the result thread of the pool)
+        done = queue.SimpleQueue()
+        items = enumerate(items)
+        n_in_flight, ready, next_index = 0, {}, 0
+
+        def submit(n):
+            # Hand (up to) n more items to the pool; return how many
+            n_submitted = 0
+            for index, item in islice(items, n):
+                task = (self.n_maps, f.name, factory, index, item)
+                self.pool.apply_async(
+                    _run_worker_task, task, callback=done.put, error_callback=done.put
+                )
+                n_submitted += 1
+            return n_submitted
+
+        try:
+            n_in_flight += submit(self.prefetch * self.n_workers)
+            while n_in_flight:
+                result = done.get()
+                if isinstance(result, BaseException):
+                    raise result
+                index, value, stats = result
+                profiler.merge(stats)
+                # A slot is free
+                n_in_flight += submit(1) - 1
+                if not ordered:
+                    yield value
+                    continue
+                ready[index] = value
+                while next_index in ready:
+                    yield ready.pop(next_index)
+                    next_index += 1
+        finally:
+            os.unlink(f.name)
+
+
+@dataclass(frozen=True)
+class Det_range(object):
+    """Determinants [begin, end) of the list `name' ("psi_local", "psi_internal") of a
+    Hamiltonian_generator. What goes in the args of `Worker_pool.map' instead of the
+    determinants themselves: the workers already have them (forked with the generator).
+    >>> from types import SimpleNamespace
+    >>> Det_range("psi_internal", 1, 3).of(SimpleNamespace(psi_internal=list("abcd")))
+    ['b', 'c']
+    """
+
+    name: str
+    begin: int = 0
+    end: int = None
+
+    def of(self, owner) -> Psi_det:
+        return getattr(owner, self.name)[self.begin : self.end]
+
+
 #   _   _                 _ _ _              _
 #  | | | |               (_) | |            (_)
 #  | |_| | __ _ _ __ ___  _| | |_ ___  _ __  _  __ _ _ __
@@ -87,6 +356,21 @@ def integral_category(i, j, k, l):
 #  \_| |_/\__,_|_| |_| |_|_|_|\__\___/|_| |_|_|\__,_|_| |_|
 #
 
+
+def occupation_matrix(psi: Psi_det, spin: str, n_orb: int) -> np.ndarray:
+    """(len(psi) x n_orb) matrix of the occupation numbers of the `spin` orbitals
+    >>> occupation_matrix([Determinant((0, 2), ()), Determinant((1,), (0,))], "alpha", 3)
+    array([[1., 0., 1.],
+           [0., 1., 0.]])
+    """
+    sdets = [getattr(det, spin) for det in psi]
+    counts = np.fromiter(map(len, sdets), dtype=np.int64, count=len(sdets))
+    orbitals = np.fromiter(chain.from_iterable(sdets), dtype=np.int64, count=int(counts.sum()))
+    A = np.zeros((len(sdets), n_orb))
+    A[np.repeat(np.arange(len(sdets)), counts), orbitals] = 1.0
+    return A
+
+
 #    _             _
 #   / \ ._   _    |_ |  _   _ _|_ ._ _  ._
 #   \_/ | | (/_   |_ | (/_ (_  |_ | (_) | |
@@ -113,6 +397,13 @@ class Hamiltonian_one_electron(object):
         res += sum(self.H_ij_orbital(i, i) for i in det_i.beta)
         return res
 
+    def H_ii_occupation(self, A: np.ndarray, B: np.ndarray) -> np.ndarray:
+        """Diagonal elements of many determinants at once,
+        from their alpha (A) and beta (B) occupation matrices"""
+        # `get` doesn't insert the missing keys of a defaultdict
+        h = np.array([self.integrals.get((i, i), 0.0) for i in range(A.shape[1])])
+        return self.E0 + A @ h + B @ h
+
     def H_ij(self, det_i: Determinant, det_j: Determinant) -> Energy:
         """General function to dispatch the evaluation of H_ij"""
 
@@ -134,9 +425,57 @@ class Hamiltonian_one_electron(object):
         else:
             return 0.0
 
+    def H_indices(
+        self, psi_i: Psi_det, psi_j: Psi_det
+    ) -> Iterator[Tuple[Tuple[int, int], Energy]]:
+        """Generate the non-zero one-electron <I|H|J>, I in psi_i and J in psi_j, as ((a, b), H_ij).
+        Connectivity-driven: only the diagonal and the single excitations allowed by
+        the non-zero off-diagonal integrals are visited (instead of all the (I, J) pairs).
+
+        >>> h = Hamiltonian_one_electron({(0, 0): 1.0, (1, 1): 2.0, (0, 1): 0.5, (1, 0): 0.5}, 10.0)
+        >>> psi = [Determinant((0,), ()), Determinant((1,), ())]
+        >>> sorted(h.H_indices(psi, psi))
+        [((0, 0), 11.0), ((0, 1), 0.5), ((1, 0), 0.5), ((1, 1), 12.0)]
+        >>> sorted(h.H_indices(psi[:1], psi[1:]))
+        [((0, 0), 0.5)]
+        """
+        generator = H_indices_generator(psi_i, psi_j)
+        spindet_a_occ_i, spindet_b_occ_i = generator.spindet_occ_int
+        det_to_index_j = generator.det_to_index
+
+        # Diagonal
+        for a, det_i in enumerate(psi_i):
+            b = det_to_index_j.get(det_i)
+            if b is not None:
+                yield (a, b), self.H_ii(det_i)
+
+        # Singles h -> p. For real orbitals, both (h, p) and (p, h) are stored in the dict.
+        # Take a copy of the items, `H_ii` may add keys when integrals is a defaultdict
+        for (h, p), integral in list(self.integrals.items()):
+            if h == p or not integral:
+                continue
+            for spindet_occ, spin in ((spindet_a_occ_i, "alpha"), (spindet_b_occ_i, "beta")):
+                # Candidates are occupied in h and empty in p
+                det_indices = (
+                    Hamiltonian_two_electrons_integral_driven.get_dets_via_orbital_occupancy(
+                        spindet_occ, {}, {"same": {h}}, {"same": {p}}
+                    )
+                )
+                for a in det_indices:
+                    det_i = psi_i[a]
+                    if spin == "alpha":
+                        excited_det = det_i.apply_excitation(((h,), (p,)), ((), ()))
+                    else:
+                        excited_det = det_i.apply_excitation(((), ()), ((h,), (p,)))
+                    b = det_to_index_j.get(excited_det)
+                    if b is not None:
+                        yield (a, b), integral * det_i.single_phase(h, p, spin)
+
     def H(self, psi_i, psi_j) -> List[List[Energy]]:
-        h = np.array([self.H_ij(det_i, det_j) for det_i, det_j in product(psi_i, psi_j)])
-        return h.reshape(len(psi_i), len(psi_j))
+        h = np.zeros(shape=(len(psi_i), len(psi_j)))
+        for (a, b), matrix_elt in self.H_indices(psi_i, psi_j):
+            h[a, b] += matrix_elt
+        return h
 
 
 #   _   _                 _ _ _              _
@@ -169,6 +508,14 @@ class Hamiltonian_two_electrons(object):
         key = compound_idx4(i, j, k, l)
         return self.d_two_e_integral[key]
 
+    def H_ijkl_orbitals(self, i, j, k, l) -> np.ndarray:
+        """`H_ijkl_orbital` for arrays of orbital indices.
+        One numpy gather with the packed integrals, a loop over the keys with a dictionary."""
+        if isinstance(self.d_two_e_integral, Two_electron_integral_packed):
+            return self.d_two_e_integral.gather(i, j, k, l)
+        keys = compound_idx4_array(i, j, k, l).tolist()
+        return np.array([self.d_two_e_integral.get(key, 0.0) for key in keys], dtype=float)
+
     @staticmethod
     def H_ii_indices(det_i: Determinant) -> Iterator[Two_electron_integral_index_phase]:
         """Diagonal element of the Hamiltonian : <I|H|I>.
@@ -189,11 +536,43 @@ class Hamiltonian_two_electrons(object):
 
     @cached_property
     def N_orb(self):
+        if isinstance(self.d_two_e_integral, Two_electron_integral_packed):
+            return self.d_two_e_integral.n_orb
         key = max(self.d_two_e_integral)
         return max(compound_idx4_reverse(key)) + 1
 
+    @cached_property
+    def coulomb_exchange(self) -> Tuple[np.ndarray, np.ndarray]:
+        """(N_orb x N_orb) Coulomb J_ij = <ij|ij> and exchange K_ij = <ij|ji> integrals,
+        the only ones needed by the diagonal elements.
+        Screened like the rest of the integrals by the drivers which have an `eps`, so that the
+        diagonal (D_i, the PT2 denominators) and the off-diagonal part of H see the same ones"""
+        i, j = np.indices((self.N_orb, self.N_orb)).reshape(2, -1)
+        J = self.H_ijkl_orbitals(i, j, i, j).reshape(self.N_orb, self.N_orb)
+        K = self.H_ijkl_orbitals(i, j, j, i).reshape(self.N_orb, self.N_orb)
+        eps = getattr(self, "eps", 0.0)
+        if eps:
+            J = np.where(np.abs(J) >= eps, J, 0.0)
+            K = np.where(np.abs(K) >= eps, K, 0.0)
+        return J, K
+
     def H_ii(self, det_i: Determinant):
-        return sum(phase * self.H_ijkl_orbital(*idx) for idx, phase in self.H_ii_indices(det_i))
+        A = occupation_matrix([det_i], "alpha", self.N_orb)
+        B = occupation_matrix([det_i], "beta", self.N_orb)
+        return self.H_ii_occupation(A, B)[0]
+
+    def H_ii_occupation(self, A: np.ndarray, B: np.ndarray) -> np.ndarray:
+        """Diagonal elements of many determinants at once,
+        from their alpha (A) and beta (B) occupation matrices.
+            same spin pairs: 1/2 sum_ij n_i n_j (J_ij - K_ij)  (J_ii = K_ii, so i == j cancels)
+            opposite spins:      sum_ij n_i m_j  J_ij
+        """
+        J, K = self.coulomb_exchange
+        JmK = J - K
+        E = 0.5 * ((A @ JmK) * A).sum(axis=1)
+        E += 0.5 * ((B @ JmK) * B).sum(axis=1)
+        E += ((A @ J) * B).sum(axis=1)
+        return E
 
 
 #   ___            _
@@ -211,9 +590,10 @@ class Hamiltonian_two_electrons_determinant_driven(Hamiltonian_two_electrons, ob
 
     @staticmethod
     def H_ij_indices(
-        det_i: Determinant, det_j: Determinant
+        det_i: Determinant, det_j: Determinant, exc_degree: Tuple[int, int] = None
     ) -> Iterator[Two_electron_integral_index_phase]:
-        """General function to dispatch the evaluation of H_ij"""
+        """General function to dispatch the evaluation of H_ij
+        `exc_degree` can be given when already known (from the screening of `H_indices`)"""
 
         def H_ij_single_indices(
             sdet_i: Tuple[OrbitalIdx, ...],
@@ -251,7 +631,7 @@ class Hamiltonian_two_electrons_determinant_driven(Hamiltonian_two_electrons, ob
 
             yield (h1, h2, p1, p2), phaseA * phaseB
 
-        ed_up, ed_dn = det_i.exc_degree(det_j)
+        ed_up, ed_dn = det_i.exc_degree(det_j) if exc_degree is None else exc_degree
         # Same determinant -> Diagonal element
         if (ed_up, ed_dn) == (0, 0):
             yield from Hamiltonian_two_electrons_determinant_driven.H_ii_indices(det_i)
@@ -273,10 +653,21 @@ class Hamiltonian_two_electrons_determinant_driven(Hamiltonian_two_electrons, ob
     def H_indices(
         psi_internal: Psi_det, psi_j: Psi_det
     ) -> Iterator[Two_electron_integral_index_phase]:
-        for a, det_i in enumerate(psi_internal):
-            for b, det_j in enumerate(psi_j):
+        # (With workers, each one is given its own rows of psi_internal: the pairs are screened
+        # once, see `Hamiltonian_generator.H_i_matrix_elements_worker')
+        if not (psi_internal and psi_j):
+            return
+        # Screen all the pairs at once, only the connected ones go through the Slater-Condon rules
+        n_orb = 1 + max(
+            max(chain(det.alpha, det.beta), default=0) for det in chain(psi_internal, psi_j)
+        )
+        connected_pairs = Psi_det_packed.from_psi_det(psi_internal, n_orb).connected_pairs(
+            Psi_det_packed.from_psi_det(psi_j, n_orb)
+        )
+        for exc_degree, (A, B) in connected_pairs.items():
+            for a, b in zip(A.tolist(), B.tolist()):
                 for idx, phase in Hamiltonian_two_electrons_determinant_driven.H_ij_indices(
-                    det_i, det_j
+                    psi_internal[a], psi_j[b], exc_degree
                 ):
                     yield (a, b), idx, phase
 
@@ -288,6 +679,69 @@ class Hamiltonian_two_electrons_determinant_driven(Hamiltonian_two_electrons, ob
         return h
 
 
+@dataclass
+class Hamiltonian_two_electrons_compiled(Hamiltonian_two_electrons_determinant_driven, object):
+    """Determinant-driven, with the matrix elements of all the connected pairs computed by one
+    compiled loop (`qe.compiled`, Numba when available) over packed determinants and integrals,
+    instead of one generator step per integral. The Python implementations stay the reference.
+    Integrals with |<ij|kl>| < eps are dropped (like `Hamiltonian_two_electrons_integral_driven`)
+
+    This is *not* a compiled version of the integral-driven categories (`category_A`..`G`):
+    like the determinant-driven driver, every (I, J) pair of the block is screened
+    (`Psi_det_packed.connected_pairs`, O(len(psi_i) x len(psi_j)) popcounts), only the
+    Slater-Condon rules of the connected pairs are compiled. In PT2 the external determinants
+    are the determinant-driven constrained excitations; only their <I|H|J> are compiled.
+    """
+
+    d_two_e_integral: Two_electron_integral
+    eps: float = 0.0
+
+    def __post_init__(self):
+        if not HAS_NUMBA:
+            warnings.warn(
+                "numba is not installed: the `compiled' two-electron loop runs as plain Python"
+                " (orders of magnitude slower); pip install -r requirements-compiled.txt"
+            )
+
+    @cached_property
+    def packed_integrals(self) -> np.ndarray:
+        """`Two_electron_integral_packed.data` (converted from a dictionary if needed), screened"""
+        d = self.d_two_e_integral
+        if not isinstance(d, Two_electron_integral_packed):
+            d = Two_electron_integral_packed.from_dict(d, self.N_orb)
+        if self.eps:
+            return np.where(np.abs(d.data) >= self.eps, d.data, 0.0)
+        return d.data
+
+    def pair_elements(self, packed_i: Psi_det_packed, packed_j: Psi_det_packed, I, J) -> np.ndarray:
+        """Two-electron <I|H|J> for the pairs of determinants (packed_i[I], packed_j[J])"""
+        I, J = np.asarray(I, dtype=np.int64), np.asarray(J, dtype=np.int64)
+        out = np.zeros(len(I), dtype="float")
+        two_electron_pair_elements(
+            *(np.ascontiguousarray(w).view(np.int64) for w in (packed_i.alpha, packed_i.beta)),
+            *(np.ascontiguousarray(w).view(np.int64) for w in (packed_j.alpha, packed_j.beta)),
+            I,
+            J,
+            self.packed_integrals,
+            self.N_orb,
+            out,
+        )
+        return out
+
+    def H_matrix_elements(self, psi_i: Psi_det, psi_j: Psi_det):
+        """Two-electron part of the (psi_i x psi_j) block of H, in COO format
+        (with workers, each one is given its own rows of psi_i, like `H_indices')
+
+        :return rows, cols, values: numpy arrays
+        """
+        packed_i = Psi_det_packed.from_psi_det(psi_i, self.N_orb)
+        packed_j = Psi_det_packed.from_psi_det(psi_j, self.N_orb)
+        pairs = packed_i.connected_pairs(packed_j).values()
+        I = np.concatenate([np.zeros(0, dtype=np.int64)] + [A for A, _ in pairs])
+        J = np.concatenate([np.zeros(0, dtype=np.int64)] + [B for _, B in pairs])
+        return I, J, self.pair_elements(packed_i, packed_j, I, J)
+
+
 #   ___            _
 #    |       _    |_ |  _   _ _|_ ._ _  ._   _
 #    | \/\/ (_)   |_ | (/_ (_  |_ | (_) | | _>
@@ -300,6 +754,52 @@ class Hamiltonian_two_electrons_determinant_driven(Hamiltonian_two_electrons, ob
 @dataclass
 class Hamiltonian_two_electrons_integral_driven(Hamiltonian_two_electrons, object):
     d_two_e_integral: Two_electron_integral
+    # Integrals smaller than `eps` (in absolute value) are skipped
+    eps: float = 0.0
+    # Irreps of the orbitals (from 0, see `Determinant.irrep`): the integrals which are zero
+    # by symmetry are skipped too, so are the excitations they would generate
+    irreps: Tuple[int, ...] = None
+
+    @cached_property
+    def screened_integrals(self) -> Tuple[np.ndarray, np.ndarray, int]:
+        """(n x 4) canonical (i, j, k, l) and values of the integrals with |<ij|kl>| >= eps,
+        and the number of non-zero integrals which were dropped (the ones which are only
+        numerical noise by symmetry aren't counted)"""
+        if isinstance(self.d_two_e_integral, Two_electron_integral_packed):
+            idx = np.stack(self.d_two_e_integral.nonzero_idx4_reverse, axis=1)
+            values = self.d_two_e_integral.data[self.d_two_e_integral.nonzero_idx4]
+        else:
+            n = len(self.d_two_e_integral)
+            idx4 = np.fromiter(self.d_two_e_integral.keys(), dtype=np.int64, count=n)
+            values = np.fromiter(self.d_two_e_integral.values(), dtype="float", count=n)
+            idx = np.stack(compound_idx4_reverse_array(idx4), axis=1).reshape(-1, 4)
+        nonzero = values != 0.0
+        if self.irreps is not None:
+            nonzero &= symmetry_allowed_array(np.array(self.irreps), *idx.T)
+        keep = nonzero & (np.abs(values) >= self.eps)
+        n_dropped = int(np.count_nonzero(nonzero) - np.count_nonzero(keep))
+        return idx[keep], values[keep], n_dropped
+
+    @cached_property
+    def category_streams(self) -> Dict[str, Tuple[np.ndarray, np.ndarray]]:
+        """{category: (indices, values)} of the screened integrals, bucketed once for all
+        so that the loops over the integrals don't have to reverse and classify each of them.
+        (n x 4) int64 canonical indices and float64 values: contiguous slices of one array
+        sorted by category (no Python object per integral, and pages that the forked workers
+        keep sharing); the loops convert them a chunk at a time (`iter_rows`)"""
+        idx, values, _ = self.screened_integrals
+        categories = integral_category_array(*idx.T)
+        order = np.argsort(categories, kind="stable")
+        idx, values = idx[order], values[order]
+        bounds = np.searchsorted(categories[order], list("ABCDEFGH"))
+        return {
+            category: (idx[begin:end], values[begin:end])
+            for category, begin, end in zip("ABCDEFG", bounds[:-1], bounds[1:])
+        }
+
+    @property
+    def n_screened_integrals(self) -> int:
+        return self.screened_integrals[2]
 
     @staticmethod
     def get_dets_occ_in_orbitals(
@@ -322,6 +822,12 @@ class Hamiltonian_two_electrons_integral_driven(Hamiltonian_two_electrons, objec
                 l += [spindet_occ[o] for o in indices]
             if spintype == "opposite":
                 l += [oppspindet_occ[o] for o in indices]
+        if l and isinstance(l[0], np.ndarray):
+            # |Spin_string_index|: sorted arrays of determinant indices
+            if which_orbitals == "all":
+                return reduce(partial(np.intersect1d, assume_unique=True), l)
+            else:
+                return reduce(np.union1d, l)
         if which_orbitals == "all":
             return set.intersection(*l)
         else:
@@ -343,11 +849,16 @@ class Hamiltonian_two_electrons_integral_driven(Hamiltonian_two_electrons, objec
         {0}
         """
 
-        det_indices = Hamiltonian_two_electrons_integral_driven.get_dets_occ_in_orbitals(
+        occupied = Hamiltonian_two_electrons_integral_driven.get_dets_occ_in_orbitals(
             spindet_occ, oppspindet_occ, d_occupied, "all"
-        ) - Hamiltonian_two_electrons_integral_driven.get_dets_occ_in_orbitals(
+        )
+        unoccupied = Hamiltonian_two_electrons_integral_driven.get_dets_occ_in_orbitals(
             spindet_occ, oppspindet_occ, d_unoccupied, "any"
         )
+        if isinstance(occupied, np.ndarray):
+            det_indices = np.setdiff1d(occupied, unoccupied, assume_unique=True).tolist()
+        else:
+            det_indices = occupied - unoccupied
 
         # if len(det_indices) == 0, `set()` is returned
         return det_indices
@@ -1847,44 +2358,24 @@ class Hamiltonian_two_electrons_integral_driven(Hamiltonian_two_electrons, objec
             )
 
     def H_indices(
-        self, psi_i: Psi_det, psi_j: Psi_det
+        self, psi_i: Psi_det, psi_j: Psi_det, worker=0, n_workers=1
     ) -> Iterator[Two_electron_integral_index_phase]:
         # Returns H_indices, and idx of associated integral
+        # (`worker' only goes through its share, 1 / n_workers, of each integral stream)
         generator = H_indices_generator(psi_i, psi_j)
         spindet_a_occ_i, spindet_b_occ_i = generator.spindet_occ_int
         det_to_index_j = generator.det_to_index
-        for idx4, _ in self.d_two_e_integral.items():
-            idx = compound_idx4_reverse(idx4)
-            for (
-                (a, b),
-                phase,
-            ) in self.H_indices_idx(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i):
-                yield (a, b), idx, phase
-
-    def H_indices_idx(
-        self,
-        idx: Two_electron_integral_index,
-        psi_i: Psi_det,
-        det_to_index_j: Dict[OrbitalIdx, int],
-        spindet_a_occ_i: Dict[OrbitalIdx, Set[int]],
-        spindet_b_occ_i: Dict[OrbitalIdx, Set[int]],
-    ) -> Iterator[Two_electron_integral_index_phase]:
-        # Call to get indices of determinant pairs + associated phase for a given integral idx
-        category = integral_category(*idx)
-        if category == "A":
-            yield from self.category_A(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i)
-        if category == "B":
-            yield from self.category_B(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i)
-        if category == "C":
-            yield from self.category_C(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i)
-        if category == "D":
-            yield from self.category_D(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i)
-        if category == "E":
-            yield from self.category_E(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i)
-        if category == "F":
-            yield from self.category_F(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i)
-        if category == "G":
-            yield from self.category_G(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i)
+        for category, (indices, _) in self.category_streams.items():
+            category_function = getattr(self, f"category_{category}")
+            indices, n_emitted = indices[worker::n_workers], 0
+            for idx in iter_rows(indices):
+                for (a, b), phase in category_function(
+                    idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i
+                ):
+                    n_emitted += 1
+                    yield (a, b), idx, phase
+            profiler.count(f"H integrals visited, category {category}", len(indices))
+            profiler.count(f"H elements emitted, category {category}", n_emitted)
 
     def H_indices_pt2(
         self, psi_i: Psi_det, C: Tuple[OrbitalIdx, ...]
@@ -1893,48 +2384,18 @@ class Hamiltonian_two_electrons_integral_driven(Hamiltonian_two_electrons, objec
         # For pt2 selection!
         generator = H_indices_generator(psi_i)
         spindet_a_occ_i, spindet_b_occ_i = generator.spindet_occ_int
-        for idx4, _ in self.d_two_e_integral.items():
-            idx = compound_idx4_reverse(idx4)
-            for (
-                (I, det_J),
-                phase,
-            ) in self.H_indices_idx_pt2(idx, psi_i, C, spindet_a_occ_i, spindet_b_occ_i):
-                yield (I, det_J), idx, phase
-
-    def H_indices_idx_pt2(
-        self,
-        idx: Two_electron_integral_index,
-        psi_i: Psi_det,
-        C: Tuple[OrbitalIdx, ...],
-        spindet_a_occ_i,
-        spindet_b_occ_i,
-    ) -> Iterator[Two_electron_integral_index_phase]:
-        # Call to get indices of determinant pairs + associated phase for a given integral idx
-        category = integral_category(*idx)
-        if category == "A":
-            pass
-        if category == "B":
-            pass
-        if category == "C":
-            yield from self.category_C_pt2(
-                idx, psi_i, C, spindet_a_occ_i, spindet_b_occ_i, self.N_orb
-            )
-        if category == "D":
-            yield from self.category_D_pt2(
-                idx, psi_i, C, spindet_a_occ_i, spindet_b_occ_i, self.N_orb
-            )
-        if category == "E":
-            yield from self.category_E_pt2(
-                idx, psi_i, C, spindet_a_occ_i, spindet_b_occ_i, self.N_orb
-            )
-        if category == "F":
-            yield from self.category_F_pt2(
-                idx, psi_i, C, spindet_a_occ_i, spindet_b_occ_i, self.N_orb
-            )
-        if category == "G":
-            yield from self.category_G_pt2(
-                idx, psi_i, C, spindet_a_occ_i, spindet_b_occ_i, self.N_orb
-            )
+        # Categories A and B only contribute to the diagonal
+        for category in "CDEFG":
+            category_function = getattr(self, f"category_{category}_pt2")
+            indices, n_emitted = self.category_streams[category][0], 0
+            for idx in iter_rows(indices):
+                for (I, det_J), phase in category_function(
+                    idx, psi_i, C, spindet_a_occ_i, spindet_b_occ_i, self.N_orb
+                ):
+                    n_emitted += 1
+                    yield (I, det_J), idx, phase
+            profiler.count(f"PT2 integrals visited, category {category}", len(indices))
+            profiler.count(f"PT2 elements emitted, category {category}", n_emitted)
 
     def H(self, psi_i, psi_j) -> List[List[Energy]]:
         generator = H_indices_generator(psi_i, psi_j)
@@ -1942,16 +2403,102 @@ class Hamiltonian_two_electrons_integral_driven(Hamiltonian_two_electrons, objec
         det_to_index_j = generator.det_to_index
         # This is the function who will take foreever
         h = np.zeros(shape=(len(psi_i), len(psi_j)))
-        for idx4, integral_values in self.d_two_e_integral.items():
-            idx = compound_idx4_reverse(idx4)
-            for (
-                (a, b),
-                phase,
-            ) in self.H_indices_idx(idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i):
-                h[a, b] += phase * integral_values
+        for category, (indices, values) in self.category_streams.items():
+            category_function = getattr(self, f"category_{category}")
+            for idx, integral_values in zip(iter_rows(indices), iter_rows(values)):
+                for (a, b), phase in category_function(
+                    idx, psi_i, det_to_index_j, spindet_a_occ_i, spindet_b_occ_i
+                ):
+                    h[a, b] += phase * integral_values
         return h
 
 
+def iter_rows(array: np.ndarray, chunk_size=1 << 12) -> Iterator:
+    """Items of a 1D array, rows (as tuples) of a 2D one; converted to Python a chunk at a time
+    >>> list(iter_rows(np.arange(6).reshape(3, 2), chunk_size=2))
+    [(0, 1), (2, 3), (4, 5)]
+    >>> list(iter_rows(np.array([0.5, 1.5])))
+    [0.5, 1.5]
+    """
+    for begin in range(0, len(array), chunk_size):
+        chunk = array[begin : begin + chunk_size].tolist()
+        yield from map(tuple, chunk) if array.ndim == 2 else chunk
+
+
+def expand_ranges(starts: np.ndarray, lengths: np.ndarray) -> np.ndarray:
+    """Concatenation of the ranges [start, start + length)
+    >>> expand_ranges(np.array([10, 0, 5]), np.array([2, 0, 3]))
+    array([10, 11,  5,  6,  7])
+    """
+    offsets = np.repeat(np.cumsum(lengths) - lengths, lengths)
+    return np.repeat(starts, lengths) + np.arange(lengths.sum()) - offsets
+
+
+class Spin_string_index(object):
+    """Index of one spin part (alpha or beta) of a list of determinants, factorized by spin strings
+    (the `helper lists' of selected CI codes). Everything is stored in CSR arrays:
+
+      - `strings`: the unique spin determinants; `string_of_det[I]` is the string of determinant I
+      - `dets_of_string(s)`: sorted indices of the determinants whose spin part is the string s
+      - `[o]`: sorted indices of the determinants occupied in orbital o. This is the same as
+        the `Dict[OrbitalIdx, Set[int]]` occupancy maps, so set operations per integral
+        become `np.intersect1d` / `np.setdiff1d` of contiguous slices.
+
+    >>> index = Spin_string_index([Determinant((0, 1), (0,)), Determinant((0, 2), (0,)),
+    ...                            Determinant((0, 1), (1,))], "alpha")
+    >>> index.strings
+    [(0, 1), (0, 2)]
+    >>> index.dets_of_string(0), index[1], index[3]
+    (array([0, 2]), array([0, 2]), array([], dtype=int64))
+    """
+
+    def __init__(self, psi: Psi_det, spin: str):
+        string_to_id = {}
+        self.string_of_det = np.fromiter(
+            (string_to_id.setdefault(getattr(det, spin), len(string_to_id)) for det in psi),
+            dtype=np.int64,
+            count=len(psi),
+        )
+        self.strings = list(string_to_id)
+        n_strings = len(self.strings)
+
+        # Determinants of each string
+        self.dets_of_string_indptr = np.zeros(n_strings + 1, dtype=np.int64)
+        np.cumsum(
+            np.bincount(self.string_of_det, minlength=n_strings),
+            out=self.dets_of_string_indptr[1:],
+        )
+        self.dets_of_string_indices = np.argsort(self.string_of_det, kind="stable")
+
+        # Determinants occupied in each orbital: expand the (orbital, string) pairs
+        # with the determinants of the string
+        n_elec = np.fromiter(map(len, self.strings), dtype=np.int64, count=n_strings)
+        orbitals = np.fromiter(
+            chain.from_iterable(self.strings), dtype=np.int64, count=int(n_elec.sum())
+        )
+        strings = np.repeat(np.arange(n_strings), n_elec)
+        n_dets = np.diff(self.dets_of_string_indptr)[strings]
+        dets = self.dets_of_string_indices[
+            expand_ranges(self.dets_of_string_indptr[strings], n_dets)
+        ]
+        orbitals = np.repeat(orbitals, n_dets)
+        order = np.lexsort((dets, orbitals))
+        self.n_orb = int(orbitals.max()) + 1 if len(orbitals) else 0
+        self.dets_of_orbital_indptr = np.zeros(self.n_orb + 1, dtype=np.int64)
+        np.cumsum(np.bincount(orbitals, minlength=self.n_orb), out=self.dets_of_orbital_indptr[1:])
+        self.dets_of_orbital_indices = dets[order]
+
+    def __getitem__(self, o: OrbitalIdx) -> np.ndarray:
+        if o >= self.n_orb:
+            return self.dets_of_orbital_indices[:0]
+        begin, end = self.dets_of_orbital_indptr[o], self.dets_of_orbital_indptr[o + 1]
+        return self.dets_of_orbital_indices[begin:end]
+
+    def dets_of_string(self, s: int) -> np.ndarray:
+        begin, end = self.dets_of_string_indptr[s], self.dets_of_string_indptr[s + 1]
+        return self.dets_of_string_indices[begin:end]
+
+
 class H_indices_generator(object):
     """Generate and cache necessary utilities for building the
     two-electron Hamiltonian in an integral-driven fashion.
@@ -1979,7 +2526,7 @@ class H_indices_generator(object):
         set()
         """
 
-        # TODO: Implement bitstring rep
+        # Works for both representations (a |Spin_determinant_bitstring| iterates over its orbitals)
         # Can generate det_to_indices hash in here
         def get_dets_occ(psi_i: Psi_det, spin: str) -> Dict[OrbitalIdx, Set[int]]:
             ds = defaultdict(set)
@@ -1997,8 +2544,150 @@ class H_indices_generator(object):
 
     @cached_property
     def spindet_occ_int(self):
-        # Create and cache dictionaries mapping spin-orbital indices to determinants \in psi_i to associated indices
-        return self.get_spindet_a_occ_spindet_b_occ(self.psi_i)
+        # Create and cache the indices mapping spin-orbital indices to determinants \in psi_i
+        # (|Spin_string_index|, used as the dictionaries of `get_spindet_a_occ_spindet_b_occ`)
+        return tuple(Spin_string_index(self.psi_i, spin) for spin in ["alpha", "beta"])
+
+
+class Diagonal_engine(object):
+    """
+    Diagonal elements <J|H|J> of determinants generated from the internal ones (the Epstein-Nesbet
+    denominators of the PT2), from the diagonal of their generator |I> and the few orbitals whose
+    occupation changes.
+
+    With a, b the occupation numbers of |I>, d_a, d_b the changes of occupation (+1 on the
+    particles, -1 on the holes; at most 4 non-zero per spin) and M = J - K:
+        <J|H|J> - <I|H|I> = e_a . d_a + e_b . d_b + 1/2 d_a M d_a + 1/2 d_b M d_b + d_a J d_b
+    where e_a = h + M a + J b, e_b = h + M b + J a are the (Fock-like) orbital energies of |I>,
+    computed once per internal determinant. That's exact (the diagonal is quadratic in the
+    occupations), and O(1) per determinant instead of O(n_orb^2) (see `H_ii_occupation`).
+
+    :param h: diagonal of the one-electron integrals
+    :param J, K: Coulomb and exchange integrals (see `coulomb_exchange`)
+    :param D_internal: <I|H|I> for all the determinants of psi_internal
+    """
+
+    def __init__(self, h, J, K, psi_internal: Psi_det, D_internal, n_orb: int):
+        self.h, self.J, self.M = h, J, J - K
+        self.D_internal = D_internal
+        self.n_orb = n_orb
+        packed = Psi_det_packed.from_psi_det(psi_internal, n_orb)
+        self.occupation = {
+            "alpha": self.occupations(packed.alpha, n_orb),
+            "beta": self.occupations(packed.beta, n_orb),
+        }
+
+    @staticmethod
+    def occupations(words: np.ndarray, n_orb: int) -> np.ndarray:
+        """(len(words) x n_orb) occupation numbers of packed spin determinants
+        >>> Diagonal_engine.occupations(np.array([[5], [2]], dtype=np.uint64), 3)
+        array([[1, 0, 1],
+               [0, 1, 0]], dtype=int8)
+        """
+        bytes_ = np.ascontiguousarray(words, dtype="<u8").view(np.uint8)
+        return np.unpackbits(bytes_, axis=1, bitorder="little")[:, :n_orb].astype(np.int8)
+
+    @cached_property
+    def orbital_energies(self) -> Tuple[np.ndarray, np.ndarray]:
+        """(e_a, e_b), (len(psi_internal) x n_orb) each"""
+        A, B = self.occupation["alpha"], self.occupation["beta"]
+        return self.h + A @ self.M + B @ self.J, self.h + B @ self.M + A @ self.J
+
+    def H_jj(self, sources, psi_J: Psi_det) -> np.ndarray:
+        """<J|H|J> for each |J> of psi_J, generated from the internal determinant sources[J]"""
+        sources = np.asarray(sources, dtype=np.int64)
+        if not len(sources):
+            return np.zeros(0, dtype="float")
+        packed = Psi_det_packed.from_psi_det(psi_J, self.n_orb)
+        D = self.D_internal[sources].copy()
+        changes = []
+        for spin, e in zip(("alpha", "beta"), self.orbital_energies):
+            d = self.occupations(getattr(packed, spin), self.n_orb) - self.occupation[spin][sources]
+            # The orbitals whose occupation changes come first; keep (index, sign) of those
+            w = max(1, int(np.count_nonzero(d, axis=1).max()))
+            idx = np.argsort(d == 0, axis=1, kind="stable")[:, :w]
+            sign = np.take_along_axis(d, idx, axis=1).astype("float")
+            M = self.M[idx[:, :, None], idx[:, None, :]]
+            D += (e[sources[:, None], idx] * sign).sum(axis=1)
+            D += 0.5 * np.einsum("ku,kuv,kv->k", sign, M, sign)
+            changes.append((idx, sign))
+        (idx_a, sign_a), (idx_b, sign_b) = changes
+        J = self.J[idx_a[:, :, None], idx_b[:, None, :]]
+        D += np.einsum("ku,kuv,kv->k", sign_a, J, sign_b)
+        return D
+
+
+def representation_of(psi_det: Psi_det) -> str:
+    """"tuple" or "bitstring", the representation of the determinants of psi_det"""
+    return "bitstring" if isinstance(psi_det[0].alpha, int) else "tuple"
+
+
+def alpha_block_distribution(alpha: np.ndarray, world_size) -> np.ndarray:
+    """Number of determinants of each rank, for determinants grouped by alpha string (`alpha':
+    their alpha words, N_det x n_words; e.g. memory-mapped, see `qe.io.load_wf_binary_alpha').
+    The even split, with each boundary moved forward to the start of the next alpha string:
+    the determinants of an alpha string are on the same rank, so are their same-alpha
+    connections (the (0, 1) and (0, 2) excitations).
+
+    >>> alpha = np.array([[1], [1], [1], [2], [3], [3]], dtype=np.uint64)
+    >>> alpha_block_distribution(alpha, 2)
+    array([3, 3], dtype=int32)
+    >>> alpha_block_distribution(alpha, 3)
+    array([3, 1, 2], dtype=int32)
+    """
+    n_det = len(alpha)
+    bounds = [0]
+    for r in range(1, world_size):
+        b = max(r * n_det // world_size, bounds[-1])
+        while 0 < b < n_det and (alpha[b] == alpha[b - 1]).all():
+            b += 1
+        bounds.append(b)
+    bounds.append(n_det)
+    return np.diff(bounds).astype("i")
+
+
+class Halo_exchange(object):
+    """The rows of a row-distributed V (of the distributed determinants) that a rank needs
+    for H_i * V: the `columns' of the non-zeros of H_i, i.e. the determinants connected to the
+    local ones. Fetched from the ranks which have them, with one Alltoallv per product,
+    instead of gathering all of V. Who needs which local rows is exchanged once (collective).
+
+    :param columns: sorted global indices of the rows needed by this rank
+    :param offsets: first global row of each rank
+
+    >>> halo = Halo_exchange(MPI.COMM_SELF, np.array([0, 2]), np.array([0], dtype="i"))
+    >>> halo.exchange(np.array([[1.0], [2.0], [3.0]]))
+    array([[1.],
+           [3.]])
+    """
+
+    def __init__(self, comm, columns: np.ndarray, offsets: np.ndarray):
+        self.comm = comm
+        self.columns = columns
+        owners = np.searchsorted(offsets, columns, side="right") - 1
+        self.recv_counts = np.bincount(owners, minlength=len(offsets)).astype("i")
+        self.send_counts = np.zeros_like(self.recv_counts)
+        comm.Alltoall([self.recv_counts, MPI.INT], [self.send_counts, MPI.INT])
+        self.recv_displs = np.r_[0, np.cumsum(self.recv_counts)[:-1]].astype("i")
+        self.send_displs = np.r_[0, np.cumsum(self.send_counts)[:-1]].astype("i")
+        # The local rows each rank asks this one for
+        requested = (columns - offsets[owners]).astype(np.int64)
+        self.send_rows = np.zeros(self.send_counts.sum(), dtype=np.int64)
+        comm.Alltoallv(
+            [requested, self.recv_counts, self.recv_displs, MPI.INT64_T],
+            [self.send_rows, self.send_counts, self.send_displs, MPI.INT64_T],
+        )
+
+    def exchange(self, V_i: np.ndarray) -> np.ndarray:
+        """Rows `columns' of V (len(columns) x m), from the local rows V_i. Collective"""
+        m = V_i.shape[1]
+        send = np.ascontiguousarray(V_i[self.send_rows], dtype="float")
+        halo = np.zeros((len(self.columns), m), dtype="float")
+        self.comm.Alltoallv(
+            [send, m * self.send_counts, m * self.send_displs, MPI.DOUBLE],
+            [halo, m * self.recv_counts, m * self.recv_displs, MPI.DOUBLE],
+        )
+        return halo
 
 
 #   _   _                 _ _ _              _
@@ -2032,6 +2721,36 @@ class Hamiltonian_generator(object):
     :param d_one_e_integral: Dictionary of one-electorn integrals
     :param d_two_e_integral: Dictionary of two-electorn integrals
     :param driven_by: generate H in a an integral/determinant-driven fashion.
+    :param integral_eps: integral-driven only, two-electron integrals with |<ij|kl>| < integral_eps
+                         are dropped (`Hamiltonian_2e_driver.n_screened_integrals` counts them).
+    :param memory_budget: bytes allowed per rank for the cached matrix elements of H_i.
+                          None (default): all of H_i is cached (`H_i_sparse`). Otherwise, H_i is
+                          split in blocks of `row_block_size` rows and only the blocks that fit are
+                          cached, the others are recomputed at each product (see `memory_report`).
+    :param n_workers: number of processes of this rank (see `Worker_pool`) for the matrix elements
+                      and the PT2: the two-electron integral streams (integral-driven) or the
+                      connected pairs (determinant-driven) are split between them.
+    :param backend: where the Davidson solves run (see `Array_backend`): "numpy" (host),
+                    or "cupy" (GPU; H_i and the trial vectors stay on the device)
+    :param det_storage: "replicated" (default): `psi_internal` is the whole wave function, on
+                        every rank. "distributed": `psi_internal` is only the block of this rank
+                        (`psi_local`; the distribution is the one of the blocks, the blocks being in
+                        rank order). H_i is then generated against the blocks of the other ranks
+                        going around a ring (`H_i_ring_matrix_elements`), the products only fetch
+                        the rows of the vectors H_i needs (`Halo_exchange`) and the PT2 is summed
+                        by the owners of the connected determinants
+                        (`Powerplant_manager.distributed_pt2_pass`). Only the coefficients are
+                        still full-length vectors. Not with `memory_budget`.
+    :param symmetric: only the upper triangle of H (J >= I) is generated and cached; the products
+                      add the transposed part, which is reduce-scattered to the ranks owning its
+                      rows (`H_i_symmetric_product`). The rows are then distributed so that the
+                      ranks have the same share of the triangle (`triangular_distribution`).
+                      Not with `memory_budget`, nor distributed determinants.
+    :param preconditioner: of the Davidson solves, "diagonal" or "block" (see `Davidson_manager`)
+    :param orbsym: irreps of the orbitals (FCIDUMP ORBSYM, from 1; abelian point groups). The PT2
+                   and the selection then only generate the excitations which keep the irrep of
+                   their determinant, and the integral-driven H only visits the integrals which
+                   are allowed by symmetry (see `irreps`). None: no symmetry (as all 1).
 
     ~
     Slater-Condon Rules
@@ -2047,7 +2766,7 @@ class Hamiltonian_generator(object):
       alpha-spin electrons (N_alpha >= N_beta), and n_orb is the number of
       molecular orbitals.  So the number of non-zero elements scales linearly with
       the number of selected determinant.
-    * Matrix elements of H are stored as a hash lookup.
+    * Matrix elements of H are cached in a compressed sparse row (CSR) matrix.
     """
 
     # Only pass internal determinant, since we'll only want to cache the Hamiltonian matrix elts. for an iteration
@@ -2060,19 +2779,86 @@ class Hamiltonian_generator(object):
         d_two_e_integral: Two_electron_integral,
         psi_internal: Psi_det,
         driven_by="determinant",
+        integral_eps=0.0,
+        memory_budget=None,
+        row_block_size=1024,
+        n_workers=1,
+        backend="numpy",
+        det_storage="replicated",
+        symmetric=False,
+        orbsym=None,
+        preconditioner="diagonal",
     ):
         self.comm = comm
         self.world_size = self.comm.Get_size()  # No. of processes running
         self.rank = self.comm.Get_rank()  # Rank of current process
         self.MPI_master_rank = 0  # Master rank
-        # Full problem size is no. of internal determinants
-        self.full_problem_size = len(psi_internal)
-        # Save lists of determinants/integral dictionaries with instance of class
-        self.psi_internal = psi_internal
+        self.det_storage = det_storage
+        if det_storage == "replicated":
+            # Full problem size is no. of internal determinants
+            self.full_problem_size = len(psi_internal)
+            # Save lists of determinants/integral dictionaries with instance of class
+            self.psi_internal = psi_internal
+        elif det_storage == "distributed":
+            if memory_budget is not None:
+                raise NotImplementedError("memory_budget with distributed determinants")
+            # Collective: the sizes (and representation) of the blocks of all the ranks
+            blocks = comm.allgather(
+                (len(psi_internal), representation_of(psi_internal) if psi_internal else None)
+            )
+            self.psi_local = psi_internal
+            self.distribution = np.array([size for size, _ in blocks], dtype="i")
+            self.full_problem_size = int(self.distribution.sum())
+            self.det_representation = next((r for _, r in blocks if r), "tuple")
+        else:
+            raise NotImplementedError
+        if symmetric and (memory_budget is not None or det_storage != "replicated"):
+            raise NotImplementedError("symmetric H with memory_budget or distributed determinants")
+        self.symmetric = symmetric
+        self.orbsym = orbsym
         self.E0 = E0
         self.d_one_e_integral = d_one_e_integral
         self.d_two_e_integral = d_two_e_integral
         self.driven_by = driven_by
+        self.integral_eps = integral_eps
+        self.memory_budget = memory_budget
+        self.row_block_size = row_block_size
+        self.n_workers = n_workers
+        # Array backend of the Davidson solves (`Array_backend' or its name)
+        self.backend = backend
+        self.preconditioner = preconditioner
+
+    @cached_property
+    def worker_pool(self) -> Worker_pool:
+        # (Forked at first use, with the determinants and the drivers of this generator)
+        return Worker_pool(self.n_workers, self)
+
+    def prepare_workers(self):
+        """What the drivers cache, computed before the workers are forked: once in the rank,
+        shared by the workers, instead of once per worker.
+        And the determinants, which the maps only refer to (`Det_range')"""
+        self.psi_local
+        if self.det_storage != "distributed":
+            self.psi_internal
+        self.Hamiltonian_2e_driver.coulomb_exchange
+        if self.driven_by == "integral":
+            self.Hamiltonian_2e_driver.category_streams
+        elif self.driven_by == "compiled":
+            self.Hamiltonian_2e_driver.packed_integrals
+
+    def dets(self, psi) -> Psi_det:
+        """psi itself, or the determinants it refers to: a `Det_range' of this generator,
+        or packed ones (`Psi_det_packed', e.g. a block of another rank)"""
+        if isinstance(psi, Det_range):
+            return psi.of(self)
+        if isinstance(psi, Psi_det_packed):
+            return unpack_psi_det(psi, self.det_representation)
+        return psi
+
+    def close(self):
+        """Stop the workers of this generator (if any; forked again if it's used again)"""
+        if "worker_pool" in self.__dict__:
+            self.worker_pool.close()
 
     @cached_property
     def distribution(self):
@@ -2091,9 +2877,28 @@ class Hamiltonian_generator(object):
         array([34, 34, 34], dtype=int32)
         """
         # At initialization, each rank computes distribution of determinants
-        floor, remainder = divmod(self.full_problem_size, self.world_size)
+        if self.symmetric:
+            return self.triangular_distribution(self.full_problem_size, self.world_size)
+        return self.even_distribution(self.full_problem_size, self.world_size)
+
+    @staticmethod
+    def even_distribution(n, world_size) -> np.ndarray:
+        floor, remainder = divmod(n, world_size)
         ceiling = floor + 1
-        return np.array([ceiling] * remainder + [floor] * (self.world_size - remainder), dtype="i")
+        return np.array([ceiling] * remainder + [floor] * (world_size - remainder), dtype="i")
+
+    @staticmethod
+    def triangular_distribution(n, world_size) -> np.ndarray:
+        """Contiguous blocks of rows with the same share of the upper triangle of a (n x n) matrix.
+        Row I has n - I elements, so the first ranks get fewer rows.
+        >>> Hamiltonian_generator.triangular_distribution(100, 2)
+        array([29, 71], dtype=int32)
+        >>> Hamiltonian_generator.triangular_distribution(100, 3)
+        array([18, 24, 58], dtype=int32)
+        """
+        # The first b rows have n^2 - (n - b)^2 elements (up to the diagonal)
+        bounds = [int(round(n * (1 - np.sqrt(1 - r / world_size)))) for r in range(world_size)]
+        return np.diff(bounds + [n]).astype("i")
 
     @cached_property
     def local_size(self):
@@ -2122,10 +2927,45 @@ class Hamiltonian_generator(object):
             self.offsets[self.rank] : (self.offsets[self.rank] + self.distribution[self.rank])
         ]
 
+    @cached_property
+    def psi_internal(self) -> Psi_det:
+        # Given to the constructor; distributed determinants: gathered at first use (collective)
+        return self.gather_psi_internal()
+
+    def gather_psi_internal(self) -> Psi_det:
+        """Collective: all the determinants, in order, from the blocks of the ranks.
+        Not cached (unlike `psi_internal'), e.g. for a checkpoint of distributed determinants."""
+        if "psi_internal" in self.__dict__:
+            return self.psi_internal
+        n_words = Psi_det_packed.n_words(self.N_orb)
+        packed = Psi_det_packed.from_psi_det(self.psi_local, self.N_orb)
+        words = np.ascontiguousarray(np.c_[packed.alpha, packed.beta], dtype=np.uint64)
+        all_words = np.zeros((self.full_problem_size, 2 * n_words), dtype=np.uint64)
+        self.comm.Allgatherv(
+            [words, MPI.UINT64_T],
+            [all_words, 2 * n_words * self.distribution, 2 * n_words * self.offsets, MPI.UINT64_T],
+        )
+        psi = Psi_det_packed(all_words[:, :n_words], all_words[:, n_words:])
+        return unpack_psi_det(psi, self.det_representation)
+
+    @cached_property
+    def det_representation(self) -> str:
+        return representation_of(self.psi_internal)
+
     @cached_property
     def N_orb(self):
-        key = max(self.d_two_e_integral)
-        return max(compound_idx4_reverse(key)) + 1
+        return self.Hamiltonian_2e_driver.N_orb
+
+    @cached_property
+    def irreps(self) -> Tuple[int, ...]:
+        """Irreps of the orbitals numbered from 0 (see `Determinant.irrep`), None without symmetry
+        >>> Hamiltonian_generator(MPI.COMM_WORLD, 0, None, None, [0], orbsym=[1, 3, 1]).irreps
+        (0, 2, 0)
+        >>> Hamiltonian_generator(MPI.COMM_WORLD, 0, None, None, [0], orbsym=[1, 1]).irreps
+        """
+        if self.orbsym is None or len(set(self.orbsym)) == 1:
+            return None
+        return tuple(int(irrep) - 1 for irrep in self.orbsym)
 
     # Create instances of 1e and 2e `driver' classes
     @cached_property
@@ -2137,7 +2977,11 @@ class Hamiltonian_generator(object):
         if self.driven_by == "determinant":
             return Hamiltonian_two_electrons_determinant_driven(self.d_two_e_integral)
         elif self.driven_by == "integral":
-            return Hamiltonian_two_electrons_integral_driven(self.d_two_e_integral)
+            return Hamiltonian_two_electrons_integral_driven(
+                self.d_two_e_integral, self.integral_eps, self.irreps
+            )
+        elif self.driven_by == "compiled":
+            return Hamiltonian_two_electrons_compiled(self.d_two_e_integral, self.integral_eps)
         else:
             raise NotImplementedError
 
@@ -2148,16 +2992,63 @@ class Hamiltonian_generator(object):
         # Diagonal elements of local Hamiltonian
         return self.Hamiltonian_1e_driver.H_ii(det_i) + self.Hamiltonian_2e_driver.H_ii(det_i)
 
+    def H_ii_batch(self, psi: Psi_det, chunk_size=4096) -> np.ndarray:
+        """Diagonal elements <I|H|I> of all the determinants of psi, as a numpy vector.
+        Computed from the occupation matrices of the determinants and the J / K integrals,
+        by chunks of `chunk_size` determinants to bound the size of the temporaries.
+        psi can be a `Det_range' (see `dets'), which is all the workers get."""
+        with profiler.timer("H diagonal"):
+            n = len(self.dets(psi))
+            chunks = self.worker_pool.map(
+                Hamiltonian_generator.H_ii_task, (psi, chunk_size), range(0, n, chunk_size)
+            )
+            return np.concatenate([np.zeros(0, dtype="float")] + list(chunks))
+
+    def H_ii_task(self, psi: Psi_det, chunk_size):
+        # `H_ii_batch' of the chunk of psi starting at `begin' (`Worker_pool.map' task)
+        psi = self.dets(psi)
+
+        def H_ii_chunk(begin):
+            chunk = psi[begin : begin + chunk_size]
+            A = occupation_matrix(chunk, "alpha", self.N_orb)
+            B = occupation_matrix(chunk, "beta", self.N_orb)
+            return self.Hamiltonian_1e_driver.H_ii_occupation(
+                A, B
+            ) + self.Hamiltonian_2e_driver.H_ii_occupation(A, B)
+
+        return H_ii_chunk
+
+    @cached_property
+    def D_internal(self) -> np.ndarray:
+        """Collective: diagonal elements of all of psi_internal, gathered from `D_i'"""
+        D = np.zeros(self.full_problem_size, dtype="float")
+        self.comm.Allgatherv(
+            [self.D_i, MPI.DOUBLE], [D, self.distribution, self.offsets, MPI.DOUBLE]
+        )
+        return D
+
+    @cached_property
+    def diagonal_engine(self) -> Diagonal_engine:
+        """Collective: diagonal elements of the determinants connected to psi_internal (the
+        PT2 denominators), incrementally from the ones of psi_internal (`D_internal')"""
+        # `get` doesn't insert the missing keys of a defaultdict
+        h = np.array([self.d_one_e_integral.get((i, i), 0.0) for i in range(self.N_orb)])
+        J, K = self.Hamiltonian_2e_driver.coulomb_exchange
+        return Diagonal_engine(h, J, K, self.psi_internal, self.D_internal, self.N_orb)
+
+    @cached_property
+    def local_diagonal_engine(self) -> Diagonal_engine:
+        """`diagonal_engine' of the local determinants only (distributed determinants)"""
+        h = np.array([self.d_one_e_integral.get((i, i), 0.0) for i in range(self.N_orb)])
+        J, K = self.Hamiltonian_2e_driver.coulomb_exchange
+        return Diagonal_engine(h, J, K, self.psi_local, self.D_i, self.N_orb)
+
     @cached_property
     def D_i(self):
         """Return `diagonal' of local H_i. (Diagonal meaning, entries of H_i
         corresponding to the diagonal part of H) as a numpy vector.
         Used for pre-conditioning step in Davidson's iteration."""
-        D_i = np.zeros(self.local_size, dtype="float")
-        # Iterate through local determinants m
-        for j, det in enumerate(self.psi_local):
-            D_i[j] = self.H_ii(det)
-        return D_i
+        return self.H_ii_batch(Det_range("psi_local"))
 
     # ~ ~ ~
     # H
@@ -2190,34 +3081,367 @@ class Hamiltonian_generator(object):
 
         return H_full
 
+    def H_i_matrix_elements(self, psi_rows: Psi_det, psi_cols: Psi_det):
+        """Generate the elements of the (psi_rows x psi_cols) block of H, in coordinate (COO) format.
+        1e and 2e contributions are both returned; duplicated (I, J) are summed by `CSR_matrix`.
+        Works for integral-driven, determinant-driven or compiled implementation.
+        The work is split between the `worker_pool', their elements are concatenated.
+        psi_rows and psi_cols can be `Det_range's of this generator, or packed determinants
+        (see `dets'): then the workers aren't sent the determinants, or only their words.
+
+        :return rows, cols, values: numpy arrays
+        """
+        n_workers = self.worker_pool.n_workers
+        with profiler.timer("H matrix elements"):
+            parts = list(
+                self.worker_pool.map(
+                    Hamiltonian_generator.H_i_matrix_elements_task,
+                    (psi_rows, psi_cols, n_workers),
+                    range(n_workers),
+                )
+            )
+            return tuple(np.concatenate(arrays) for arrays in zip(*parts))
+
+    def H_i_matrix_elements_task(self, psi_rows: Psi_det, psi_cols: Psi_det, n_workers):
+        # `H_i_matrix_elements_worker' of a worker (`Worker_pool.map' task)
+        return partial(self.H_i_matrix_elements_worker, psi_rows, psi_cols, n_workers=n_workers)
+
+    def H_i_matrix_elements_worker(
+        self, psi_rows: Psi_det, psi_cols: Psi_det, worker=0, n_workers=1
+    ):
+        """Share `worker' (of n_workers) of `H_i_matrix_elements'.
+        Integral-driven: the integral streams are split, and the one-electron part is done by
+        the worker 0. Otherwise the rows are, before any connected pair is looked for."""
+        psi_rows, psi_cols = self.dets(psi_rows), self.dets(psi_cols)
+        first_row = 0
+        if self.driven_by != "integral":
+            counts = self.even_distribution(len(psi_rows), n_workers)
+            first_row = int(counts[:worker].sum())
+            psi_rows = psi_rows[first_row : first_row + counts[worker]]
+            worker, n_workers = 0, 1
+        rows, cols, values = self.H_i_matrix_elements_rows(psi_rows, psi_cols, worker, n_workers)
+        return rows + first_row, cols, values
+
+    def H_i_matrix_elements_rows(self, psi_rows: Psi_det, psi_cols: Psi_det, worker, n_workers):
+        # (`H_i_matrix_elements_worker', once its rows are known)
+        rows, cols, values = [], [], []
+        # One-electron part
+        if worker == 0:
+            for (I, J), matrix_elt in self.Hamiltonian_1e_driver.H_indices(psi_rows, psi_cols):
+                rows.append(I)
+                cols.append(J)
+                values.append(matrix_elt)
+        if self.driven_by == "compiled":
+            # Two-electron part, straight into arrays
+            rows_2e, cols_2e, values_2e = self.Hamiltonian_2e_driver.H_matrix_elements(
+                psi_rows, psi_cols
+            )
+            return (
+                np.r_[np.array(rows, dtype=np.int64), rows_2e],
+                np.r_[np.array(cols, dtype=np.int64), cols_2e],
+                np.r_[np.array(values, dtype="float"), values_2e],
+            )
+        # Two-electron part. Collect the indices first, the integrals are then fetched all at once
+        idxs, phases = [], []
+        # (`worker' is only used by the integral-driven streams)
+        H_indices_args = (worker, n_workers) if self.driven_by == "integral" else ()
+        for (I, J), idx, phase in self.Hamiltonian_2e_driver.H_indices(
+            psi_rows, psi_cols, *H_indices_args
+        ):
+            rows.append(I)
+            cols.append(J)
+            idxs.append(idx)
+            phases.append(phase)
+        i, j, k, l = np.array(idxs, dtype=np.int64).reshape(-1, 4).T
+        values_2e = np.array(phases, dtype="float") * self.Hamiltonian_2e_driver.H_ijkl_orbitals(
+            i, j, k, l
+        )
+        values = np.concatenate((np.array(values, dtype="float"), values_2e))
+        return np.array(rows, dtype=np.int64), np.array(cols, dtype=np.int64), values
+
     @cached_property
-    def H_i_1e_matrix_elements(self):
-        """Generate elements of H_i_1e (local row-wise portion of one-electron Hamiltonian).
-        Elements are gathered `on-the-fly' at first iteration, and then cached in a dict to be re-used later.
+    def H_i_sparse(self):
+        """Local row-wise portion of the Hamiltonian (H_i), stored as a CSR matrix.
+        Elements are gathered `on-the-fly' at first iteration, and then cached to be re-used later.
         """
-        H_i_1e_matrix_elements = defaultdict(int)
-        for I, det_I in enumerate(self.psi_local):
-            for J, det_J in enumerate(self.psi_internal):
-                H_i_1e_matrix_elements[(I, J)] += self.Hamiltonian_1e_driver.H_ij(det_I, det_J)
-        # Remove the default dict
-        return dict(H_i_1e_matrix_elements)
+        if self.det_storage == "distributed":
+            rows, cols, values = self.H_i_ring_matrix_elements(Det_range("psi_local"))
+        elif self.symmetric:
+            rows, cols, values = self.H_i_upper_matrix_elements(
+                Det_range("psi_local"), self.offsets[self.rank]
+            )
+        else:
+            rows, cols, values = self.H_i_matrix_elements(
+                Det_range("psi_local"), Det_range("psi_internal")
+            )
+        H_i = CSR_matrix.from_coo(rows, cols, values, (self.local_size, self.full_problem_size))
+        self.record_cache_size(H_i)
+        return H_i
+
+    def H_local_block(self, P) -> np.ndarray:
+        """Dense (|P| x |P|) block of H between the local determinants P (local indices).
+        Taken from the cached H_i (`H_i_sparse'), generated if H_i is not cached."""
+        P = np.asarray(P, dtype=np.int64)
+        if self.memory_budget is not None and "H_i_sparse" not in self.__dict__:
+            psi_P = [self.psi_local[I] for I in P.tolist()]
+            rows, cols, values = self.H_i_matrix_elements(psi_P, psi_P)
+            return CSR_matrix.from_coo(rows, cols, values, (len(P), len(P))).to_dense()
+        H_i = self.H_i_sparse
+        # Position in P of the global columns, -1 if not in P
+        position = np.full(self.full_problem_size, -1, dtype=np.int64)
+        position[self.offsets[self.rank] + P] = np.arange(len(P))
+        H_PP = np.zeros((len(P), len(P)), dtype="float")
+        for a, I in enumerate(P.tolist()):
+            b = position[H_i.indices[H_i.indptr[I] : H_i.indptr[I + 1]]]
+            H_PP[a, b[b >= 0]] = H_i.data[H_i.indptr[I] : H_i.indptr[I + 1]][b >= 0]
+        if self.symmetric:
+            # Each pair is in the row of its first determinant only
+            H_PP = H_PP + H_PP.T - np.diag(np.diag(H_PP))
+        return H_PP
+
+    # ~ ~ ~
+    # Symmetric H
+    # ~ ~ ~
+    def H_i_upper_matrix_elements(self, psi_rows: Psi_det, first_row):
+        """The elements (I, J >= I) of psi_rows, which are the rows first_row, first_row + 1...
+        of H, in COO format (global column indices). Only the columns from first_row on are
+        generated; the lower part of the diagonal block is then dropped."""
+        psi_cols = Det_range("psi_internal", first_row)
+        rows, cols, values = self.H_i_matrix_elements(psi_rows, psi_cols)
+        cols = cols + first_row
+        upper = cols >= rows + first_row
+        return rows[upper], cols[upper], values[upper]
 
     @cached_property
-    def H_i_2e_matrix_elements(self):
-        """Generate elements of H_i_1e (local row-wise portion of one-electron Hamiltonian).
-        Elements are gathered `on-the-fly' at first iteration, and then cached in a dict to be re-used later.
-        Works for integral-driven or determinant-driven implementation.
+    def H_i_diagonal(self) -> np.ndarray:
+        """Diagonal of the local rows of the cached upper triangle (symmetric H)"""
+        rows, cols, values = self.H_i_sparse.to_coo()
+        diagonal = np.zeros(self.local_size, dtype="float")
+        on_diagonal = cols == rows + self.offsets[self.rank]
+        diagonal[rows[on_diagonal]] = values[on_diagonal]
+        return diagonal
+
+    def H_i_symmetric_product(self, M):
+        """W_i = H_i * M, from the local rows U_i of the upper triangle U of H.
+        H = U + U^T - diag(U), so W_i = U_i * M + (U^T * M)_i - diag(U_i) * M_i.
+        Collective: U^T * M = sum over the ranks r of U_r^T * M_r, which is reduce-scattered
+        to the owners of its rows."""
+        if M.ndim == 1:  # Handle case when M is a vector
+            M = M.reshape(len(M), 1)
+        k = M.shape[1]
+        M_i = M[self.offsets[self.rank] : self.offsets[self.rank] + self.local_size]
+        W_transpose = np.zeros((self.local_size, k), dtype="float")
+        self.comm.Reduce_scatter(
+            [self.H_i_sparse.transpose_dot(M_i), MPI.DOUBLE],
+            [W_transpose, MPI.DOUBLE],
+            recvcounts=(k * self.distribution).tolist(),
+            op=MPI.SUM,
+        )
+        return self.H_i_sparse.dot(M) + W_transpose - self.H_i_diagonal[:, np.newaxis] * M_i
+
+    # ~ ~ ~
+    # Distributed determinants
+    # ~ ~ ~
+    def H_i_ring_matrix_elements(self, psi_rows):
+        """The (psi_rows x psi_internal) elements, in COO format (global column indices),
+        without psi_internal. Collective: the blocks of determinants go around the ring of the
+        ranks (packed, `ring_shift'), and psi_rows is done against each of them in turn;
+        a rank never has more than its own block and the one it is visiting."""
+        block = Psi_det_packed.from_psi_det(self.psi_local, self.N_orb)
+        parts = []
+        for step in range(self.world_size):
+            owner = (self.rank - step) % self.world_size  # Rank whose block we have
+            # (the workers are sent the packed block only)
+            rows, cols, values = self.H_i_matrix_elements(psi_rows, block)
+            parts.append((rows, cols + self.offsets[owner], values))
+            if step + 1 < self.world_size:
+                block = self.ring_shift(block, (owner - 1) % self.world_size)
+        return tuple(np.concatenate(arrays) for arrays in zip(*parts))
+
+    def ring_shift(self, block: Psi_det_packed, previous_owner) -> Psi_det_packed:
+        """Send `block' to the next rank of the ring, and return the block of the previous rank
+        (which is the block of `previous_owner')"""
+        next_rank = (self.rank + 1) % self.world_size
+        previous_rank = (self.rank - 1) % self.world_size
+        n_words = Psi_det_packed.n_words(self.N_orb)
+        received = []
+        for words in (block.alpha, block.beta):
+            recvbuf = np.zeros((self.distribution[previous_owner], n_words), dtype=np.uint64)
+            self.comm.Sendrecv(
+                [np.ascontiguousarray(words, dtype=np.uint64), MPI.UINT64_T],
+                dest=next_rank,
+                recvbuf=[recvbuf, MPI.UINT64_T],
+                source=previous_rank,
+            )
+            received.append(recvbuf)
+        return Psi_det_packed(*received)
+
+    @cached_property
+    def halo_exchange(self) -> "Halo_exchange":
+        # Collective: the rows of the vectors needed by H_i are the columns of its non-zeros
+        columns = np.unique(self.H_i_sparse.indices).astype(np.int64)
+        return Halo_exchange(self.comm, columns, self.offsets)
+
+    @cached_property
+    def H_i_halo(self) -> CSR_matrix:
+        """H_i, with its columns numbered as the rows of the halo (`halo_exchange.columns')"""
+        H_i = self.H_i_sparse
+        indices = np.searchsorted(self.halo_exchange.columns, H_i.indices).astype(np.int32)
+        shape = (H_i.shape[0], len(self.halo_exchange.columns))
+        return CSR_matrix(shape, H_i.indptr, indices, H_i.data)
+
+    def H_i_halo_product(self, V_i):
+        """W_i = H_i * V, from the local rows V_i of V (distributed determinants).
+        Collective: the rows of V that H_i needs are exchanged (`Halo_exchange')."""
+        if V_i.ndim == 1:
+            V_i = V_i.reshape(len(V_i), 1)
+        with profiler.timer("H_i * M"):
+            return self.H_i_halo.dot(self.halo_exchange.exchange(V_i))
+
+    @staticmethod
+    def record_cache_size(H_i: CSR_matrix):
+        profiler.peak("H cache, non-zeros", H_i.nnz)
+        profiler.peak("H cache, bytes", H_i.nbytes)
+
+    @staticmethod
+    def extended_distribution(distribution, n_new):
+        """Number of `n_new' additional determinants given to each rank.
+        New determinants go to the least loaded ranks, so the extended distribution is as even
+        as possible without moving any of the determinants already distributed.
+        >>> Hamiltonian_generator.extended_distribution(np.array([34, 33, 33], dtype="i"), 5)
+        array([1, 2, 2], dtype=int32)
+        >>> Hamiltonian_generator.extended_distribution(np.array([10, 0, 0], dtype="i"), 4)
+        array([0, 2, 2], dtype=int32)
         """
-        H_i_2e_matrix_elements = defaultdict(int)
-        for (I, J), idx, phase in self.Hamiltonian_2e_driver.H_indices(
-            self.psi_local, self.psi_internal
-        ):
-            # Update (I, J)th 2e matrix element
-            H_i_2e_matrix_elements[(I, J)] += phase * self.Hamiltonian_2e_driver.H_ijkl_orbital(
-                *idx
+        new_counts = np.zeros(len(distribution), dtype="i")
+        heap = [(count, rank) for rank, count in enumerate(distribution)]
+        heapq.heapify(heap)
+        for _ in range(n_new):
+            count, rank = heapq.heappop(heap)
+            new_counts[rank] += 1
+            heapq.heappush(heap, (count + 1, rank))
+        return new_counts
+
+    @staticmethod
+    def extended_triangular_distribution(distribution, n_new):
+        """`extended_distribution' for a symmetric H, where the rows are weighted by their length
+        in the upper triangle: the extended blocks are the closest to `triangular_distribution'
+        (of the extended size) without moving any of the determinants already distributed.
+        >>> Hamiltonian_generator.extended_triangular_distribution(np.array([29, 71]), 20)
+        array([ 6, 14], dtype=int32)
+        >>> Hamiltonian_generator.extended_triangular_distribution(np.array([18, 24, 58]), 30)
+        array([ 6,  7, 17], dtype=int32)
+        >>> Hamiltonian_generator.extended_triangular_distribution(np.array([50, 50]), 2)
+        array([0, 2], dtype=int32)
+        """
+        n = int(np.sum(distribution)) + n_new
+        bounds = np.cumsum(Hamiltonian_generator.triangular_distribution(n, len(distribution)))
+        # Number of new determinants up to each rank: can't decrease, nor be more than n_new
+        new_bounds = np.maximum.accumulate(np.maximum(bounds - np.cumsum(distribution), 0))
+        new_bounds = np.minimum(new_bounds, n_new)
+        return np.diff(np.r_[0, new_bounds]).astype("i")
+
+    def extend(self, psi_new: Psi_det):
+        """Return the Hamiltonian_generator of psi_internal + psi_new, re-using what is cached.
+        Used between CIPSI iterations, where only a few determinants are added to the wave function.
+
+        Determinants don't move between ranks. The new ones are appended to the local block of
+        the rank they are given to, so the global order becomes [old_0, new_0, old_1, new_1, ...],
+        where old_r (new_r) are the old (new) determinants of rank r.
+        `old_to_new[I]' is the index in the extended wave function of the old determinant I.
+
+        If H_i was already built, only H(old_local, new) and H(new_local, all) are computed;
+        H(old_local, old) is taken from the old CSR matrix, with its columns re-indexed.
+        (old_to_new is increasing, so the upper triangle of a symmetric H stays upper.)
+        The workers of this generator are stopped, the extended one has its own.
+        """
+        self.close()
+        if self.symmetric:
+            new_counts = self.extended_triangular_distribution(self.distribution, len(psi_new))
+        else:
+            new_counts = self.extended_distribution(self.distribution, len(psi_new))
+        new_offsets = np.zeros(self.world_size, dtype="i")
+        np.add.accumulate(new_counts[:-1], out=new_offsets[1:])
+        psi_new_local = psi_new[
+            new_offsets[self.rank] : (new_offsets[self.rank] + new_counts[self.rank])
+        ]
+
+        if self.det_storage == "distributed":
+            # Only the block of this rank
+            psi_internal = self.psi_local + psi_new_local
+        else:
+            psi_internal = []
+            for r in range(self.world_size):
+                psi_internal += self.psi_internal[
+                    self.offsets[r] : (self.offsets[r] + self.distribution[r])
+                ]
+                psi_internal += psi_new[new_offsets[r] : new_offsets[r] + new_counts[r]]
+        # Index in the extended wave function of the old and new determinants
+        old_to_new = np.arange(self.full_problem_size) + np.repeat(new_offsets, self.distribution)
+        new_to_index = np.arange(len(psi_new)) + np.repeat(
+            self.offsets + self.distribution, new_counts
+        )
+
+        lewis = Hamiltonian_generator(
+            self.comm,
+            self.E0,
+            self.d_one_e_integral,
+            self.d_two_e_integral,
+            psi_internal,
+            driven_by=self.driven_by,
+            integral_eps=self.integral_eps,
+            memory_budget=self.memory_budget,
+            row_block_size=self.row_block_size,
+            n_workers=self.n_workers,
+            backend=self.backend,
+            det_storage=self.det_storage,
+            symmetric=self.symmetric,
+            orbsym=self.orbsym,
+            preconditioner=self.preconditioner,
+        )
+        lewis.distribution = self.distribution + new_counts
+        lewis.old_to_new = old_to_new
+        # The drivers only depend on the integrals
+        for name in ("N_orb", "Hamiltonian_1e_driver", "Hamiltonian_2e_driver"):
+            if name in self.__dict__:
+                setattr(lewis, name, getattr(self, name))
+
+        if "D_i" in self.__dict__:
+            D_new = lewis.H_ii_batch(Det_range("psi_local", self.local_size))
+            lewis.D_i = np.r_[self.D_i, D_new]
+        if "H_i_sparse" in self.__dict__:
+            # H(old_local, old)
+            rows_old, cols_old, values_old = self.H_i_sparse.to_coo()
+            # H(old_local, new)
+            # (psi_new is the only one sent to the workers; new local rows after the old ones)
+            old_local, new_local = (
+                Det_range("psi_local", 0, self.local_size),
+                Det_range("psi_local", self.local_size),
             )
-        # Remove the default dict
-        return dict(H_i_2e_matrix_elements)
+            rows_new, cols_new, values_new = lewis.H_i_matrix_elements(old_local, psi_new)
+            # H(new_local, all); new local rows are after the old ones
+            if self.det_storage == "distributed":
+                rows_all, cols_all, values_all = lewis.H_i_ring_matrix_elements(new_local)
+            elif self.symmetric:
+                # Only the (I, J >= I) elements; the new local rows start after the old ones
+                first_row = lewis.offsets[self.rank] + self.local_size
+                rows_all, cols_all, values_all = lewis.H_i_upper_matrix_elements(
+                    new_local, first_row
+                )
+                upper = new_to_index[cols_new] >= old_to_new[self.offsets[self.rank] + rows_new]
+                rows_new, cols_new, values_new = rows_new[upper], cols_new[upper], values_new[upper]
+            else:
+                rows_all, cols_all, values_all = lewis.H_i_matrix_elements(
+                    new_local, Det_range("psi_internal")
+                )
+            lewis.H_i_sparse = CSR_matrix.from_coo(
+                np.r_[rows_old, rows_new, rows_all + self.local_size],
+                np.r_[old_to_new[cols_old], new_to_index[cols_new], cols_all],
+                np.r_[values_old, values_new, values_all],
+                (lewis.local_size, lewis.full_problem_size),
+            )
+            lewis.record_cache_size(lewis.H_i_sparse)
+        return lewis
 
     # TODO:
     # H * G
@@ -2227,32 +3451,82 @@ class Hamiltonian_generator(object):
     def H_i_implicit_matrix_product(self, M):
         """Function to implicitly compute matrix-matrix product W_i = H_i * M
         At first call, matrix elements of H_i are built `on-the-fly'. Matrix elements are cached
-        for later use, and iterated through to compute H_i * V implicitly.
+        in a CSR matrix for later use, and the product is done in one vectorized sparse-times-dense product.
 
         :param H_i: local (self.local_size \times n) row-wise portion of Hamiltonian (never explicitly formed)
         :param V:  (self.full_size \times k) diensional numpy array
 
         :return W_i: locally computed chunk of matrix-matrix product (self.local_size \times k), as a numpy array
         """
+        with profiler.timer("H_i * M"):
+            if self.det_storage == "distributed":
+                # M is full, only its rows that H_i needs are used
+                return self.H_i_halo.dot(M[self.halo_exchange.columns])
+            if self.symmetric:
+                return self.H_i_symmetric_product(M)
+            if self.memory_budget is None or "H_i_sparse" in self.__dict__:
+                return self.H_i_sparse.dot(M)
+            return self.H_i_hybrid_matrix_product(M)
 
-        def H_i_implicit_matrix_product_step(matrix_elements, M):
-            # Implicitly compute the 1e/2e Hamiltonain matrix-matrix product W_i = H_i * M
-            # :param matrix_elements: python dictionary of 1e or 2e Hamiltonian matrix elements
-            if M.ndim == 1:  # Handle case when M is a vector
-                M = M.reshape(len(M), 1)
-            k = M.shape[1]  # Column dimension
-            # Pre-allocate space for local brick of matrix-matrix product
-            W_i = np.zeros((self.local_size, k), dtype="float")
-            # Iterate through nonzero matrix elements to compute matrix-matrix product
-            for (I, J), matrix_elt in matrix_elements.items():
-                W_i[I, :] += matrix_elt * M[J, :]  # Update row I of W_i
-            return W_i
+    # ~ ~ ~
+    # Memory-budgeted H_i * M
+    # ~ ~ ~
+    def H_i_block(self, begin, end) -> CSR_matrix:
+        """Rows [begin, end) of H_i, as a CSR matrix"""
+        rows, cols, values = self.H_i_matrix_elements(
+            Det_range("psi_local", begin, end), Det_range("psi_internal")
+        )
+        return CSR_matrix.from_coo(rows, cols, values, (end - begin, self.full_problem_size))
 
-        # On first call, these will do the same things regardless of the `driven_by' option
-        # If option to cache, compute elements and store in a sparse representation, then multiply
-        return H_i_implicit_matrix_product_step(
-            self.H_i_1e_matrix_elements, M
-        ) + H_i_implicit_matrix_product_step(self.H_i_2e_matrix_elements, M)
+    @cached_property
+    def H_i_block_cache(self) -> Dict[int, CSR_matrix]:
+        """{first row: CSR block} of the row blocks of H_i kept within `memory_budget'.
+        Filled during the first product, in row order, until the budget is exhausted."""
+        return {}
+
+    def H_i_hybrid_matrix_product(self, M):
+        """H_i * M, with cached blocks when they fit in `memory_budget', direct otherwise.
+        A direct block is built once per product and applied to all the columns of M
+        (the whole Davidson block), i.e. each element is generated once and not once per vector.
+        The first call also records the sizes in `H_i_memory_report'."""
+        if M.ndim == 1:  # Handle case when M is a vector
+            M = M.reshape(len(M), 1)
+        W = np.zeros((self.local_size, M.shape[1]), dtype="float")
+        first_product = "H_i_memory_report" not in self.__dict__
+        report = dict.fromkeys(
+            ["cached_blocks", "cached_bytes", "direct_blocks", "direct_bytes"], 0
+        )
+        for begin in range(0, self.local_size, self.row_block_size):
+            end = min(begin + self.row_block_size, self.local_size)
+            H_b = self.H_i_block_cache.get(begin)
+            if H_b is None:
+                H_b = self.H_i_block(begin, end)
+                if first_product and report["cached_bytes"] + H_b.nbytes <= self.memory_budget:
+                    self.H_i_block_cache[begin] = H_b
+            if first_product:
+                kind = "cached" if begin in self.H_i_block_cache else "direct"
+                report[f"{kind}_blocks"] += 1
+                report[f"{kind}_bytes"] += H_b.nbytes
+            W[begin:end] = H_b.dot(M)
+        if first_product:
+            self.H_i_memory_report = report
+            profiler.peak("H cache, bytes", report["cached_bytes"])
+        return W
+
+    def memory_report(self) -> Dict[str, int]:
+        """Cached vs recomputed (direct) blocks of H and their sizes in bytes, summed over ranks.
+        Needs a first product (the sizes of the blocks are only known once built).
+        Collective: all ranks have to call it."""
+        if self.memory_budget is None or "H_i_sparse" in self.__dict__:
+            report = {"cached_blocks": 1, "cached_bytes": self.H_i_sparse.nbytes}
+            report.update(direct_blocks=0, direct_bytes=0)
+        else:
+            report = self.H_i_memory_report
+        keys = sorted(report)
+        values = np.array([report[key] for key in keys], dtype=np.int64)
+        total = np.zeros_like(values)
+        self.comm.Allreduce([values, MPI.INT64_T], [total, MPI.INT64_T])
+        return dict(zip(keys, total.tolist()))
 
 
 import inspect
@@ -2272,6 +3546,70 @@ for name, member in inspect.getmembers(Hamiltonian_generator):
 #
 
 
+class Diagonal_preconditioner(object):
+    """Davidson's preconditioner, t_i = r_i / (D_i - λ): applied element-wise, O(local_size)
+    per root (the diagonal matrix is never built). The denominators are clipped away from 0.
+
+    >>> M = Diagonal_preconditioner(np.array([1.5, 2.5, 4.5]))
+    >>> M(0.5, np.ones(3), None)
+    array([1.  , 0.5 , 0.25])
+    """
+
+    def __init__(self, D_i, xp=np):
+        self.D_i = D_i
+        self.xp = xp
+
+    def inverse(self, eigenvalues, l_k):
+        xp = self.xp
+        return xp.clip(xp.reciprocal(eigenvalues - l_k), -1e5, 1e5)
+
+    def __call__(self, l_k, r_ik, x_ik):
+        """New trial vector for the Ritz pair (l_k, x_ik) of residual r_ik (local rows)"""
+        return self.inverse(self.D_i, l_k) * r_ik
+
+
+class Block_preconditioner(Diagonal_preconditioner):
+    """(H - λ) inverted on a block P of local determinants, and diagonal elsewhere.
+    P are the `block_size' local determinants of largest |c| in the guess (then of lowest
+    <I|H|I>), their block H_PP of the cached H_i is diagonalized once, H_PP = Q Λ Q^T,
+    so that each root costs O(|P|^2 + local_size): t_P = Q (Λ - λ)^-1 Q^T r_P, clipped as
+    the diagonal. The blocks are local to each rank.
+    An exact inverse would give back the Ritz vector itself as new trial vector, so the
+    correction is Olsen's, t = M^-1 r - ε M^-1 x with ε = <x|M^-1|r> / <x|M^-1|x>
+    (two numbers to reduce per root)."""
+
+    def __init__(self, comm, D_i, H_PP, P, xp=np):
+        super().__init__(D_i, xp)
+        self.comm = comm
+        self.P = xp.asarray(P)
+        L, Q = np.linalg.eigh(H_PP) if len(P) else (np.zeros(0), np.zeros((0, 0)))
+        self.L, self.Q = xp.asarray(L), xp.asarray(Q)
+
+    @classmethod
+    def from_generator(cls, comm, H_i_generator, c_i, block_size, backend: Array_backend):
+        """The block of the leading |c_i| (host vector of the local rows) of H_i_generator"""
+        D_i = H_i_generator.D_i
+        P = np.sort(np.lexsort((D_i, -np.abs(c_i)))[:block_size])
+        H_PP = H_i_generator.H_local_block(P)
+        return cls(comm, backend.asarray(D_i), H_PP, P, backend.xp)
+
+    def apply(self, l_k, v_ik):
+        t_ik = self.inverse(self.D_i, l_k) * v_ik
+        if not len(self.P):  # (no local determinant)
+            return t_ik
+        t_ik[self.P] = self.Q @ (self.inverse(self.L, l_k) * (self.Q.T @ v_ik[self.P]))
+        return t_ik
+
+    def __call__(self, l_k, r_ik, x_ik):
+        t_ik, y_ik = self.apply(l_k, r_ik), self.apply(l_k, x_ik)
+        xy_i = np.array([float(self.xp.dot(x_ik, t_ik)), float(self.xp.dot(x_ik, y_ik))])
+        xy = np.zeros(2, dtype="float")
+        self.comm.Allreduce([xy_i, MPI.DOUBLE], [xy, MPI.DOUBLE])
+        if xy[1] == 0.0:
+            return t_ik
+        return t_ik - (xy[0] / xy[1]) * y_ik
+
+
 class Davidson_manager(object):
     """A matrix-free implementation of Davidson's method in parallel.
     All matrix products involving the Hamiltonian matrix are computed implicitly, and
@@ -2283,9 +3621,43 @@ class Davidson_manager(object):
 
     Each process will have local access to instance of the `Hamiltonian_generator()' class, to construct
     the local portion Hamiltonian on the fly.
+
+    :param orthogonalization: "block", all the new trial vectors are orthogonalized at once
+        by `block_cgs2` (a fixed number of Allreduce per iteration); or "mgs", one vector at a time
+        by `mgs` (one Allreduce per basis vector and per new vector).
+    Either way, norms are computed from reduced local squared norms (`distributed_norms`);
+    full-length vectors are never gathered to orthogonalize.
+    :param backend: `Array_backend` (or its name) holding H_i and the local work variables
+        (V_ik, W_ik, Ritz vectors and residuals). Default: the one of `H_i_generator`.
+        Small matrices (Gram blocks, norms, S_k and its eigenvectors) are always on the host.
+    :param preconditioner: of the new trial vectors, "diagonal" (`Diagonal_preconditioner`) or
+        "block" (`Block_preconditioner`, exact on the `block_size' leading local determinants).
+        Default: the one of `H_i_generator`. The iterations are counted per preconditioner in
+        `profiler' ("Davidson iterations, <name> preconditioner"), next to the time of its setup.
     """
 
-    def __init__(self, comm, H_i_generator: Hamiltonian_generator):
+    def __init__(
+        self,
+        comm,
+        H_i_generator: Hamiltonian_generator,
+        orthogonalization="block",
+        backend=None,
+        preconditioner=None,
+        block_size=256,
+    ):
+        if orthogonalization not in ("block", "mgs"):
+            raise NotImplementedError
+        self.orthogonalization = orthogonalization
+        if preconditioner is None:
+            preconditioner = H_i_generator.preconditioner
+        if preconditioner not in ("diagonal", "block"):
+            raise NotImplementedError(preconditioner)
+        self.preconditioner = preconditioner
+        self.block_size = block_size
+        if backend is None:
+            backend = H_i_generator.backend
+        self.backend = backend if isinstance(backend, Array_backend) else Array_backend(backend)
+        self.xp = self.backend.xp
         self.comm = comm
         self.world_size = self.comm.Get_size()  # No. of processes running
         self.rank = self.comm.Get_rank()  # Rank of current process
@@ -2307,30 +3679,32 @@ class Davidson_manager(object):
         :param dim_S: column-size of local working variables (V_ik and friends)
         :param n_eig: number of eigenvalues to look for (minimally allowed dim_S)
         :param n_newvecs: number of new vectors added at the previous iteration
-        :param X_ik: current Ritz vectors, numpy array
-        :param V_ik, W_ik: local working variables, numpy arrays
+        :param X_ik: current Ritz vectors, backend array
+        :param V_ik, W_ik: local working variables, backend arrays
 
         :return new values for dim_S, V_ik, and W_ik following implicit restart
         """
+        xp = self.xp
         if n_newvecs == 0:
             V_inew = X_ik[:, :n_eig]
         else:
-            V_inew = np.c_[X_ik[:, :n_eig], V_ik[:, -n_newvecs:]]
+            V_inew = xp.c_[X_ik[:, :n_eig], V_ik[:, -n_newvecs:]]
         # Take leading n_eig Ritz vectors as new guess vectors
         dim_S = V_inew.shape[1]  # New subspace dimension
-        V_ik = np.zeros((self.local_size, 0), dtype="float")
-        W_ik = np.zeros((self.local_size, 0), dtype="float")
-        # Initialize; normalize first basis vector
-        v_inew = np.array(V_inew[:, 0], dtype="float")
-        v_new = np.zeros(self.full_problem_size, dtype="float")
-        self.comm.Allgatherv(
-            [v_inew, MPI.DOUBLE], [v_new, self.distribution, self.offsets, MPI.DOUBLE]
-        )
-        V_ik = np.c_[V_ik, v_inew / np.linalg.norm(v_new)]
-        for j in range(1, dim_S):
-            # Orthogonalize next vector against previous ones in restart basis
-            v_inew, norm_vnew = self.mgs(V_ik[:, :j], V_inew[:, j])
-            V_ik = np.c_[V_ik, v_inew]  # Update basis
+        V_ik = xp.zeros((self.local_size, 0), dtype="float")
+        W_ik = xp.zeros((self.local_size, 0), dtype="float")
+        if self.orthogonalization == "block":
+            V_ik = self.block_cgs2(V_ik, V_inew)
+            dim_S = V_ik.shape[1]
+        else:
+            # Initialize; normalize first basis vector
+            v_inew = xp.array(V_inew[:, :1], dtype="float")
+            (norm_vnew,) = self.distributed_norms(v_inew)
+            V_ik = xp.c_[V_ik, v_inew / norm_vnew]
+            for j in range(1, dim_S):
+                # Orthogonalize next vector against previous ones in restart basis
+                v_inew, norm_vnew = self.mgs(V_ik[:, :j], V_inew[:, j])
+                V_ik = xp.c_[V_ik, v_inew]  # Update basis
         n_newvecs = dim_S
         return dim_S, n_newvecs, V_ik, W_ik
 
@@ -2338,43 +3712,160 @@ class Davidson_manager(object):
         """Parallel implementation of Modified Graham-Schmidt (MGS).
         Takes piece of new guess vector t_ik, and orthogonalizes it against trial subspace V_k.
 
-        :param V_ik: local work variable, numpy matrix
-        :param t_ik: local work variable, numpy vector
+        :param V_ik: local work variable, backend matrix
+        :param t_ik: local work variable, backend vector
 
         :return orthonormalized vector t_ik
         """
         for j in range(V_ik.shape[1]):  # Iterate through k basis vectors
-            c_ij = np.copy(
-                np.inner(V_ik[:, j], t_ik)
+            c_ij = np.array(
+                self.backend.asnumpy(self.xp.inner(V_ik[:, j], t_ik)), dtype="float", ndmin=1
             )  # Each process computes partial inner-product
             c_j = np.zeros(1, dtype="float")  # Pre-allocate
             self.comm.Allreduce([c_ij, MPI.DOUBLE], [c_j, MPI.DOUBLE])  # Default op=SUM
-            t_ik = t_ik - c_j * V_ik[:, j]  # Remove component of t_ik in V_ik
-        t_k = np.zeros(
-            self.full_problem_size, dtype="float"
-        )  # Pre-allocate space to receive new guess vector
-        self.comm.Allgatherv([t_ik, MPI.DOUBLE], [t_k, self.distribution, self.offsets, MPI.DOUBLE])
-        norm_tk = np.linalg.norm(t_k)
+            t_ik = t_ik - c_j[0] * V_ik[:, j]  # Remove component of t_ik in V_ik
+        (norm_tk,) = self.distributed_norms(t_ik[:, None])
         return t_ik / norm_tk, norm_tk  # Return new orthonormalized vector
 
-    def preconditioning(self, D_i, l_k, r_ik):
-        """Preconditon next guess vector
+    def allreduce_gram(self, A_ik, B_ik):
+        """A_k.T * B_k, for row-distributed A_k and B_k: one Allreduce of a small matrix
+
+        :param A_ik, B_ik: local rows, backend arrays (self.local_size x a), (self.local_size x b)
+
+        :return (a x b) numpy (host) array, same on all ranks
+        """
+        G_i = np.ascontiguousarray(self.backend.asnumpy(self.xp.dot(A_ik.T, B_ik)), dtype="float")
+        G = np.zeros_like(G_i)
+        self.comm.Allreduce([G_i, MPI.DOUBLE], [G, MPI.DOUBLE])  # Default op=SUM
+        return G
+
+    def distributed_norms(self, X_ik):
+        """2-norms of the columns of a row-distributed X_k,
+        from the reduction of the local squared norms (nothing of size n is communicated)
 
-        :param D_i: diagonal portion of local Hamiltonian, as a numpy vector
-        :param l_k: an eigenvalue, as a scalar
-        :param r_ik: residual, a numpy vector
+        :param X_ik: local rows, backend array (self.local_size x m)
 
-        :return numpy vector
+        :return numpy (host) vector of size m, same on all ranks
         """
-        # Build diagonal preconditioner
-        M_k = np.diag(np.clip(np.reciprocal(D_i - l_k), a_min=-1e5, a_max=1e5))
-        return np.dot(M_k, r_ik)
+        sq_i = np.ascontiguousarray(self.backend.asnumpy(self.xp.einsum("ij,ij->j", X_ik, X_ik)))
+        sq = np.zeros_like(sq_i)
+        self.comm.Allreduce([sq_i, MPI.DOUBLE], [sq, MPI.DOUBLE])
+        return np.sqrt(sq)
+
+    @staticmethod
+    def svqb(T_ik, G, tol, xp=np):
+        """Orthonormalize the columns of T_k knowing their Gram matrix G = T_k.T * T_k
+        (SVQB, [Stathopoulos & Wu, 2002]); directions of norm < tol are dropped.
+        Only uses G, so no communication. G (small) is on the host, T_k in the array module `xp`.
+
+        >>> T = np.array([[1.0, 1.0, 2.0], [0.0, 1.0, 0.0], [0.0, 0.0, 0.0]])
+        >>> Q = Davidson_manager.svqb(T, T.T @ T, 1e-10)
+        >>> Q.shape
+        (3, 2)
+        >>> np.allclose(Q.T @ Q, np.eye(2))
+        True
+        """
+        d = np.sqrt(np.clip(np.diag(G), 0.0, None))
+        (keep,) = np.nonzero(d > tol)
+        T_ik, G, d = T_ik[:, xp.asarray(keep)], G[np.ix_(keep, keep)], d[keep]
+        # Scaling by the diagonal first makes the eigendecomposition well conditioned
+        L, U = np.linalg.eigh(G / np.outer(d, d))
+        # (eigenvalues of the order of the machine epsilon are only noise)
+        keep = L > max(tol * tol, 100 * np.finfo(float).eps)
+        return xp.dot(T_ik / xp.asarray(d), xp.asarray(U[:, keep] / np.sqrt(L[keep])))
+
+    def block_cgs2(self, V_ik, T_ik, tol=1e-10):
+        """Parallel block classical Gram-Schmidt with reorthogonalization (CGS2).
+        Orthonormalizes the new vectors T_k against the orthonormal basis V_k, and among themselves.
+
+        Each of the two passes is one projection, with a single Allreduce of the
+        (k + p) x p Gram matrix [V_k T_k].T * T_k, followed by a SVQB,
+        with a single Allreduce of the p x p Gram matrix of the projected vectors.
+        So the number of collectives doesn't depend on k nor p.
+        The second pass restores the orthogonality lost by classical GS ("twice is enough").
+
+        :param V_ik: local rows of the basis, backend array (self.local_size x k)
+        :param T_ik: local rows of the new vectors, backend array (self.local_size x p)
+        :param tol: new vectors (or combination of) whose relative norm after projection is < tol
+            are dropped, as in `distributed_davidson` with MGS
+
+        :return local rows of the p' <= p orthonormalized vectors, backend array
+        """
+        xp = self.xp
+        k = V_ik.shape[1]
+        T_ik = xp.array(T_ik, dtype="float", ndmin=2)
+        for it in range(2):
+            M = self.allreduce_gram(xp.c_[V_ik, T_ik], T_ik)
+            C = M[:k]
+            if it == 0:
+                # Normalize the input first, so that the drop tolerance is relative
+                norms = np.sqrt(np.clip(np.diag(M[k:]), 0.0, None))
+                (nonzero,) = np.nonzero(norms > 0.0)
+                T_ik = T_ik[:, xp.asarray(nonzero)] / xp.asarray(norms[nonzero])
+                C = C[:, nonzero] / norms[nonzero]
+            T_ik = T_ik - xp.dot(V_ik, xp.asarray(C))
+            T_ik = self.svqb(T_ik, self.allreduce_gram(T_ik, T_ik), tol, xp)
+        return T_ik
+
+    def make_preconditioner(self, V_iguess) -> Diagonal_preconditioner:
+        """`preconditioner' of this solve; the block is chosen from the first guess vector
+        (local rows, backend array)"""
+        with profiler.timer(f"Davidson {self.preconditioner} preconditioner setup"):
+            if self.preconditioner == "diagonal":
+                D_i = self.backend.asarray(self.H_i_generator.D_i)
+                return Diagonal_preconditioner(D_i, self.xp)
+            c_i = self.backend.asnumpy(V_iguess[:, 0])
+            return Block_preconditioner.from_generator(
+                self.comm, self.H_i_generator, c_i, self.block_size, self.backend
+            )
 
     def print_master(self, str_):
         """Master rank prints inputted str"""
         if self.rank == self.MPI_master_rank:
             print(str_)
 
+    @cached_property
+    def H_i_device(self):
+        """H_i as a sparse matrix of the backend; copied to the device once, for all the products"""
+        return self.backend.csr(self.H_i_generator.H_i_sparse)
+
+    def H_i_matrix_product(self, V_ik):
+        """W_i = H_i * V_k, from the local rows V_ik of V_k; V_ik and W_i backend arrays.
+        V_k is gathered (`allgather_rows'); with distributed determinants, only the rows of V_k
+        that H_i needs are exchanged, on the host (`Hamiltonian_generator.H_i_halo_product').
+        When H_i is not entirely cached (`memory_budget'), the blocks are generated on the host,
+        so is the product; only V_k and W_i cross. So is the product of a symmetric H (its
+        transposed part is reduce-scattered)."""
+        H_i_generator = self.H_i_generator
+        if H_i_generator.det_storage == "distributed":
+            W_i = H_i_generator.H_i_halo_product(self.backend.asnumpy(V_ik))
+            return self.backend.asarray(W_i)
+        V_k = self.backend.asarray(self.allgather_rows(V_ik))
+        if not self.backend.on_device:
+            return H_i_generator.H_i_implicit_matrix_product(V_k)  # Default is to cache
+        cached = H_i_generator.memory_budget is None or "H_i_sparse" in H_i_generator.__dict__
+        if cached and not H_i_generator.symmetric:
+            return self.H_i_device.dot(V_k)
+        W_i = H_i_generator.H_i_implicit_matrix_product(self.backend.asnumpy(V_k))
+        return self.backend.asarray(W_i)
+
+    def allgather_rows(self, X_ik):
+        """Full X_k on all ranks, from its local rows X_ik (a backend array)
+
+        :return X_k, on the device with a device-aware MPI, else a numpy (host) array
+        """
+        m = X_ik.shape[1]
+        device_buffers = self.backend.on_device and self.backend.device_aware_mpi
+        xp = self.xp if device_buffers else np
+        X_ik = xp.ascontiguousarray(X_ik if device_buffers else self.backend.asnumpy(X_ik))
+        X_k = xp.zeros((self.full_problem_size, m), dtype="float")
+        self.backend.synchronize()
+        self.comm.Allgatherv(
+            [X_ik, MPI.DOUBLE],
+            [X_k, m * np.array(self.distribution), m * np.array(self.offsets), MPI.DOUBLE],
+        )
+        return X_k
+
     def initial_guess_vectors(self, n, dim_S):
         """Generate standard initial guess vectors for Davidson's iteration.
         Locally distributed canonical basis vectors
@@ -2382,10 +3873,11 @@ class Davidson_manager(object):
         :param n: full problem size
         :param dim_S: initial subspace dimension
         """
-        I = np.eye(n, dim_S)
-        V_iguess = I[
-            self.offsets[self.rank] : (self.offsets[self.rank] + self.distribution[self.rank]), :
-        ]
+        # Local rows of the n x dim_S identity
+        V_iguess = np.zeros((self.local_size, dim_S), dtype="float")
+        begin = self.offsets[self.rank]
+        for j in range(begin, min(begin + self.local_size, dim_S)):
+            V_iguess[j - begin, j] = 1.0
 
         return V_iguess
 
@@ -2398,7 +3890,9 @@ class Davidson_manager(object):
 
         :param H: self.full_problem_size \times self.full_problem_size symmetric Hamiltonian
         :param H_i: self.local_size \times self.full_problem_size `short and fat' locally distributed H
-        :param V_iguess: self.local_size \times dim_S initial guess vectors
+        :param V_iguess: self.local_size \times dim_S initial guess vectors (local rows),
+            orthonormalized here (e.g. `Powerplant_manager.warm_start_guess`).
+            Default: canonical basis vectors, see `initial_guess_vectors`
         :param n_eig: number of desired eigenpairs
         :param conv_tol: convergence tolerance
         :param subspace_tol: tolerance for adding new basis vectors to trial subspace (avoids ill-conditioning)
@@ -2407,56 +3901,57 @@ class Davidson_manager(object):
         :param q: memory footprint tuning, q is maximally allowed subspace dimension
 
         :return a list of `n_eig` eigenvalues/associated eigenvectors, as numpy vector/array resp.
+            (on the host, whatever the backend)
         """
+        xp, backend = self.xp, self.backend
         # Initialization steps
         n = self.full_problem_size  # Save full problem size
         # Establish local vars: trial subspace (V_ik) and action of H_i on full V_k (W_ik = H_i * V_k)
-        V_ik = np.zeros((self.local_size, 0), dtype="float")
-        W_ik = np.zeros((self.local_size, 0), dtype="float")
+        V_ik = xp.zeros((self.local_size, 0), dtype="float")
+        W_ik = xp.zeros((self.local_size, 0), dtype="float")
         # Set initial guess vectors and minimal initial subspace dimension
-        dim_S = min(m, n)
-        assert m >= n_eig  # No. of initial guess vectors must be >= no. of desired energy values
-        # Set initial guess vectors TODO: For now, have some default guess vectors for testing
         if V_iguess is None:
-            V_iguess = self.initial_guess_vectors(n, dim_S)
+            dim_S = min(m, n)
+            # No. of initial guess vectors must be >= no. of desired energy values
+            assert m >= n_eig
+            V_iguess = backend.asarray(self.initial_guess_vectors(n, dim_S))
         else:  # Else, check dimensions of initial guess vectors align with other inputs
-            assert (n, m) == V_iguess.shape
-        V_ik = np.c_[V_ik, V_iguess]
-        # Build `diagonal` of local Hamiltonian
-        D_i = self.H_i_generator.D_i
+            assert V_iguess.shape[0] == self.local_size
+            V_iguess = self.block_cgs2(V_ik, backend.asarray(V_iguess))
+            dim_S = V_iguess.shape[1]
+            assert dim_S >= n_eig
+        V_ik = xp.c_[V_ik, V_iguess]
+        # From the `diagonal` of the local Hamiltonian (and its block of the leading determinants)
+        preconditioner = self.make_preconditioner(V_iguess)
 
         n_newvecs = dim_S  # No. of vectors added is initial subspace dimension
         restart = True
+        # (set on every exit: converged, or not when `max_iter' is reached)
+        self.n_iterations = 0
         for k in range(1, max_iter):
+            self.n_iterations = k
+            profiler.count("Davidson iterations")
+            profiler.count(f"Davidson iterations, {self.preconditioner} preconditioner")
             self.print_master(
                 f"Process rank: {self.rank}, Iterate: {k}, Subspace dimension: {dim_S}"
             )
-            # Gather full trial vectors added during previous iteration on each rank
-            V_new = np.zeros((n, n_newvecs), dtype="float")
-            V_inew = np.array(V_ik[:, -n_newvecs:], dtype="float")
-            self.comm.Allgatherv(
-                [V_inew, MPI.DOUBLE],
-                [
-                    V_new,
-                    n_newvecs * np.array(self.distribution),
-                    n_newvecs * np.array(self.offsets),
-                    MPI.DOUBLE,
-                ],
-            )
+            # Trial vectors added during previous iteration (gathered by `H_i_matrix_product')
+            V_inew = V_ik[:, -n_newvecs:]
             # Compute new columns of W_ik, W_inew = H_i * V_new
             # TODO: Some maximal allowed dimension before we switch to on the fly?
-            W_inew = self.H_i_generator.H_i_implicit_matrix_product(V_new)  # Default is to cache
-            W_ik = np.c_[W_ik, W_inew]
+            W_inew = self.H_i_matrix_product(V_inew)
+            W_ik = xp.c_[W_ik, W_inew]
 
             # Each rank computes partial update to the projected Hamiltonian S_k
+            # (the products are done by the backend, S_ik itself is small and kept on the host)
             if restart:  # If True, need to compute full S_k explicitly
-                S_ik = np.dot(V_ik.T, W_ik)
+                S_ik = backend.asnumpy(xp.dot(V_ik.T, W_ik))
                 restart = False
             else:  # Else, append new rows & columns
-                S_inew_c = np.dot(V_ik[:, :-n_newvecs].T, W_inew)
-                S_ik = np.c_[S_ik, S_inew_c]
-                S_inew_r = np.c_[np.dot(V_inew.T, W_ik[:, :-n_newvecs]), np.dot(V_inew.T, W_inew)]
-                S_ik = np.r_[S_ik, S_inew_r]
+                S_inew_c = xp.dot(V_ik[:, :-n_newvecs].T, W_inew)
+                S_inew_r = xp.c_[xp.dot(V_inew.T, W_ik[:, :-n_newvecs]), xp.dot(V_inew.T, W_inew)]
+                S_ik = np.c_[S_ik, backend.asnumpy(S_inew_c)]
+                S_ik = np.r_[S_ik, backend.asnumpy(S_inew_r)]
             # Reduce contributions and form new S_k
             S_k = np.zeros((dim_S, dim_S), dtype="float")
             self.comm.Allreduce([S_ik, MPI.DOUBLE], [S_k, MPI.DOUBLE])
@@ -2465,23 +3960,16 @@ class Davidson_manager(object):
             L_k, Y_k = L_k[:n_eig], Y_k[:, :n_eig]
 
             n_newvecs = 0  # Initialize counter; no. of new vectors added to trial subspace
-            X_ik = np.dot(V_ik, Y_k)  # Pre-compute Ritz vectors (V_ik updated each iteration)
+            Y_k_backend = backend.asarray(Y_k)
+            X_ik = xp.dot(V_ik, Y_k_backend)  # Pre-compute Ritz vectors (V_ik updated each iter.)
             # Each rank computes local portion of residuals simultaneously
-            R_i = np.dot(W_ik, Y_k) - np.dot(X_ik, np.diag(L_k))
-            R = np.zeros((n, n_eig), dtype="float")  # Pre-allocate space for residuals
-            self.comm.Allgatherv(
-                [R_i, MPI.DOUBLE],
-                [
-                    R,
-                    n_eig * np.array(self.distribution),
-                    n_eig * np.array(self.offsets),
-                    MPI.DOUBLE,
-                ],
-            )  # Gather full residuals on each rank to compute norm
+            R_i = xp.dot(W_ik, Y_k_backend) - X_ik * backend.asarray(L_k)
+            # Norms of the residuals, without gathering them
+            res_norms = self.distributed_norms(R_i)
             # Track converged eigenpairs; True if R[:, j] < eps -> jth pair has converged
             converged, working_indices = [], []
             for j in range(n_eig):
-                res = np.linalg.norm(R[:, j])
+                res = res_norms[j]
                 self.print_master(f"||r_j||: {res}")
                 converged.append(res < conv_tol)
                 # If jth eigenpair not converged, add to list of working indices
@@ -2495,27 +3983,33 @@ class Davidson_manager(object):
             if all(converged):  # Convergence check
                 self.print_master("All eigenvalues converged, exiting iteration")
                 break
+            T_ik = xp.zeros((self.local_size, 0), dtype="float")
             for j in working_indices:  # Iterate through non-converged eigenpairs
                 self.print_master(
                     f"Eigenvalue {j}: not converged, preconditioning next trial vector"
                 )
                 # Precondition next trial vector
-                t_ik = self.preconditioning(D_i, L_k[j], R_i[:, j])
+                t_ik = preconditioner(L_k[j], R_i[:, j], X_ik[:, j])
+                if self.orthogonalization == "block":
+                    T_ik = xp.c_[T_ik, t_ik]
+                    continue
                 # Orthogonalize new trial vector against previous basis vectors via parallel-MGS
-                t_k = np.zeros(n, dtype="float")
-                self.comm.Allgatherv(
-                    [np.array(t_ik, dtype="float"), MPI.DOUBLE],
-                    [t_k, self.distribution, self.offsets, MPI.DOUBLE],
-                )
-                t_ik = t_ik / np.linalg.norm(t_k)
-                t_ik, norm_tk = self.mgs(V_ik, t_ik)
+                (norm_tk,) = self.distributed_norms(t_ik[:, None])
+                t_ik, norm_tk = self.mgs(V_ik, t_ik / norm_tk)
                 # If new trial vector is `small`, ignore. Avoids ill-conditioning
                 if norm_tk > subspace_tol:
-                    V_ik = np.c_[V_ik, t_ik]  # Append new vector to trial subspace
+                    V_ik = xp.c_[V_ik, t_ik]  # Append new vector to trial subspace
                     n_newvecs += 1
+            if self.orthogonalization == "block":
+                # Orthogonalize all the new trial vectors at once; `small` ones are dropped
+                T_ik = self.block_cgs2(V_ik, T_ik, subspace_tol)
+                V_ik = xp.c_[V_ik, T_ik]
+                n_newvecs = T_ik.shape[1]
 
             dim_S = V_ik.shape[1]  # Update dimension of trial subspace
 
+            if q <= dim_S or n_newvecs == 0:
+                profiler.count("Davidson restarts")
             if q <= dim_S:  # Collapose trial basis
                 self.print_master(f"q <= dim_S: {dim_S}, restarting Davidson's")
                 dim_S, n_newvecs, V_ik, W_ik = self.parallel_iteration_restart(
@@ -2535,13 +4029,8 @@ class Davidson_manager(object):
         else:
             raise NotImplementedError("Davidson not converged")
 
-        m = X_ik.shape[1]  # Same across all ranks
-        X_k = np.zeros((n, m), dtype="float")
         # Gather Ritz vectors on all ranks
-        self.comm.Allgatherv(
-            [X_ik, MPI.DOUBLE],
-            [X_k, m * np.array(self.distribution), m * np.array(self.offsets), MPI.DOUBLE],
-        )
+        X_k = backend.asnumpy(self.allgather_rows(X_ik))
 
         return L_k, X_k
 
@@ -2559,10 +4048,14 @@ class Powerplant_manager(object):
 
     # Generator class for current basis of determinants
     # Each rank has instance of this corresponding to locally stored dets psi_local \subset psi_internal
-    def __init__(self, comm, H_i_generator: Hamiltonian_generator):
+    def __init__(self, comm, H_i_generator: Hamiltonian_generator, constraint_scheduling="dynamic"):
+        if constraint_scheduling not in ("dynamic", "static"):
+            raise NotImplementedError
+        self.constraint_scheduling = constraint_scheduling
         self.comm = comm
-        self.world_size = self.comm.Get_size()  # No. of processes running
-        self.rank = self.comm.Get_rank()  # Rank of current process
+        # (From the generator: no MPI call, it's also created by the workers, see `map_constraints')
+        self.world_size = H_i_generator.world_size  # No. of processes running
+        self.rank = H_i_generator.rank  # Rank of current process
         self.MPI_master_rank = 0  # Master rank
         self.H_i_generator = H_i_generator
         # Hamiltonian_generator computes dist. of work, so pass these to this class for easier reference.
@@ -2570,9 +4063,13 @@ class Powerplant_manager(object):
         self.internal_distribution = H_i_generator.distribution
         # Offsets + distribution used for distributed computation of E_var
         self.internal_offsets = H_i_generator.offsets
-        self.psi_internal = self.H_i_generator.psi_internal
         self.N_orb = self.H_i_generator.N_orb
 
+    @property
+    def psi_internal(self) -> Psi_det:
+        # (Distributed determinants: gathered at first use, only by the replicated PT2)
+        return self.H_i_generator.psi_internal
+
     @cached_property
     def DM(self):
         # Instance of Davidson_manager() class for diagonalizing the Hamiltonian
@@ -2582,15 +4079,58 @@ class Powerplant_manager(object):
     def E_and_psi_coef(self) -> Tuple[Energy, Psi_coef]:
         """Diagonalize Hamiltonian in // and return ground state energy (new E) and corresponding eigenvector (new psi_coef)
         Done per CIPSI iteration"""
+        energies, coeffs = self.diagonalize()
+        E, psi_coef = energies[0], coeffs[:, 0]
+        return E, psi_coef
+
+    def diagonalize(self, V_iguess=None, n_eig=1):
+        """The `n_eig' lowest eigenpairs of H, (energies, coefficients as columns).
+        :param V_iguess: local rows of the Davidson guess vector(s), e.g. from `warm_start_guess'"""
         try:
-            energies, coeffs = self.DM.distributed_davidson()
+            with profiler.timer("Davidson"):
+                energies, coeffs = self.DM.distributed_davidson(V_iguess, n_eig=n_eig, m=n_eig)
         except NotImplementedError:
             print("Davidson Failed, fallback to numpy eigh")
-            psi_H_psi = self.lewis.H  # Build full Hamiltonian
+            psi_H_psi = self.H_i_generator.H  # Build full Hamiltonian
             energies, coeffs = np.linalg.eigh(psi_H_psi)
+        return energies[:n_eig], coeffs[:, :n_eig]
 
-        E, psi_coef = energies[0], coeffs[:, 0]
-        return E, psi_coef
+    def warm_start_guess(self, psi_coef) -> np.ndarray:
+        """Davidson guess for this wave function, from the eigenvector(s) `psi_coef' of the wave
+        function it was extended from (by `Hamiltonian_generator.extend', so old determinants
+        are at `old_to_new'). Several roots (the previous Ritz block) are given as columns.
+
+        The new determinants |a> get their first-order perturbative coefficient
+            c_a = <a|H|psi> / (E - <a|H|a>)
+        The numerators come from one product by the local rows of H, which is cached anyway
+        for the Davidson iterations that follow.
+
+        :return local rows of the guess vector(s), (self.local_size x number of roots)
+        """
+        C_old = np.array(psi_coef, dtype="float").reshape(len(psi_coef), -1)
+        old_to_new = getattr(self.H_i_generator, "old_to_new", np.arange(len(C_old)))
+        C = np.zeros((self.full_problem_size, C_old.shape[1]), dtype="float")
+        C[old_to_new] = C_old
+        is_new = np.ones(self.full_problem_size, dtype=bool)
+        is_new[old_to_new] = False
+
+        local = slice(
+            self.internal_offsets[self.rank],
+            self.internal_offsets[self.rank] + self.internal_distribution[self.rank],
+        )
+        C_i, is_new_i = C[local], is_new[local]
+        HC_i = self.H_i_generator.H_i_implicit_matrix_product(C)
+        # <psi|H|psi> / <psi|psi> for each root
+        EN_i = np.array([np.einsum("ij,ij->j", C_i, HC_i), np.einsum("ij,ij->j", C_i, C_i)])
+        EN = np.zeros_like(EN_i)
+        self.comm.Allreduce([EN_i, MPI.DOUBLE], [EN, MPI.DOUBLE])
+        E = EN[0] / EN[1]
+        # The new determinants are those which were not selected because |c_a| would be small,
+        # the denominators are not close to 0; but clip them like in the preconditioner
+        denominators = E[None, :] - self.H_i_generator.D_i[is_new_i][:, None]
+        denominators = np.where(np.abs(denominators) < 1e-5, -1e-5, denominators)
+        C_i[is_new_i] = HC_i[is_new_i] / denominators
+        return C_i
 
     def E(self, psi_coef: Psi_coef) -> Energy:
         """Compute the variatonal energy associated with psi_det
@@ -2619,12 +4159,76 @@ class Powerplant_manager(object):
         # TODO: Fix this if there's a more efficient way to convert to a float
         return E.item()
 
+    @property
+    def worker_pool(self) -> Worker_pool:
+        return self.H_i_generator.worker_pool
+
+    def prepare_workers(self):
+        """Compute what is collective in `psi_external_pt2' (`diagonal_engine'), before the
+        sweeps by the workers: it's given to them by `map_constraints'"""
+        self.H_i_generator.diagonal_engine
+
+    def map_constraints(self, method, args, constraints) -> Iterator:
+        """method(self, *args, C) for each constraint C, by the worker pool, in any order.
+        `method' is a method of Powerplant_manager; each worker calls it on its own
+        Powerplant_manager, of its copy of H_i_generator (see `Worker_pool.map')."""
+        if not self.worker_pool.parallel:
+            return map(partial(method, self, *args), constraints)
+        return self.worker_pool.map(
+            Powerplant_manager.worker_task,
+            (self.H_i_generator.D_internal, method) + tuple(args),
+            constraints,
+            ordered=False,
+        )
+
+    @staticmethod
+    def worker_task(lewis: Hamiltonian_generator, D_internal, method, *args):
+        # (In a worker) `D_internal' is collective, so it comes from the rank
+        if "D_internal" not in lewis.__dict__:
+            lewis.D_internal = D_internal
+        return partial(method, Powerplant_manager(lewis.comm, lewis), *args)
+
+    def E_pt2_constraint(self, psi_coef: Psi_coef, E_var: Energy, C) -> Energy:
+        # E_pt2 contribution of the determinants of a constraint
+        _, E_pt2_conts_local = self.psi_external_pt2(C, psi_coef, E_var)
+        return sum(E_pt2_conts_local)
+
+    def selection_constraint(self, psi_coef: Psi_coef, n, E_var: Energy, C):
+        # (E_pt2 contribution of a constraint, its n best determinants, their contributions)
+        psi_connected_C, E_pt2_energies_C = self.psi_external_pt2(C, psi_coef, E_var)
+        E_C = E_pt2_energies_C.sum()
+        return (E_C,) + self.most_negative(psi_connected_C, E_pt2_energies_C, n)
+
+    @staticmethod
+    def most_negative(dets: Psi_det, energies: np.ndarray, n):
+        """The n determinants of most negative energy (in no particular order)
+        >>> dets, energies = Powerplant_manager.most_negative(
+        ...     ["a", "b", "c"], np.array([-1.0, -3.0, -2.0]), 2
+        ... )
+        >>> sorted(dets), sorted(energies.tolist())
+        (['b', 'c'], [-3.0, -2.0])
+        """
+        if len(energies) <= n:
+            return dets, energies
+        idx = np.argpartition(energies, n)[:n]
+        return [dets[i] for i in idx.tolist()], energies[idx]
+
     def gen_local_constraints(self) -> Iterator[Tuple[OrbitalIdx, ...]]:
         # Generate local constraints
-        # Call to MPI function that yields local constraints
-        C_loc, _ = dispatch_local_constraints(self.comm, self.psi_internal, self.N_orb)
-        for C in C_loc:
-            yield C
+        # Collective: the constraints are handed out dynamically, largest first, to the ranks
+        # as they finish their previous one (static: pre-computed greedy assignment)
+        # The diagonal elements of psi_internal are gathered before: a rank may get no constraint
+        self.H_i_generator.diagonal_engine
+        if self.constraint_scheduling == "static":
+            C_loc, _ = dispatch_local_constraints(
+                self.comm, self.psi_internal, self.N_orb, irreps=self.H_i_generator.irreps
+            )
+            yield from C_loc
+        else:
+            tasks = constraint_tasks(
+                self.comm, self.psi_internal, self.N_orb, irreps=self.H_i_generator.irreps
+            )
+            yield from dynamic_constraints(self.comm, tasks)
 
     def psi_external_pt2(
         self, C: Tuple[OrbitalIdx, ...], psi_coef: Psi_coef, E_var: Energy
@@ -2638,6 +4242,8 @@ class Powerplant_manager(object):
         :param C: (Triplet) constraint |C⟩ = |a_0 a_1 a_2⟩-> Specify the three highest occupied alpha spin orbitals
                   This function only generates determinants |C⟩ (and the corresponding E_pt2 contributions)
                   s.to C (i.e., only generate connected dets occupied in orbitals a_0, a_1, a_2)
+                  Or quadruplet constraint (q, a_0, a_1, a_2): a triplet split further by
+                  the 4th highest occupied alpha orbital q (see `constraint_tasks`)
         :param psi_coef: list of determinant coefficients in expansion of trial WF
 
         Outputs:
@@ -2647,86 +4253,195 @@ class Powerplant_manager(object):
         # Compute len(psi_internal) \times len(psi_external_chunk) `Hamiltonian'
         # Each rank computes its contributions in place, these are then gathered to compute the full pt2 energy in self.E_pt2
         c = np.array(psi_coef, dtype="float")  # Coef. vector as np array
-        # Pre-allocate space for nominators of E_pt2 contributions (as dict for now)
-        nominator_conts_table = defaultdict(int)
-        # Two-electron matrix elements
+        psi_i, q = self.psi_internal, None
+        if len(C) == 4:
+            # Only the |I⟩ which can be connected to a |J⟩ satisfying the quadruplet are used,
+            # and the generated |J⟩ which don't satisfy it are dropped
+            q, C = C[0], tuple(C[1:])
+            candidates = self.quadruplet_candidates(q, C)
+            psi_i, c = [self.psi_internal[I] for I in candidates.tolist()], c[candidates]
+        dets_J, conts, sources = self.connected_nominators(C, psi_i, c)
+        if q is not None:
+            keep = np.array([det_J.alpha[-4] == q for det_J in dets_J], dtype=bool)
+            dets_J, conts = list(compress(dets_J, keep)), conts[keep]
+            sources = candidates[sources[keep]]
+
+        # `Sort and accumulate` E_pt2 contributions corresponding to individual dets ∣J⟩,
+        # internal determinants are removed
+        psi_connected_C, nominator_conts, first = self.accumulate_nominators(
+            dets_J, conts, return_index=True
+        )
+        profiler.count("connected dets (external, distinct)", len(psi_connected_C))
+        # <J|H|J> from the diagonal element of the (first) |I⟩ it was generated from
+        diagonal = self.H_i_generator.diagonal_engine.H_jj(sources[first], psi_connected_C)
+        denominator_conts = np.divide(1.0, E_var - diagonal)
+
+        # Compute E_pt2 contributions of this subset of connected space
+        # Do this einsum in place, then Reduce later
+        # Return the determinants we generated as well for the selection step
+        return psi_connected_C, np.einsum(
+            "i,i,i -> i", nominator_conts, nominator_conts, denominator_conts
+        )  # vector * vector * vector -> scalar
+
+    def connected_nominators(self, C: Tuple[OrbitalIdx, ...], psi_i: Psi_det, c: np.ndarray):
+        """The individual nominator contributions c[I] * <I|H|J> of the |J⟩ satisfying the
+        (triplet) constraint C, generated from the |I⟩ of psi_i (of coefficients c).
+
+        :return (|J⟩ of each contribution, contributions, index in psi_i of their |I⟩)
+            a |J⟩ appears once per contribution, internal ones included
+        """
+        # Individual nominator contributions c[I] * <I|H|J>, as (|J⟩, value) pairs, in order.
+        # Two-electron values are filled at the end, with all their integrals fetched at once
+        # (`sources': the |I⟩ of each |J⟩, for its diagonal element, see `Diagonal_engine`)
+        dets_J, conts, sources = [], [], []
+        pos_2e, Is, idxs, phases = [], [], [], []
 
         # By constraint:
         # for C in constraints:
         #   for I, J in gen_connected_by_constraint(psi_internal, C):
         #       E_pt2_J <- (|J⟩, c[I]* <I|H|J>)
-        # Store pairs of (|J⟩, E_pt2_J) -> By end of inner loop, partial contribution of |J⟩ to E_pt2 is fully computed
-        # As in [Tubman et al., `18] they instead store individual numerator conts separately, do a sort by bistring, then aggregate across bitstrings
+        # As in [Tubman et al., `18], individual numerator conts are stored separately,
+        # then sorted by (packed) determinant and aggregated, see `accumulate_nominators`
+
+        def emit_2e(I, det_J, idx, phase):
+            pos_2e.append(len(dets_J))
+            dets_J.append(det_J)
+            conts.append(0.0)
+            sources.append(I)
+            Is.append(I)
+            idxs.append(idx)
+            phases.append(phase)
+
+        # With point-group symmetry, the |J⟩ of another irrep than |I⟩ are not generated
+        irreps = self.H_i_generator.irreps
+
+        def singles(det_I):
+            return det_I.triplet_constrained_single_excitations_from_det(
+                C, self.N_orb, irreps=irreps
+            )
+
+        def doubles(det_I):
+            return det_I.triplet_constrained_double_excitations_from_det(
+                C, self.N_orb, irreps=irreps
+            )
 
         if self.H_i_generator.driven_by == "determinant":
             # Pass over internal determinants
-            for I, det_I in enumerate(self.psi_internal):
+            for I, det_I in enumerate(psi_i):
                 # Inner pass (for each |I⟩) generates all excitations satisfying constraint |C⟩ from |I⟩
                 # Triplet constrained singles
-                for det_J in det_I.triplet_constrained_single_excitations_from_det(C, self.N_orb):
+                for det_J in singles(det_I):
                     for idx, phase in self.H_i_generator.Hamiltonian_2e_driver.H_ij_indices(
                         det_I, det_J
                     ):
-                        nominator_conts_table[det_J] += (
-                            c[I]
-                            * phase
-                            * self.H_i_generator.Hamiltonian_2e_driver.H_ijkl_orbital(*idx)
-                        )
-                    nominator_conts_table[det_J] += c[
-                        I
-                    ] * self.H_i_generator.Hamiltonian_1e_driver.H_ij(det_I, det_J)
+                        emit_2e(I, det_J, idx, phase)
+                    dets_J.append(det_J)
+                    conts.append(c[I] * self.H_i_generator.Hamiltonian_1e_driver.H_ij(det_I, det_J))
+                    sources.append(I)
                 # Triplet-constrained doubles
-                for det_J in det_I.triplet_constrained_double_excitations_from_det(C, self.N_orb):
+                for det_J in doubles(det_I):
                     for idx, phase in self.H_i_generator.Hamiltonian_2e_driver.H_ij_indices(
                         det_I, det_J
                     ):
-                        nominator_conts_table[det_J] += (
-                            c[I]
-                            * phase
-                            * self.H_i_generator.Hamiltonian_2e_driver.H_ijkl_orbital(*idx)
-                        )
+                        emit_2e(I, det_J, idx, phase)
         elif self.H_i_generator.driven_by == "integral":
             for (I, det_J), idx, phase in self.H_i_generator.Hamiltonian_2e_driver.H_indices_pt2(
-                self.psi_internal, C
+                psi_i, C
             ):
-                nominator_conts_table[det_J] += (
-                    c[I] * phase * self.H_i_generator.Hamiltonian_2e_driver.H_ijkl_orbital(*idx)
-                )
+                emit_2e(I, det_J, idx, phase)
             # One-electron matrix elements
-            for I, det_I in enumerate(self.psi_internal):
+            for I, det_I in enumerate(psi_i):
                 # Inner pass (for each |I⟩) generates all excitations satisfying constraint |C⟩ from |I⟩
                 # Triplet constrained singles
                 # Each det_J will show up all connected to multiple I.. so have to do this outside of integral loop
-                for det_J in det_I.triplet_constrained_single_excitations_from_det(C, self.N_orb):
-                    nominator_conts_table[det_J] += c[
-                        I
-                    ] * self.H_i_generator.Hamiltonian_1e_driver.H_ij(det_I, det_J)
+                for det_J in singles(det_I):
+                    dets_J.append(det_J)
+                    conts.append(c[I] * self.H_i_generator.Hamiltonian_1e_driver.H_ij(det_I, det_J))
+                    sources.append(I)
+        elif self.H_i_generator.driven_by == "compiled":
+            # Same excitations as determinant-driven; all the two-electron <I|H|J> at once, below
+            for I, det_I in enumerate(psi_i):
+                for det_J in singles(det_I):
+                    dets_J.append(det_J)
+                    conts.append(c[I] * self.H_i_generator.Hamiltonian_1e_driver.H_ij(det_I, det_J))
+                    sources.append(I)
+                for det_J in doubles(det_I):
+                    dets_J.append(det_J)
+                    conts.append(0.0)
+                    sources.append(I)
         else:
             raise NotImplementedError
 
-        # Remove contributions of internal determinants
-        for det_I in self.psi_internal:
-            if det_I in nominator_conts_table:
-                del nominator_conts_table[det_I]
-        # `Sort and accumulate` E_pt2 contributions corresponding to individual dets ∣J⟩ done in place above...
-        # Each item in (key, item) pair is the partial E_pt2 contribution of ∣J⟩ -> Denoted E_pt2_J
-
-        E_pt2_J = nominator_conts_table.values()
-        nominator_conts = np.array(list(E_pt2_J), dtype="float")
-        # TODO: For integral driven, loop over integrals? In general, be more efficient in this area.
-        # TODO: In general, though, we need a different way to do this. It goes back to storing the connected space. We can even do the denominator conts in a separate array..
-        psi_connected_C = [det_J for det_J in nominator_conts_table.keys()]
-        denominator_conts = np.divide(
-            1.0,
-            E_var - np.array([self.H_i_generator.H_ii(det_J) for det_J in psi_connected_C]),
+        conts = np.array(conts, dtype="float")
+        if self.H_i_generator.driven_by == "compiled":
+            I = np.array(sources, dtype=np.int64)
+            conts += c[I] * self.H_i_generator.Hamiltonian_2e_driver.pair_elements(
+                Psi_det_packed.from_psi_det(psi_i, self.N_orb),
+                Psi_det_packed.from_psi_det(dets_J, self.N_orb),
+                I,
+                np.arange(len(dets_J)),
+            )
+        i, j, k, l = np.array(idxs, dtype=np.int64).reshape(-1, 4).T
+        conts[np.array(pos_2e, dtype=np.int64)] = (
+            c[np.array(Is, dtype=np.int64)]
+            * np.array(phases, dtype="float")
+            * self.H_i_generator.Hamiltonian_2e_driver.H_ijkl_orbitals(i, j, k, l)
         )
 
-        # Compute E_pt2 contributions of this subset of connected space
-        # Do this einsum in place, then Reduce later
-        # Return the determinants we generated as well for the selection step
-        return psi_connected_C, np.einsum(
-            "i,i,i -> i", nominator_conts, nominator_conts, denominator_conts
-        )  # vector * vector * vector -> scalar
+        profiler.count("constraints")
+        profiler.count("connected dets generated", len(dets_J))
+        profiler.peak("connected dets generated per constraint", len(dets_J))
+        return dets_J, conts, np.array(sources, dtype=np.int64)
+
+    @cached_property
+    def alpha_occupations(self) -> np.ndarray:
+        return occupation_matrix(self.psi_internal, "alpha", self.N_orb)
+
+    def quadruplet_candidates(self, q: OrbitalIdx, C: Tuple[OrbitalIdx, ...]) -> np.ndarray:
+        """Indices of the internal determinants |I⟩ which may be connected to a |J⟩ of
+        quadruplet constraint (q, C), i.e. whose 4 highest occupied alpha orbitals are (q, *C).
+        At most 2 alpha electrons move, so |I⟩ has to miss at most 2 of these orbitals,
+        and to occupy at most 2 of the other orbitals above q."""
+        A = self.alpha_occupations
+        n_missing = 4 - A[:, [q, *C]].sum(axis=1)
+        n_above = A[:, q + 1 :].sum(axis=1) - A[:, list(C)].sum(axis=1)
+        return np.flatnonzero((n_missing <= 2) & (n_above <= 2))
+
+    @cached_property
+    def psi_internal_sorted_keys(self) -> np.ndarray:
+        # Sorted packed keys of psi_internal, for the membership tests of `accumulate_nominators`
+        return np.sort(Psi_det_packed.from_psi_det(self.psi_internal, self.N_orb).keys)
+
+    def accumulate_nominators(self, dets_J: Psi_det, conts: np.ndarray, return_index=False):
+        """Sum the individual contributions `conts' of each distinct determinant of `dets_J'
+        which is not in psi_internal.
+        Determinants are packed into fixed-size keys (`Psi_det_packed.keys`), stably sorted and
+        segment-reduced; the internal ones are found by binary search in the sorted keys of
+        psi_internal. Determinants are returned in order of first appearance in `dets_J'.
+
+        :return (distinct external determinants, their summed contributions as a numpy vector)
+                (and, if `return_index', the indices in `dets_J' of the returned determinants)
+        """
+        if not dets_J:
+            empty = [], np.zeros(0, dtype="float")
+            return empty + (np.zeros(0, dtype=np.int64),) if return_index else empty
+        keys = Psi_det_packed.from_psi_det(dets_J, self.N_orb).keys
+        order = np.argsort(keys, kind="stable")
+        keys, conts = keys[order], conts[order]
+        # Segments of equal keys
+        starts = np.flatnonzero(np.r_[True, keys[1:] != keys[:-1]])
+        nominators = np.add.reduceat(conts, starts)
+        keys, first = keys[starts], order[starts]
+        # Vectorized membership test against psi_internal
+        sorted_internal = self.psi_internal_sorted_keys
+        pos = np.minimum(np.searchsorted(sorted_internal, keys), len(sorted_internal) - 1)
+        external = sorted_internal[pos] != keys
+        # Back to the order of appearance
+        by_appearance = np.argsort(first[external], kind="stable")
+        first, nominators = first[external][by_appearance], nominators[external][by_appearance]
+        if return_index:
+            return [dets_J[i] for i in first.tolist()], nominators, first
+        return [dets_J[i] for i in first.tolist()], nominators
 
     def E_pt2(self, psi_coef: Psi_coef) -> Energy:
         """
@@ -2742,12 +4457,18 @@ class Powerplant_manager(object):
 
         # Pre-allocate space for the reduced E_pt2 contributions
         E_var = self.E(psi_coef)  # Pre-compute variational energy
+        if self.H_i_generator.det_storage == "distributed":
+            E_pt2_local, _, _ = self.distributed_pt2_pass(psi_coef, 0, E_var)
+            return self.comm.allreduce(E_pt2_local)
         E_pt2_conts = np.zeros(1, dtype="double")
-        # Generate chunks of the connected space by constraints
-        for C in self.gen_local_constraints():
-            # Track E_pt2 contributions of determinants in the current chunk of the connected space
-            _, E_pt2_conts_local = self.psi_external_pt2(C, psi_coef, E_var)
-            E_pt2_conts += sum(E_pt2_conts_local)
+
+        # Generate chunks of the connected space by constraints (processed by the worker pool)
+        self.prepare_workers()
+        with profiler.timer("PT2 sweep"):
+            for E_C in self.map_constraints(
+                Powerplant_manager.E_pt2_constraint, (psi_coef, E_var), self.gen_local_constraints()
+            ):
+                E_pt2_conts += E_C
 
         # Sum in place -> MPI.Allreduce call
         # Equivalent to MPI AllGather + sum. Do this because we can't store the full external space
@@ -2756,6 +4477,268 @@ class Powerplant_manager(object):
 
         return _E_pt2.item()
 
+    def local_selection_pass(self, psi_coef: Psi_coef, n, E_var: Energy):
+        """
+        One sweep over the local constraints, for both the PT2 energy and the selection:
+        the E_pt2 contributions are summed, and the n largest (in magnitude) are kept.
+        The candidates are buffered and partially sorted (argpartition) only when the buffer
+        gets larger than max(n, 1024), not once per constraint.
+        Constraints are processed by the worker pool; each worker only sends back the n best
+        determinants of a constraint.
+
+        Output:
+        (local E_pt2, n best local determinants, their E_pt2 contributions)
+        If there are less than n candidates, the result is padded with empty determinants
+        of contribution 1 (PT2 contributions are always < 0: these will never be selected)
+        """
+        if self.H_i_generator.det_storage == "distributed":
+            E_pt2_local, best_dets, best_energies = self.distributed_pt2_pass(psi_coef, n, E_var)
+            return (E_pt2_local,) + self.padded_candidates(best_dets, best_energies, n)
+        E_pt2_local = 0.0
+        best_dets, best_energies = [], np.zeros(0, dtype="float")
+        buffer_dets, buffer_energies, n_buffer = [], [], 0
+
+        def prune(dets, energies):
+            return self.most_negative(dets, energies, n)
+
+        self.prepare_workers()
+        constraints = self.gen_local_constraints()
+        with profiler.timer("selection sweep"):
+            for E_C, psi_connected_C, E_pt2_energies_C in self.map_constraints(
+                Powerplant_manager.selection_constraint, (psi_coef, n, E_var), constraints
+            ):
+                E_pt2_local += E_C
+                if not len(E_pt2_energies_C):
+                    continue
+                buffer_dets.append(psi_connected_C)
+                buffer_energies.append(E_pt2_energies_C)
+                n_buffer += len(E_pt2_energies_C)
+                if n_buffer > max(n, 1024):
+                    best_dets, best_energies = prune(
+                        best_dets + list(chain.from_iterable(buffer_dets)),
+                        np.concatenate([best_energies] + buffer_energies),
+                    )
+                    buffer_dets, buffer_energies, n_buffer = [], [], 0
+
+        best_dets, best_energies = prune(
+            best_dets + list(chain.from_iterable(buffer_dets)),
+            np.concatenate([best_energies] + buffer_energies),
+        )
+        return (E_pt2_local,) + self.padded_candidates(best_dets, best_energies, n)
+
+    def padded_candidates(self, best_dets: Psi_det, best_energies: np.ndarray, n):
+        # `Dummy' determinants (empty spin determinants, of the same representation as psi_det)
+        n_dummy = n - len(best_energies)
+        empty = () if self.H_i_generator.det_representation == "tuple" else 0
+        best_dets = best_dets + [Determinant(empty, empty)] * n_dummy
+        best_energies = np.r_[best_energies, np.ones(n_dummy, dtype="float")]
+        return best_dets, best_energies
+
+    @cached_property
+    def owned_internal_keys(self) -> np.ndarray:
+        """Distributed determinants: sorted keys of the internal determinants owned by this
+        rank (`det_owners'), to drop the internal |J⟩ in `distributed_pt2_pass'. Collective"""
+        packed = Psi_det_packed.from_psi_det(self.H_i_generator.psi_local, self.N_orb)
+        words = np.c_[packed.alpha, packed.beta]
+        (words,) = exchange_by_owner(self.comm, det_owners(words, self.world_size), words)
+        n_words = packed.alpha.shape[1]
+        return np.sort(Psi_det_packed(words[:, :n_words], words[:, n_words:]).keys)
+
+    def distributed_pt2_pass(self, psi_coef: Psi_coef, n, E_var: Energy, batch_size=64):
+        """
+        The sweep of `E_pt2' and `local_selection_pass', with distributed determinants.
+        Collective, in lockstep: all the ranks go through all the (triplet) constraints, each
+        one from its own internal determinants |I⟩ only. The nominator of a |J⟩ then has
+        partial sums from several ranks: each rank sums its own, and sends it (with <J|H|J>,
+        from its local |I⟩) to the owner of |J⟩ (`det_owners'), one Alltoallv per batch of
+        `batch_size' constraints. The owner sums the partial nominators, drops the internal
+        |J⟩, and accumulates E_pt2 and its n best candidates.
+        The constraints without any work are skipped, and the others go largest first (total
+        `constraint_costs' over the ranks), in batches of about the cost of `batch_size'
+        average constraints: the heavy ones come alone, the light ones together, so that the
+        batches (and their exchanges) are of about the same size.
+        No worker pool and no dynamic scheduling: a lockstep sweep, where the work of a rank
+        is its share of |I⟩ in each batch (it waits for the slowest rank at every exchange).
+
+        Output:
+        (E_pt2 of the |J⟩ owned by this rank, up to n best of them, their E_pt2 contributions)
+        """
+        lewis = self.H_i_generator
+        begin = self.internal_offsets[self.rank]
+        end = begin + self.internal_distribution[self.rank]
+        c_i = np.array(psi_coef, dtype="float")[begin:end]
+        psi_i, n_words = lewis.psi_local, Psi_det_packed.n_words(self.N_orb)
+        na = self.comm.allreduce(len(psi_i[0].alpha) if psi_i else 0, op=MPI.MAX)
+        constraints = generate_all_constraints(na, self.N_orb)
+        internal_keys = self.owned_internal_keys
+        # (Integer counts: the sums are exact, all the ranks make the same batches)
+        costs_local = np.zeros(len(constraints), dtype="float")
+        if psi_i:
+            costs_local = constraint_costs(psi_i, self.N_orb, constraints, irreps=lewis.irreps)
+        costs = np.zeros(len(constraints), dtype="float")
+        self.comm.Allreduce([costs_local, MPI.DOUBLE], [costs, MPI.DOUBLE])
+        order = np.argsort(-costs, kind="stable")
+        order = order[costs[order] > 0]
+        # Batch of a constraint: from the cost of the ones before it
+        budget = costs.sum() * batch_size / max(1, len(order))
+        batch_of = (np.cumsum(costs[order]) - costs[order]) // max(budget, 1.0)
+        batches = np.split(order, np.flatnonzero(np.diff(batch_of)) + 1) if len(order) else []
+
+        E_pt2_local = 0.0
+        best_words = np.zeros((0, 2 * n_words), dtype=np.uint64)
+        best_energies = np.zeros(0, dtype="float")
+        with profiler.timer("distributed PT2 sweep"):
+            for batch in batches:
+                # (alpha, beta words) and (partial nominator, <J|H|J>) of the local |J⟩
+                words = [np.zeros((0, 2 * n_words), dtype=np.uint64)]
+                values = [np.zeros((0, 2), dtype="float")]
+                for C in (constraints[i] for i in batch.tolist()):
+                    dets_J, conts, sources = self.connected_nominators(C, psi_i, c_i)
+                    if not dets_J:
+                        continue
+                    packed = Psi_det_packed.from_psi_det(dets_J, self.N_orb)
+                    first, nominators = sum_by_key(packed.keys, conts)
+                    diagonal = lewis.local_diagonal_engine.H_jj(
+                        sources[first], [dets_J[i] for i in first.tolist()]
+                    )
+                    words.append(np.c_[packed.alpha[first], packed.beta[first]])
+                    values.append(np.c_[nominators, diagonal])
+                words, values = np.concatenate(words), np.concatenate(values)
+                words, values = exchange_by_owner(
+                    self.comm, det_owners(words, self.world_size), words, values
+                )
+                # Owned |J⟩: sum of the partial nominators
+                keys = Psi_det_packed(words[:, :n_words], words[:, n_words:]).keys
+                first, nominators = sum_by_key(keys, values[:, 0])
+                external = ~is_in_sorted(internal_keys, keys[first])
+                profiler.count("connected dets (external, distinct)", np.count_nonzero(external))
+                first, nominators = first[external], nominators[external]
+                E_J = nominators * nominators / (E_var - values[first, 1])
+                E_pt2_local += E_J.sum()
+                if n:
+                    best_words = np.r_[best_words, words[first]]
+                    best_energies = np.r_[best_energies, E_J]
+                    if len(best_energies) > n:
+                        keep = np.argpartition(best_energies, n)[:n]
+                        best_words, best_energies = best_words[keep], best_energies[keep]
+
+        best = Psi_det_packed(best_words[:, :n_words], best_words[:, n_words:])
+        return E_pt2_local, unpack_psi_det(best, lewis.det_representation), best_energies
+
+    def selection_pass(
+        self, psi_coef: Psi_coef, n, E_var: Energy = None
+    ) -> Tuple[Energy, Energy, Psi_det]:
+        """
+        Fused selection: variational energy, PT2 energy and the n determinants of largest
+        E_pt2 contribution, from a single sweep over the connected space.
+
+        :param E_var: variational energy of psi_coef, if already known (e.g. returned by the
+                      Davidson of the previous iteration); saves one product by H
+        :return (E_var, E_pt2, selected determinants), same on all ranks
+        """
+        if E_var is None:
+            E_var = self.E(psi_coef)
+        E_pt2_local, local_best_dets, local_best_energies = self.local_selection_pass(
+            psi_coef, n, E_var
+        )
+        E_pt2 = self.comm.allreduce(E_pt2_local)
+        with profiler.timer("selection, global top n"):
+            global_best_dets = global_top_n_packed(
+                self.comm, local_best_dets, local_best_energies, n, self.N_orb
+            )
+        return E_var, E_pt2, global_best_dets
+
+    def E_pt2_semistochastic(
+        self,
+        psi_coef: Psi_coef,
+        relative_error=1e-3,
+        deterministic_fraction=0.5,
+        batch_size=4,
+        max_batches=None,
+        seed=0,
+    ) -> Tuple[Energy, float]:
+        """
+        Semistochastic estimate of E_pt2, with its statistical error bar
+        (in the spirit of [Garniron et al., `17], with the triplet constraints as the unit of work)
+
+        Each constraint C gets the weight w_C = sum_I c_I^2 h_IC, with h_IC the number of
+        determinants connected to |I> which satisfy C (see `constraint_costs`).
+        * The constraints of largest weight, carrying `deterministic_fraction` of the total weight,
+          are summed exactly (distributed round-robin over the ranks).
+        * The others are sampled, with replacement, with probability p_C = w_C / sum w_C.
+          e_C / p_C is an unbiased estimate of their sum. Each rank draws `batch_size` samples
+          per batch, and sampling stops once the error bar is below `relative_error` * |E_pt2|
+          (or after `max_batches` batches; or once a rank has computed all of them: it's exact).
+
+        The deterministic `E_pt2` stays the reference for validation.
+
+        Inputs:
+        :param psi_coef: list of determinant coefficients in expansion of trial WF
+
+        Output:
+        (E_pt2, error): estimate and standard error, same on all ranks
+        """
+        if self.H_i_generator.det_storage == "distributed":
+            raise NotImplementedError("semistochastic PT2 with distributed determinants")
+        E_var = self.E(psi_coef)
+        self.H_i_generator.diagonal_engine  # Collective, see `gen_local_constraints'
+        c = np.array(psi_coef, dtype="float")
+        na = len(getattr(self.psi_internal[0], "alpha"))
+        constraints = generate_all_constraints(na, self.N_orb)
+        w = constraint_costs(
+            self.psi_internal, self.N_orb, constraints, c * c, self.H_i_generator.irreps
+        )
+        nonzero = np.flatnonzero(w)
+        order = nonzero[np.argsort(-w[nonzero], kind="stable")]
+        # Deterministic part: leading constraints, up to `deterministic_fraction' of the weight
+        cumulative = np.cumsum(w[order]) / w[order].sum()
+        n_det = int(np.searchsorted(cumulative, deterministic_fraction, side="right"))
+        deterministic, stochastic = order[:n_det], order[n_det:]
+
+        def e_C(idx):
+            # Exact PT2 contribution of a constraint
+            return self.E_pt2_constraint(psi_coef, E_var, constraints[idx])
+
+        local_deterministic = [constraints[i] for i in deterministic[self.rank :: self.world_size]]
+        self.prepare_workers()
+        E_det_C = self.map_constraints(
+            Powerplant_manager.E_pt2_constraint, (psi_coef, E_var), local_deterministic
+        )
+        E_det_local = np.array([sum(E_det_C)], dtype="double")
+        E_det = np.zeros(1, dtype="double")
+        self.comm.Allreduce([E_det_local, MPI.DOUBLE], [E_det, MPI.DOUBLE])
+        if not len(stochastic):
+            return E_det.item(), 0.0
+
+        p = w[stochastic] / w[stochastic].sum()
+        rng = np.random.default_rng([seed, self.rank])
+        cache = {}  # A constraint drawn several times is only computed once
+        # [number of samples, sum of the estimates, sum of their squares]
+        moments_local = np.zeros(3, dtype="double")
+        n_batches = 0
+        while True:
+            for s in rng.choice(len(stochastic), size=batch_size, p=p):
+                if s not in cache:
+                    cache[s] = e_C(stochastic[s])
+                x = cache[s] / p[s]
+                moments_local += [1.0, x, x * x]
+            n_batches += 1
+            moments = np.zeros(3, dtype="double")
+            self.comm.Allreduce([moments_local, MPI.DOUBLE], [moments, MPI.DOUBLE])
+            n, sum_x, sum_x2 = moments
+            mean = sum_x / n
+            error = np.sqrt(max(sum_x2 / n - mean * mean, 0.0) / (n - 1)) if n > 1 else np.inf
+            E_pt2 = E_det.item() + mean
+            # Once a rank knows every stochastic constraint, it has the exact sum (small problems)
+            exact_rank = self.comm.allreduce(
+                self.rank if len(cache) == len(stochastic) else self.world_size, MPI.MIN
+            )
+            if exact_rank < self.world_size:
+                E_sto = self.comm.bcast(sum(cache.values()), root=exact_rank)
+                return E_det.item() + E_sto, 0.0
+            if error < relative_error * abs(E_pt2) or n_batches == max_batches:
+                return E_pt2, error
+
 
 #  __
 # (_   _  |  _   _ _|_ o  _  ._
@@ -2772,14 +4755,23 @@ def selection_step(
     psi_coef: Psi_coef,
     psi_det: Psi_det,
     n,
+    return_generator=False,
+    warm_start=True,
+    E_var: Energy = None,
+    return_pt2=False,
+    E_pt2_threshold: Energy = None,
 ) -> Tuple[Energy, Psi_coef, Psi_det]:
     # 1. Each MPI rank has a subset of constraints and computes E_pt2 contributions of determinants in this constraint (disjoint partitioning)
+    #    In the same sweep, the E_pt2 contributions are summed (PT2 energy of psi)
     # 2. Take the n determinants (across ranks) who have the biggest contribution and add it the wave function psi
     # 3. Diagonalize H corresponding to this new wave function to get the new variational energy, and new psi_coef
 
     # In the main code:
     # -> Go to 1., stop when E_pt2 < Threshold || N < Threshold
     # See example of chained call to this function in `test_f2_631g_1p5p5det`
+    # `E_var' is the variational energy of psi_coef, if known (the E returned by the previous call)
+    # If |E_pt2| < `E_pt2_threshold', psi is converged: it is returned as is (same psi_coef,
+    # psi_det and generator, E = E_var), without extending H nor running Davidson
 
     # Instance of Powerplant manager class for computing E_pt2 energies
     PP_manager = Powerplant_manager(comm, lewis)
@@ -2787,30 +4779,45 @@ def selection_step(
     # Each rank generates a chunk of the external space at the time -> computes the E_pt2 contributions of its respective chunk
     # Compute the n (local) best contributions on each rank -> Allgather + partial sort to get n global best across ranks
 
-    # 1.
-    # Compute the local best E_pt2 contributions + associated dets
-    local_best_dets, local_best_energies = local_sort_pt2_energies(PP_manager, psi_coef, psi_det, n)
-
-    # 2.
-    # Global sort local contributions to get global best E_pt2 contributions + dets
-    global_best_dets = global_sort_pt2_energies(comm, local_best_dets, local_best_energies, n)
+    # 1. + 2.
+    E_var, E_pt2, global_best_dets = PP_manager.selection_pass(psi_coef, n, E_var)
+    if E_pt2_threshold is not None and abs(E_pt2) < E_pt2_threshold:
+        result = (E_var, psi_coef, psi_det)
+        if return_generator:
+            result += (lewis,)
+        if return_pt2:
+            result += (E_pt2,)
+        return result
 
     # 3.
     # Add `best' determinants to the trial wavefunction
-    psi_det_extented = psi_det + global_best_dets
+    # The Hamiltonian of the extended wavefunction re-uses the matrix elements already computed
+    with profiler.timer("extend"):
+        lewis_new = lewis.extend(global_best_dets)
+    # (distributed determinants: only the local ones)
+    if lewis_new.det_storage == "distributed":
+        psi_det_extented = lewis_new.psi_local
+    else:
+        psi_det_extented = lewis_new.psi_internal
 
     # 4.
-    # New instance of Hamiltonian manager class for the extended wavefunction
-    lewis_new = Hamiltonian_generator(
-        comm,
-        lewis.E0,
-        lewis.d_one_e_integral,
-        lewis.d_two_e_integral,
-        psi_det_extented,
-    )
-
     # Return new E_var, psi_coef, and extended wavefunction
-    return (*Powerplant_manager(comm, lewis_new).E_and_psi_coef, psi_det_extented)
+    # (and its Hamiltonian_generator, if asked; to be re-used by the next iteration)
+    # (and the E_pt2 of the wave function we started from, if asked)
+    # Davidson starts from psi_coef (+ first order for the new determinants) if `warm_start'
+
+    PP_manager_new = Powerplant_manager(comm, lewis_new)
+    if warm_start:
+        energies, coeffs = PP_manager_new.diagonalize(PP_manager_new.warm_start_guess(psi_coef))
+        E, psi_coef = energies[0], coeffs[:, 0]
+    else:
+        E, psi_coef = PP_manager_new.E_and_psi_coef
+    result = (E, psi_coef, psi_det_extented)
+    if return_generator:
+        result += (lewis_new,)
+    if return_pt2:
+        result += (E_pt2,)
+    return result
 
 
 def local_sort_pt2_energies(
@@ -2818,37 +4825,9 @@ def local_sort_pt2_energies(
 ):
     # Function to compute the local n best E_pt2 contributions
     # Each rank computes the best contributions from a (disjoint) subset of the connected space, determined by constraint
-
-    # Pre-allocate space to track bests from previous chunk
+    # (See `Powerplant_manager.selection_pass', which also gives the PT2 energy)
     E_var = PP_manager.E(psi_coef)
-    # PT2 contribution are always < 0, use 1 as a tombstone value; these will never be selected
-    local_best_energies = np.ones(n, dtype="float")
-    # TODO: Will have to think more carefully about the case when size of the constraint space is < n
-    # `Dummy' determinants, corresponding to local_best_energies = 1
-    local_best_dets = [Determinant((), ())] * n
-
-    for C in PP_manager.gen_local_constraints():
-        # 1.
-        # Compute E_pt2 contributions of current chunk of determinants
-        # It is assumed that `chunk_size` is enough to fit in memory
-        psi_connected_C, E_pt2_energies_C = PP_manager.psi_external_pt2(C, psi_coef, E_var)
-
-        # 2.
-        # Aggregate current E_pt2 contributions and current n `best' contributions to partial sort
-        if len(E_pt2_energies_C) > 0:
-            working_energies = np.r_[E_pt2_energies_C, local_best_energies]
-            working_dets = psi_connected_C + local_best_dets
-        else:
-            # Nothing generated; local best dets and energies remain the same... Pass to next constraint in loop
-            continue
-
-        # Update `local' n largest magnitude E_pt2 contributions from working chunk -> indices of top n determinants
-        # E_pt2 < 0, so n `smallest' are actually the largest magnitude contributors
-        local_idx = np.argpartition(working_energies, n)[:n]
-        local_best_energies = np.array(working_energies[local_idx], dtype="float")
-        # Get determinants that are the local best contributors
-        local_best_dets = [working_dets[i] for i in local_idx]
-
+    _, local_best_dets, local_best_energies = PP_manager.local_selection_pass(psi_coef, n, E_var)
     # Return n largest magnitude energies/dets from this rank
     return local_best_dets, local_best_energies
 
@@ -2876,10 +4855,163 @@ def global_sort_pt2_energies(comm, local_best_dets: Psi_det, local_best_energies
     return global_best_dets
 
 
+def top_n_dtype(n_words: int) -> np.dtype:
+    """One selection candidate: its E_pt2 contribution and its packed determinant"""
+    return np.dtype([("E", "f8"), ("alpha", "u8", (n_words,)), ("beta", "u8", (n_words,))])
+
+
+def merge_top_n(records: np.ndarray, n) -> np.ndarray:
+    """
+    The n candidates of lowest E (largest magnitude E_pt2); each determinant is kept once.
+    Ties are broken by determinant, so the result doesn't depend on the order of `records'.
+    Padded with empty determinants of E = 1 (tombstones: PT2 contributions are always < 0).
+
+    >>> r = np.zeros(4, dtype=top_n_dtype(1))
+    >>> r["E"] = [-0.1, -0.3, -0.1, -0.2]
+    >>> r["alpha"][:, 0] = [1, 2, 1, 4]
+    >>> m = merge_top_n(r, 3)
+    >>> m["E"], m["alpha"][:, 0]
+    (array([-0.3, -0.2, -0.1]), array([2, 4, 1], dtype=uint64))
+    >>> merge_top_n(r[:1], 2)["E"]
+    array([-0.1,  1. ])
+    """
+    keys = Psi_det_packed(records["alpha"], records["beta"]).keys
+    order = np.lexsort((keys, records["E"]))
+    records, keys = records[order], keys[order]
+    # First (i.e. lowest E) occurrence of each determinant
+    _, first = np.unique(keys, return_index=True)
+    records = records[np.sort(first)]
+    records = records[records["E"] < 1.0][:n]
+    tombstones = np.zeros(n - len(records), dtype=records.dtype)
+    tombstones["E"] = 1.0
+    return np.concatenate([records, tombstones])
+
+
+def global_top_n_packed(comm, local_best_dets: Psi_det, local_best_energies, n, n_orb) -> Psi_det:
+    """
+    Collective: the n determinants of largest E_pt2 contribution, among the local bests of all
+    the ranks; like `global_sort_pt2_energies', without gathering world_size * n pickled
+    determinants on every rank.
+
+    Each rank packs its n candidates (uint64 words, see `Psi_det_packed') in one MPI datatype;
+    a user-defined (commutative) MPI operation merges two such top-n lists, so that `Reduce'
+    runs the merge along its reduction tree. Only the final n packed determinants are
+    broadcasted. Duplicates are discarded during the merges, and so are the tombstones
+    (less than n determinants are returned when there are less than n candidates).
+    """
+    if n == 0:
+        return []
+    n_words = Psi_det_packed.n_words(n_orb)
+    dtype = top_n_dtype(n_words)
+    local = np.zeros(len(local_best_energies), dtype=dtype)
+    local["E"] = local_best_energies
+    packed = Psi_det_packed.from_psi_det(local_best_dets, n_orb)
+    local["alpha"], local["beta"] = packed.alpha, packed.beta
+    local = merge_top_n(local, n)
+
+    def merge(inbuf, inoutbuf, datatype):
+        inout = np.frombuffer(inoutbuf, dtype=dtype)
+        inout[:] = merge_top_n(np.concatenate([np.frombuffer(inbuf, dtype=dtype), inout]), n)
+
+    # A whole top-n list is one element of the datatype: the operation can't be applied
+    # to segments of a list
+    candidate_type = MPI.BYTE.Create_contiguous(dtype.itemsize).Commit()
+    list_type = candidate_type.Create_contiguous(n).Commit()
+    op = MPI.Op.Create(merge, commute=True)
+    merged = np.zeros(n, dtype=dtype)
+    comm.Reduce([local, 1, list_type], [merged, 1, list_type], op=op, root=0)
+    op.Free()
+    list_type.Free()
+    candidate_type.Free()
+
+    # Only the selected determinants, as (n_selected x 2 n_words) words
+    n_selected = np.array([np.count_nonzero(merged["E"] < 1.0)], dtype=np.int64)
+    comm.Bcast([n_selected, MPI.INT64_T], root=0)
+    words = np.empty((n_selected[0], 2 * n_words), dtype=np.uint64)
+    if comm.Get_rank() == 0:
+        words[:] = np.c_[merged["alpha"], merged["beta"]][: n_selected[0]]
+    comm.Bcast([words, MPI.UINT64_T], root=0)
+
+    selected = Psi_det_packed(words[:, :n_words], words[:, n_words:])
+    dets = [selected[i] for i in range(len(selected))]
+    # Back to the representation of the local determinants
+    if local_best_dets and isinstance(local_best_dets[0].alpha, tuple):
+        dets = [det.convert_repr(n_orb) for det in dets]
+    return dets
+
+
+def det_owners(words: np.ndarray, world_size) -> np.ndarray:
+    """Rank owning each determinant (rows of alpha and beta words) in the distributed PT2:
+    a hash of the words, so that the connected determinants are spread evenly
+    >>> det_owners(np.array([[1, 2], [3, 4], [1, 2], [5, 0]], dtype=np.uint64), 4)
+    array([1, 3, 1, 2])
+    """
+    h = np.zeros(len(words), dtype=np.uint64)
+    for w in words.T:
+        # (the finalizer of MurmurHash3, on each word)
+        h ^= w
+        h ^= h >> np.uint64(33)
+        h *= np.uint64(0xFF51AFD7ED558CCD)
+        h ^= h >> np.uint64(33)
+        h *= np.uint64(0xC4CEB9FE1A85EC53)
+        h ^= h >> np.uint64(33)
+    return (h % np.uint64(world_size)).astype(np.int64)
+
+
+def exchange_by_owner(comm, owners: np.ndarray, *arrays) -> List[np.ndarray]:
+    """Collective: row i of each array goes to rank owners[i].
+    Returns the rows received by this rank (from all the ranks, in rank order), per array."""
+    world_size = comm.Get_size()
+    order = np.argsort(owners, kind="stable")
+    send_counts = np.bincount(owners, minlength=world_size).astype("i")
+    recv_counts = np.zeros_like(send_counts)
+    comm.Alltoall([send_counts, MPI.INT], [recv_counts, MPI.INT])
+    received = []
+    for A in arrays:
+        A = np.ascontiguousarray(A[order])
+        width = int(np.prod(A.shape[1:], dtype=np.int64))  # Items per row
+        R = np.zeros((recv_counts.sum(),) + A.shape[1:], dtype=A.dtype)
+        counts_s, counts_r = width * send_counts, width * recv_counts
+        comm.Alltoallv(
+            [A, (counts_s, np.r_[0, np.cumsum(counts_s)[:-1]])],
+            [R, (counts_r, np.r_[0, np.cumsum(counts_r)[:-1]])],
+        )
+        received.append(R)
+    return received
+
+
+def sum_by_key(keys: np.ndarray, values: np.ndarray) -> Tuple[np.ndarray, np.ndarray]:
+    """(index of the first occurrence of each distinct key, sum of its values), in key order
+    >>> sum_by_key(np.array([b"b", b"a", b"b"]), np.array([1.0, 2.0, 3.0]))
+    (array([1, 0]), array([2., 4.]))
+    """
+    if not len(keys):
+        return np.zeros(0, dtype=np.int64), np.zeros(0, dtype=values.dtype)
+    order = np.argsort(keys, kind="stable")
+    keys = keys[order]
+    starts = np.flatnonzero(np.r_[True, keys[1:] != keys[:-1]])
+    return order[starts], np.add.reduceat(values[order], starts)
+
+
+def is_in_sorted(sorted_keys: np.ndarray, keys: np.ndarray) -> np.ndarray:
+    """Membership of each key in `sorted_keys', by binary search
+    >>> is_in_sorted(np.array([b"a", b"c"]), np.array([b"c", b"b"]))
+    array([ True, False])
+    >>> is_in_sorted(np.array([], dtype="S1"), np.array([b"c"]))
+    array([False])
+    """
+    if not len(sorted_keys):
+        return np.zeros(len(keys), dtype=bool)
+    pos = np.minimum(np.searchsorted(sorted_keys, keys), len(sorted_keys) - 1)
+    return sorted_keys[pos] == keys
+
+
 # Next, we have functions that split the connected space
 
 
-def get_chunk_of_connected_determinants(psi_det: Psi_det, n_orb: int, L=None) -> Iterator[Psi_det]:
+def get_chunk_of_connected_determinants(
+    psi_det: Psi_det, n_orb: int, L=None, irreps=None
+) -> Iterator[Psi_det]:
     """
     MPI function, generates chunks of connected determinants of size L
 
@@ -2887,6 +5019,7 @@ def get_chunk_of_connected_determinants(psi_det: Psi_det, n_orb: int, L=None) ->
     :param psi_det: list of determinants
     :param L: integer, maximally allowed `chunk' of the conneceted space to yield at a time
     default is L = None, if no chunk size specified, a chunk of the connected space is allocated to each rank
+    :param irreps: if given, only the connected determinants allowed by symmetry (never generated)
 
     >>> d1 = Determinant((0, 1), (0,) ) ; d2 = Determinant((0, 2), (0,) )
     >>> for psi_chunk in get_chunk_of_connected_determinants( [ d1,d2 ], 4):
@@ -2903,11 +5036,13 @@ def get_chunk_of_connected_determinants(psi_det: Psi_det, n_orb: int, L=None) ->
     2
     """
 
-    def gen_all_connected_determinant(psi_det: Psi_det, n_orb: int) -> Psi_det:
+    def gen_all_connected_determinant(psi_det: Psi_det, n_orb: int, irreps=None) -> Psi_det:
         """
         >>> d1 = Determinant((0, 1), (0,) ) ; d2 = Determinant((0, 2), (0,) )
         >>> len(gen_all_connected_determinant( [ d1,d2 ], 4 ))
         22
+        >>> len(gen_all_connected_determinant( [ d1,d2 ], 4, [0, 1, 1, 0] ))
+        10
 
         We remove the connected determinant who are already inside the wave function. Order doesn't matter
         """
@@ -2915,14 +5050,23 @@ def get_chunk_of_connected_determinants(psi_det: Psi_det, n_orb: int, L=None) ->
         # return set(chain.from_iterable(map(self.gen_all_connected_det_from_det, psi_det)))- set(psi_det)
 
         # Naive algorithm 13
+        # The excitation degrees against all the previous determinants are computed at once (packed)
+        psi_det_packed = Psi_det_packed.from_psi_det(psi_det, n_orb)
+        psi_det_set = set(psi_det)
+        if irreps is not None:
+            irrep = np.array([det.irrep(irreps) for det in psi_det])
         l_global = []
         for i, det in enumerate(psi_det):
-            for det_connected in det.gen_all_connected_det(n_orb):
+            for det_connected in det.gen_all_connected_det(n_orb, irreps):
                 # Remove determinant who are in psi_det
-                if det_connected in psi_det:
+                if det_connected in psi_det_set:
                     continue
                 # If it's was already generated by an old determinant, just drop it
-                if any(det_connected.is_connected(d) for d in psi_det[:i]):
+                # (with symmetry, only the ones of its irrep generated it)
+                connected = psi_det_packed[:i].is_connected(det_connected)
+                if irreps is not None:
+                    connected &= irrep[:i] == irrep[i]
+                if connected.any():
                     continue
 
                 l_global.append(det_connected)
@@ -2931,7 +5075,7 @@ def get_chunk_of_connected_determinants(psi_det: Psi_det, n_orb: int, L=None) ->
         return l_global
 
     # Naive: Each ranks generates all connected determinants, and takes what is theirs
-    psi_connected = gen_all_connected_determinant(psi_det, n_orb)
+    psi_connected = gen_all_connected_determinant(psi_det, n_orb, irreps)
     world_size = MPI.COMM_WORLD.Get_size()
     # TODO: len(psi_connected) will not scale, but is needed for this naive representation
     full_idx = np.arange(len(psi_connected))
@@ -2973,100 +5117,187 @@ def check_constraint(det: Determinant, spin="alpha"):
     return spindet[-3:]
 
 
+def constraint_costs(
+    psi: Psi_det, n_orb: int, constraints: List[Tuple[OrbitalIdx, ...]], weights=None, irreps=None
+) -> np.ndarray:
+    """Estimate of the work of each triplet-constraint C: the number of (singly/doubly) connected
+    determinants to the determinants of psi which satisfy C.
+    :param weights: if given, the count of each determinant I is weighted by weights[I]
+        (e.g. c_I^2, to estimate the share of the PT2 energy carried by C)
+    :param irreps: if given (`Hamiltonian_generator.irreps`), only the excitations allowed by
+        the point-group symmetry are counted
+
+    Only the alpha occupations (and the number of beta electrons per irrep) matter, so they are
+    computed once per distinct row (histogram), and for many constraints at once.
+    Holes and particles are counted per irrep (pairs: per irrep of their product); an excitation
+    is allowed when its holes and its particles have the same. Without symmetry, one irrep.
+    >>> psi = [Determinant((0, 1, 2), (0, 1, 2)), Determinant((0, 1, 3), (0, 1, 2))]
+    >>> constraint_costs(psi, 5, generate_all_constraints(3, 5))
+    array([16., 16., 14., 14.,  8.,  8., 14.,  8.,  8.,  2.])
+    >>> constraint_costs(psi, 5, generate_all_constraints(3, 5), irreps=[0, 1, 0, 1, 1])
+    array([7., 7., 7., 7., 3., 3., 7., 5., 5., 1.])
+    """
+    irreps = np.zeros(n_orb, dtype=np.int64) if irreps is None else np.asarray(irreps)
+    n_irreps = 1 << int(irreps.max()).bit_length()  # (closed under the product, XOR)
+    S = np.eye(n_irreps)[irreps]  # S[o, g] = 1 if orbital o is of irrep g
+    A = occupation_matrix(psi, "alpha", n_orb)
+    B = occupation_matrix(psi, "beta", n_orb) @ S
+    w = np.ones(len(psi)) if weights is None else np.asarray(weights, dtype="float")
+    rows, inverse = np.unique(np.c_[A, B], axis=0, return_inverse=True)
+    A, B = rows[:, :n_orb], rows[:, n_orb:]
+    w = np.bincount(inverse.reshape(-1), weights=w, minlength=len(rows))
+    # prefix[:, o, g] = number of occupied alpha orbitals < o, of irrep g (orbitals: any)
+    prefix = np.zeros((len(A), n_orb + 1, n_irreps))
+    np.cumsum(A[:, :, None] * S, axis=1, out=prefix[:, 1:])
+    orbitals = np.zeros((n_orb + 1, n_irreps))
+    np.cumsum(S, axis=0, out=orbitals[1:])
+    # Occupied / unoccupied beta orbitals
+    b_occ, b_un = B[:, None], (orbitals[n_orb] - B)[:, None]
+    product = np.arange(n_irreps)[:, None] ^ np.arange(n_irreps)
+
+    def cross(s, t):
+        # Pairs (one of s, one of t), per irrep of their product
+        return (s[..., :, None] * t[..., product]).sum(axis=-2)
+
+    def pairs(s):
+        # Pairs of two distinct ones of s
+        return (cross(s, s) - s.sum(axis=-1, keepdims=True) * (product[0] == 0)) / 2
+
+    def cases(n, choices):
+        # choices[v] where n == v, 0 elsewhere
+        return sum((n == v)[..., None] * choice for v, choice in choices.items())
+
+    C = np.array(constraints, dtype=np.int64).reshape(-1, 3)
+    costs = np.zeros(len(C))
+    chunk = max(1, 2**20 // max(1, len(A) * n_irreps**2))
+    for begin in range(0, len(C), chunk):
+        c0, c1, c2 = C[begin : begin + chunk].T
+        # (rows, constraints, irreps)
+        # Unoccupied constraint orbitals
+        empty = sum((1 - A[:, c, None]) * S[c] for c in (c0, c1, c2))
+        n_C = 3 - empty.sum(axis=-1)
+        # Non-constraint orbitals occupied above min(C)
+        up = prefix[:, n_orb, None] - prefix[:, c0 + 1] - A[:, c1, None] * S[c1]
+        up -= A[:, c2, None] * S[c2]
+        n_up = up.sum(axis=-1)
+        # Occupied / unoccupied alpha orbitals below min(C)
+        lo_occ = prefix[:, c0]
+        lo_un = orbitals[c0] - lo_occ
+        # n_particles = [np_a, np_b, np_aa, np_bb, np_ab]
+        # Particles (or pairs) that (could possibly) involve an excitation satisfying C
+        # 0 constraint orbitals occupied: none; 1: must be aa (into the empty constraint orbitals);
+        # 2: a single must be into the empty constraint orbital, ab: it and any beta;
+        # 3: any a or aa into `lower` unoccupied alpha orbitals, all b or bb
+        n_particles = [
+            cases(n_C, {2: empty, 3: lo_un}),
+            cases(n_C, {3: b_un}),
+            cases(n_C, {1: pairs(empty), 2: cross(empty, lo_un), 3: pairs(lo_un)}),
+            cases(n_C, {3: pairs(b_un)}),
+            cases(n_C, {2: cross(empty, b_un), 3: cross(lo_un, b_un)}),
+        ]
+        # n_holes = [nh_a, nh_b, nh_aa, nh_bb, nh_ab]
+        # Holes (or pairs) that (could possibly) involve an excitation satisfying C
+        # > 2 `higher` non-constraint orbitals occupied: none; 2: must be aa (out of them);
+        # 1: a single must be out of it, ab: it and any beta; 0: from any `lower` alpha, all b or bb
+        n_holes = [
+            cases(n_up, {1: up, 0: lo_occ}),
+            cases(n_up, {0: b_occ}),
+            cases(n_up, {2: pairs(up), 1: cross(up, lo_occ), 0: pairs(lo_occ)}),
+            cases(n_up, {0: pairs(b_occ)}),
+            cases(n_up, {1: cross(up, b_occ), 0: cross(lo_occ, b_occ)}),
+        ]
+        # Number of singly/doubly connected determinants to |det> satisfying constraint C
+        #   Simply (per spin type) number of holes * particles of the same irrep
+        h = sum((n_p * n_h).sum(axis=-1) for n_p, n_h in zip(n_particles, n_holes))
+        costs[begin : begin + chunk] = w @ h
+    return costs
+
+
 def dispatch_local_constraints(
-    comm: MPI.COMM_WORLD, psi: Psi_det, n_orb: int
+    comm: MPI.COMM_WORLD, psi: Psi_det, n_orb: int, irreps=None
 ) -> List[Tuple[OrbitalIdx, ...]]:
     """MPI function, perform static load balancing + distribution of triplet-constraints to MPI ranks
     Work is roughly distributed based on the number of connected determinants satisfying a particular constraint
 
+    All the ranks compute all the costs, so they all know the greedy assignment
+    (each constraint goes to the least loaded rank, lowest rank first): no communication.
+
     Inputs:
     :param psi: List of internal determinants (global)
+    :param irreps: irreps of the orbitals, see `constraint_costs`
 
     Outputs:
     :param C_loc: Local constraints"""
 
     rank = comm.Get_rank()
     # Initialize array to track workload of each rank
-    W = np.zeros(shape=(comm.Get_size(),), dtype="i")
+    W = np.zeros(shape=(comm.Get_size(),), dtype="float")
     C_loc = []  # Pre-allocate space for local constraints
     na = len(getattr(psi[0], "alpha"))  # No. of alpha electrons
-    nb = len(getattr(psi[0], "beta"))  # No. of beta electrons
+    constraints = generate_all_constraints(na, n_orb)
     # Pass through all triplet constraints to distribute
     H = []  # Track work dist.
-    for C in generate_all_constraints(na, n_orb):
-        B_upper = set(range(min(C) + 1, n_orb))  # Upper bitmask
-        B_lower = set(range(min(C)))  # Lower bitmask
-        h = 0  # Track work of this constraint
-        for det in psi:
-            det_a = getattr(det, "alpha")
-            constraint_orbitals_occupied = set(det_a) & set(C)
-            nonconstrained_orbitals_occupied = (set(det_a) & B_upper) - set(C)
-            # n_particles = [np_a, np_b, np_aa, np_bb, np_ab]
-            # Number of particles (or pairs) that (could possibly) involve an excitation satisfying C
-            if len(constraint_orbitals_occupied) == 0:
-                # No excitations will satisfy C -> Pass
-                n_particles = np.zeros(5, dtype="i")
-            elif len(constraint_orbitals_occupied) == 1:
-                # To satisfy C, excitation must be aa (into empty constraint orbitals)
-                n_particles = np.array([0, 0, 1, 0, 0], dtype="i")
-            elif len(constraint_orbitals_occupied) == 2:
-                # To satisfy C, only possible single is a, must excite into empty constraint orbital
-                na_orbs_unocc_lower = B_lower - set(det_a)
-                # No bb; for ab doubles, a must excite into empty constraint orbital, so 1 * (self.n_orb - nb) ab pairs
-                n_particles = np.array([1, 0, len(na_orbs_unocc_lower), 0, (n_orb - nb)], dtype="i")
-            elif len(constraint_orbitals_occupied) == 3:
-                # To satisfy C, any a or aa excitaion into `lower` unoccupied alpha orbitals
-                # All possible b or bb excitations satisfy C
-                na_orbs_unocc_lower = B_lower - set(det_a)
-                # Divide some things by 2 to avoid repeats due to permuation (e.g., (p1, p2) = (1, 2) <-> (p1, p2) = (2, 1))
-                n_particles = np.array(
-                    [
-                        len(na_orbs_unocc_lower),
-                        n_orb - nb,
-                        len(na_orbs_unocc_lower) * (len(na_orbs_unocc_lower) - 1) / 2,
-                        (n_orb - nb) * (n_orb - nb - 1) / 2,
-                        (n_orb - nb) * len(na_orbs_unocc_lower),
-                    ],
-                    dtype="i",
-                )
-
-            # n_holes = [nh_a, nh_b, nh_aa, nh_bb, nh_ab]
-            # Number of holes (or pairs) that (could possibly) involve an excitation satisfying C
-            if len(nonconstrained_orbitals_occupied) > 2:
-                # No excitations will satisfy C -> Pass
-                n_holes = np.zeros(5, dtype="i")
-            elif len(nonconstrained_orbitals_occupied) == 2:
-                # To satisfy C, excitation must be aa (out of `higher` non-constraint orbitals)
-                n_holes = np.array([0, 0, 1, 0, 0], dtype="i")
-            elif len(nonconstrained_orbitals_occupied) == 1:
-                # To satisfy C, only possible single is a, must excite out of `higher` constraint orbitals
-                na_orbs_occ_lower = set(det_a) & B_lower
-                # No bb; for ab doubles, a must excite out of `higher` constraint orbital, so 1 * nb ab pairs
-                n_holes = [1, 0, len(na_orbs_occ_lower), 0, nb]
-            elif len(nonconstrained_orbitals_occupied) == 0:
-                # To satisfy C, can excite out of any `lower` occupied alpha orbitals
-                # All possible b or bb excitations satisfy C
-                na_orbs_occ_lower = set(det_a) & B_lower
-                n_holes = [
-                    len(na_orbs_occ_lower),
-                    nb,
-                    len(na_orbs_occ_lower) * (len(na_orbs_occ_lower) - 1) / 2,
-                    nb * (nb - 1) / 2,
-                    len(na_orbs_occ_lower) * nb,
-                ]
-
-            # Number of singly/doubly connected determinants to |det> satisfying constraint C
-            #   Simply (per spin type) number of holes * particles that will yield an excitation in C
-            h += np.dot(n_particles, n_holes)  # Add to work thus far
-
+    for C, h in zip(constraints, constraint_costs(psi, n_orb, constraints, irreps=irreps).tolist()):
         if h:  # Handle case where no dets satisfy C.. No one will do it
-            _, loc = comm.allreduce(
-                (W[rank], rank), MPI.MINLOC
-            )  # This is a tuple, so use python command
-            if loc == rank:  # Rank with lowest amount of work collects current constraint
+            loc = int(np.argmin(W))  # Rank with lowest amount of work collects current constraint
+            W[loc] += h  # Add h to the amount of `work` rank has
+            if loc == rank:
                 C_loc.append(C)
                 H.append(h)
-                W[rank] += h  # Add h to the amount of `work` rank has
 
     # Return local constraints and distribution of work
     return C_loc, H
+
+
+def constraint_tasks(
+    comm: MPI.COMM_WORLD, psi: Psi_det, n_orb: int, split_factor=4, irreps=None
+) -> List[Tuple[OrbitalIdx, ...]]:
+    """All the constraints with some work, same list on all ranks, to be handed out dynamically.
+    With several ranks, they are sorted largest-first, and triplets costing more than
+    1 / (split_factor * n_ranks) of the total are split in quadruplet constraints
+    (q, C): q is the 4th highest occupied alpha orbital (see `Powerplant_manager.psi_external_pt2`).
+    (Alone, a rank takes the constraints in the order of `generate_all_constraints`.)
+    The costs only count the excitations allowed by symmetry, if `irreps` is given."""
+    na = len(getattr(psi[0], "alpha"))  # No. of alpha electrons
+    constraints = generate_all_constraints(na, n_orb)
+    costs = constraint_costs(psi, n_orb, constraints, irreps=irreps)
+    tasks = [(C, h) for C, h in zip(constraints, costs.tolist()) if h]
+    if comm.Get_size() == 1:
+        return [C for C, _ in tasks]
+
+    threshold = costs.sum() / (split_factor * comm.Get_size())
+    split_tasks = []
+    for C, h in tasks:
+        # The na - 4 lowest alpha orbitals have to be below q
+        quadruplets = [(q,) + C for q in range(na - 4, C[0])] if na >= 4 else []
+        if h > threshold and len(quadruplets) > 1:
+            split_tasks += [(Q, h / len(quadruplets)) for Q in quadruplets]
+        else:
+            split_tasks.append((C, h))
+    split_tasks.sort(key=lambda task: -task[1])
+    return [C for C, _ in split_tasks]
+
+
+def dynamic_constraints(comm: MPI.COMM_WORLD, tasks: List) -> Iterator:
+    """MPI function, dynamic distribution of the `tasks' (same list on all ranks):
+    each rank takes the next task of the list by an atomic fetch-and-add on a counter
+    (MPI-3 RMA window on rank 0), when it is done with its previous one.
+    Collective: all the ranks have to exhaust the iterator (the window is freed at the end)."""
+    itemsize = MPI.INT64_T.Get_size()
+    win = MPI.Win.Allocate(itemsize if comm.Get_rank() == 0 else 0, itemsize, comm=comm)
+    if comm.Get_rank() == 0:
+        win.Lock(0)
+        win.Put([np.zeros(1, dtype=np.int64), MPI.INT64_T], 0)
+        win.Unlock(0)
+    comm.Barrier()
+
+    one = np.ones(1, dtype=np.int64)
+    next_task = np.zeros(1, dtype=np.int64)
+    while True:
+        win.Lock(0, MPI.LOCK_SHARED)
+        win.Fetch_and_op([one, MPI.INT64_T], [next_task, MPI.INT64_T], 0, op=MPI.SUM)
+        win.Unlock(0)
+        if next_task[0] >= len(tasks):
+            break
+        yield tasks[next_task[0]]
+    win.Free()
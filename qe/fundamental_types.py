@@ -1,6 +1,14 @@
 from typing import Tuple, Dict, NamedTuple, List, NewType, Iterator
 from itertools import chain, product, combinations, takewhile
-from functools import partial, cache
+from functools import partial, cache, cached_property
+from collections.abc import Mapping
+import numpy as np
+from qe.integral_indexing_utils import (
+    compound_idx4,
+    compound_idx4_reverse,
+    compound_idx4_array,
+    compound_idx4_reverse_array,
+)
 
 # Orbital index (0,1,2,...,n_orb-1)
 OrbitalIdx = NewType("OrbitalIdx", int)
@@ -16,6 +24,30 @@ Two_electron_integral_index_phase = Tuple[Two_electron_integral_index, bool]
 One_electron_integral = Dict[Tuple[OrbitalIdx, OrbitalIdx], float]
 
 
+def hole_particle_pairs(holes, particles, ed: int, irreps=None, change=0) -> Iterator[Tuple]:
+    """(holes, particles) of all the excitations of degree `ed`. With `irreps`, only the ones
+    whose holes and particles have a product of irreps (XOR, see `Determinant.irrep`) equal to
+    `change`: the particles are grouped by irrep, the others are never gone through
+    >>> list(hole_particle_pairs((0, 1), (2, 3), 1))
+    [((0,), (2,)), ((0,), (3,)), ((1,), (2,)), ((1,), (3,))]
+    >>> list(hole_particle_pairs((0, 1), (2, 3), 1, [0, 1, 1, 0]))
+    [((0,), (3,)), ((1,), (2,))]
+    """
+    holes, particles = combinations(holes, ed), combinations(particles, ed)
+    if irreps is None:
+        return product(holes, particles)
+
+    def irrep(orbitals, g=0):
+        for o in orbitals:
+            g ^= irreps[o]
+        return g
+
+    by_irrep = {}
+    for p in particles:
+        by_irrep.setdefault(irrep(p, change), []).append(p)
+    return ((h, p) for h in holes for p in by_irrep.get(irrep(h), ()))
+
+
 #    ___
 #     |     ._  |  _
 #     | |_| |_) | (/_
@@ -126,20 +158,25 @@ class Spin_determinant_tuple(Tuple[OrbitalIdx, ...]):
         """Perform a `popcount'; return length of the tuple"""
         return len(self)
 
-    def gen_all_connected_spindet(self, ed: int, n_orb: int) -> Iterator[Tuple[OrbitalIdx, ...]]:
+    def gen_all_connected_spindet(
+        self, ed: int, n_orb: int, irreps=None, change=0
+    ) -> Iterator[Tuple[OrbitalIdx, ...]]:
         """Generate all connected spin determinants to self relative to a particular excitation degree
         :param n_orb: global parameter
+        :param irreps: if given, only the excitations changing the irrep by `change` (see
+            `hole_particle_pairs`)
         >>> sorted(Spin_determinant_tuple((0, 1)).gen_all_connected_spindet(1, 4))
         [(0, 2), (0, 3), (1, 2), (1, 3)]
         >>> sorted(Spin_determinant_tuple((0, 1)).gen_all_connected_spindet(2, 4))
         [(2, 3)]
         >>> sorted(Spin_determinant_tuple((0, 1)).gen_all_connected_spindet(2, 2))
         []
+        >>> sorted(Spin_determinant_tuple((0, 1)).gen_all_connected_spindet(1, 4, [0, 1, 1, 0]))
+        [(0, 2), (1, 3)]
         """
         # Compute all possible holes (occupied orbitals in self) and particles (empty orbitals in self)
-        holes = combinations(self, ed)
-        particles = combinations(Spin_determinant_tuple(range(n_orb)) - self, ed)
-        l_hp_pairs = product(holes, particles)
+        particles = Spin_determinant_tuple(range(n_orb)) - self
+        l_hp_pairs = hole_particle_pairs(self, particles, ed, irreps, change)
 
         return [self ^ tuple((set(h) | set(p))) for h, p in l_hp_pairs]
 
@@ -155,6 +192,8 @@ class Spin_determinant_bitstring(int):
     Occupation number (ON) representation of determinants; most significant bits are rightmost
         e.g., occupation of OrbitalIdx = 0 is given by rightmost bit
     Certain bitwise logical operators overloaded.
+    Holes and particles are extracted with masks (`holes_particles`); whole lists of determinants
+    are only stored as numpy uint64 words (`Psi_det_packed`) for screening, I/O and the workers.
     """
 
     def convert_repr(self, Norb=None):
@@ -288,7 +327,7 @@ class Spin_determinant_bitstring(int):
         else:
             raise TypeError(f"Unsupported operand type(s) for ^: '{type(self)}' and '{type(mask)}'")
 
-    def __sub__(self, spin_bs: int) -> int:
+    def __sub__(self, spin_bs: int or Tuple[OrbitalIdx, ...]) -> int:
         """Overload `-` operator to perform logical bitwise comparison
         Remove common bits between `self` and `spin_bs` -> (self) & ~(spin_bs)
         >>> bin(Spin_determinant_bitstring(0b1010) - Spin_determinant_bitstring(0b0011))
@@ -297,7 +336,11 @@ class Spin_determinant_bitstring(int):
         '0b0'
         >>> bin(Spin_determinant_bitstring(0b1010) - Spin_determinant_bitstring(0b0101))
         '0b1010'
+        >>> bin(Spin_determinant_bitstring(0b1010) - (1, 2))
+        '0b1000'
         """
+        if isinstance(spin_bs, tuple):
+            spin_bs = self.create_bitmask(spin_bs)
         return Spin_determinant_bitstring(self & ~(spin_bs))
 
     def __rsub__(self, mask: int or Tuple[OrbitalIdx, ...]) -> Tuple[OrbitalIdx]:
@@ -328,9 +371,80 @@ class Spin_determinant_bitstring(int):
         """Perform a `popcount'; number of bits set to True in self"""
         return self.bit_count()
 
-    def gen_all_connected_spindet(self, ed: int, n_orb: int) -> Iterator[Tuple[OrbitalIdx, ...]]:
+    # Sequence interface, so that bitstrings can be used wherever a |Spin_determinant_tuple| is
+    # (Sorted occupied orbitals, lowest first)
+    def __iter__(self) -> Iterator[OrbitalIdx]:
+        """Iterate over the occupied orbitals, by peeling the lowest set bit at each step
+        >>> list(Spin_determinant_bitstring(0b101001))
+        [0, 3, 5]
+        >>> list(Spin_determinant_bitstring(0b0))
+        []
+        """
+        bits = int(self)
+        while bits:
+            lowest = bits & -bits
+            yield lowest.bit_length() - 1
+            bits ^= lowest
+
+    def __len__(self) -> int:
+        """Number of occupied orbitals
+        >>> len(Spin_determinant_bitstring(0b101001))
+        3
+        """
+        return self.bit_count()
+
+    def __contains__(self, o: OrbitalIdx) -> bool:
+        """
+        >>> 3 in Spin_determinant_bitstring(0b101001), 4 in Spin_determinant_bitstring(0b101001)
+        (True, False)
+        """
+        return bool((self >> o) & 1)
+
+    def __getitem__(self, key):
+        """Index (or slice) the sorted occupied orbitals
+        >>> Spin_determinant_bitstring(0b1101001)[-3:]
+        (3, 5, 6)
+        >>> Spin_determinant_bitstring(0b1101001)[0], Spin_determinant_bitstring(0b1101001)[-1]
+        (0, 6)
+        >>> [Spin_determinant_bitstring(0b1101001)[k] for k in range(-4, 4)]
+        [0, 3, 5, 6, 0, 3, 5, 6]
+        """
+        if isinstance(key, slice):
+            return tuple(self)[key]
+        # A single orbital is read from the bits, without building the whole tuple:
+        # peel the lowest (or the highest, when closer to the end) set bits until the key-th
+        n = self.bit_count()
+        if key < 0:
+            key += n
+        if not 0 <= key < n:
+            raise IndexError("Spin_determinant_bitstring index out of range")
+        bits = int(self)
+        if 2 * key < n:
+            for _ in range(key):
+                bits &= bits - 1
+            return (bits & -bits).bit_length() - 1
+        for _ in range(n - 1 - key):
+            bits ^= 1 << (bits.bit_length() - 1)
+        return bits.bit_length() - 1
+
+    def holes_particles(self, other: int) -> Tuple[Tuple[OrbitalIdx, ...], Tuple[OrbitalIdx, ...]]:
+        """Sorted holes (occupied only in self) and particles (occupied only in other),
+        from the masks self & ~other and other & ~self
+        >>> Spin_determinant_bitstring(0b11110).holes_particles(0b101010010)
+        ((2, 3), (6, 8))
+        """
+        return (
+            tuple(Spin_determinant_bitstring(int(self) & ~int(other))),
+            tuple(Spin_determinant_bitstring(int(other) & ~int(self))),
+        )
+
+    def gen_all_connected_spindet(
+        self, ed: int, n_orb: int, irreps=None, change=0
+    ) -> Iterator[Tuple[OrbitalIdx, ...]]:
         """Generate all connected spin determinants to self relative to a particular excitation degree
-        :param n_orb: global parameter, used to pad bitstring with necessary 0s
+        :param n_orb: global parameter, the particles are the unset bits below it
+        :param irreps: if given, only the excitations changing the irrep by `change` (see
+            `hole_particle_pairs`)
 
         >>> for excited_sdet in sorted(Spin_determinant_bitstring(0b11).gen_all_connected_spindet(1, 4)):
         ...     bin(excited_sdet)
@@ -354,23 +468,13 @@ class Spin_determinant_bitstring(int):
         '0b10'
         '0b100'
         """
-        # Run through bitstring to create lists of particles and holes
-        holes = []
-        particles = []
-        # Some pre-processing; Create intermediate bitstring that is padded with zeros s.t len(inter) = n_orb
-        # If n_orb bit is already set -> No affect
-        inter = format(self, "#0" + f"{n_orb + 2}" + "b")
-        # One pass right -> left through reflected bitstring ([:-2] skips 'b0' in the flipped reflected bitstring)
-        for i, bit in enumerate(inter[::-1][:-2]):
-            # If ith bit is set, append to holes
-            if bit == "1":
-                holes.append(i)
-            # Else ith bit is not set, append to particles
-            else:
-                particles.append(i)
-        l_hp_pairs = product(combinations(tuple(holes), ed), combinations(tuple(particles), ed))
+        # Holes are the set bits of self, particles the unset ones of the n_orb lowest bits
+        holes = list(self)
+        particles = list(Spin_determinant_bitstring(((1 << n_orb) - 1) & ~int(self)))
+        l_hp_pairs = hole_particle_pairs(holes, particles, ed, irreps, change)
 
-        return [self ^ tuple(sorted(set(h) | set(p))) for h, p in l_hp_pairs]
+        # Holes and particles are distinct bits: the excitation flips all of them
+        return [self ^ self.create_bitmask(h + p) for h, p in l_hp_pairs]
 
 
 #   ______     _                      _                   _
@@ -481,6 +585,40 @@ class Determinant(tuple):
         # Each spin determinant class has member `convert_repr` function
         return Determinant(self.alpha.convert_repr(Norb), self.beta.convert_repr(Norb))
 
+    #     __
+    #    (_      ._ _  ._ _   _ _|_ ._
+    #    __) \/ | | | | | | (/_ |_ | \/
+    #        /                       /
+    # Abelian point groups (D2h and its subgroups): with the irreps numbered from 0
+    # (FCIDUMP ORBSYM - 1), the product of two irreps is their XOR, 0 is totally symmetric.
+
+    def irrep(self, irreps) -> int:
+        """Irrep of the determinant, product of the irreps (`irreps[o]`) of its occupied orbitals
+        >>> Determinant((0, 1), (0,)).irrep([0, 1, 3])
+        1
+        >>> Determinant(0b101, 0b100).irrep([0, 1, 3])
+        0
+        """
+        product = 0
+        for o in chain(self.alpha, self.beta):
+            product ^= irreps[o]
+        return product
+
+    @staticmethod
+    def symmetry_allowed(irreps, *orbitals) -> bool:
+        """Does an excitation of these holes and particles keep the irrep of the determinant?
+        (Otherwise <I|H|J> is zero by symmetry.) Always, if `irreps` is None.
+        >>> irreps = [0, 1, 1]
+        >>> Determinant.symmetry_allowed(irreps, 1, 2), Determinant.symmetry_allowed(irreps, 0, 2)
+        (True, False)
+        """
+        if irreps is None:
+            return True
+        product = 0
+        for o in orbitals:
+            product ^= irreps[o]
+        return product == 0
+
     #     _
     #    |_     _ o _|_  _. _|_ o  _  ._
     #    |_ >< (_ |  |_ (_|  |_ | (_) | |
@@ -517,6 +655,12 @@ class Determinant(tuple):
         lh_a, lp_a = alpha_exc
         lh_b, lp_b = beta_exc
 
+        if isinstance(self.alpha, int):
+            # Holes and particles are distinct orbitals: flip their bits
+            return Determinant(
+                self.alpha ^ Spin_determinant_bitstring.create_bitmask(tuple(lh_a) + tuple(lp_a)),
+                self.beta ^ Spin_determinant_bitstring.create_bitmask(tuple(lh_b) + tuple(lp_b)),
+            )
         excited_sdet_a = self.alpha ^ (tuple(sorted(set(lh_a) | set(lp_a))))
         excited_sdet_b = self.beta ^ (tuple(sorted(set(lh_b) | set(lp_b))))
         return Determinant(excited_sdet_a, excited_sdet_b)
@@ -565,9 +709,10 @@ class Determinant(tuple):
         """
         return sum(self.exc_degree(det_j)) in [1, 2]
 
-    def gen_all_connected_det(self, n_orb: int) -> Iterator[NamedTuple]:
+    def gen_all_connected_det(self, n_orb: int, irreps=None) -> Iterator[NamedTuple]:
         """Generate all determinants that are singly or doubly connected to self
         :param n_orb: global parameter, needed to cap possible excitations
+        :param irreps: if given, only the determinants of the same irrep as self (see `irrep`)
 
         >>> sorted(Determinant((0, 1), (0,)).gen_all_connected_det(3))
         [Determinant(alpha=(0, 1), beta=(1,)),
@@ -589,24 +734,41 @@ class Determinant(tuple):
         ['0b110', '0b1']
         ['0b110', '0b10']
         ['0b110', '0b100']
+
+        >>> sorted(Determinant((0, 1), (0,)).gen_all_connected_det(3, irreps=[0, 1, 1]))
+        [Determinant(alpha=(0, 2), beta=(0,)),
+         Determinant(alpha=(1, 2), beta=(1,)),
+         Determinant(alpha=(1, 2), beta=(2,))]
         """
         # Generate all singles from constituent alpha and beta spin determinants
         # Then, opposite-spin and same-spin doubles
+        # With symmetry, the forbidden excitations are never generated: the same-spin ones have
+        # to keep the irrep of their spin determinant, the opposite-spin ones to change the irreps
+        # of both by the same one (the singles are grouped by this change of irrep)
+        changes = [0] if irreps is None else range(1 << max(irreps).bit_length())
 
         # We use l_single_a, and l_single_b twice. So we store them.
-        l_single_a = set(self.alpha.gen_all_connected_spindet(1, n_orb))
-        l_double_aa = self.alpha.gen_all_connected_spindet(2, n_orb)
+        l_single_a = {
+            g: set(self.alpha.gen_all_connected_spindet(1, n_orb, irreps, g)) for g in changes
+        }
+        l_double_aa = self.alpha.gen_all_connected_spindet(2, n_orb, irreps)
 
         # Singles and doubles; alpha spin
-        exc_a = (Determinant(det_alpha, self.beta) for det_alpha in chain(l_single_a, l_double_aa))
+        exc_a = (
+            Determinant(det_alpha, self.beta) for det_alpha in chain(l_single_a[0], l_double_aa)
+        )
 
-        l_single_b = set(self.beta.gen_all_connected_spindet(1, n_orb))
-        l_double_bb = self.beta.gen_all_connected_spindet(2, n_orb)
+        l_single_b = {
+            g: set(self.beta.gen_all_connected_spindet(1, n_orb, irreps, g)) for g in changes
+        }
+        l_double_bb = self.beta.gen_all_connected_spindet(2, n_orb, irreps)
 
         # Singles and doubles; beta spin
-        exc_b = (Determinant(self.alpha, det_beta) for det_beta in chain(l_single_b, l_double_bb))
+        exc_b = (
+            Determinant(self.alpha, det_beta) for det_beta in chain(l_single_b[0], l_double_bb)
+        )
 
-        l_double_ab = product(l_single_a, l_single_b)
+        l_double_ab = chain.from_iterable(product(l_single_a[g], l_single_b[g]) for g in changes)
 
         # Doubles; opposite-spin
         exc_ab = (Determinant(det_alpha, det_beta) for det_alpha, det_beta in l_double_ab)
@@ -614,13 +776,16 @@ class Determinant(tuple):
         return chain(exc_a, exc_b, exc_ab)
 
     def triplet_constrained_single_excitations_from_det(
-        self, constraint: Tuple[OrbitalIdx, ...], n_orb: int, spin="alpha"
+        self, constraint: Tuple[OrbitalIdx, ...], n_orb: int, spin="alpha", irreps=None
     ) -> Iterator[NamedTuple]:
-        """Called by inherited classes; Generate singlet excitations from constraint"""
+        """Called by inherited classes; Generate singlet excitations from constraint
+        (with `irreps`, only the ones which keep the irrep of the determinant)"""
 
         ha, pa, hb, pb = self.get_holes_particles_for_constrained_singles(constraint, n_orb, spin)
         # Excitations of argument `spin`
         for h, p in product(ha, pa):
+            if not self.symmetry_allowed(irreps, h, p):
+                continue
             if spin == "alpha":
                 # Then, det_a is alpha spindet
                 excited_det = self.apply_excitation(((h,), (p,)), ((), ()))
@@ -632,6 +797,8 @@ class Determinant(tuple):
 
         # Generate opposite-spin excitations
         for h, p in product(hb, pb):
+            if not self.symmetry_allowed(irreps, h, p):
+                continue
             if spin == "alpha":
                 # Then, det_b is beta spindet
                 excited_det = self.apply_excitation(((), ()), ((h,), (p,)))
@@ -643,9 +810,10 @@ class Determinant(tuple):
             yield excited_det
 
     def triplet_constrained_double_excitations_from_det(
-        self, constraint: Tuple[OrbitalIdx, ...], n_orb: int, spin="alpha"
+        self, constraint: Tuple[OrbitalIdx, ...], n_orb: int, spin="alpha", irreps=None
     ) -> Iterator[NamedTuple]:
-        """Called by inherited classes; Generate singlet excitations from constraint"""
+        """Called by inherited classes; Generate singlet excitations from constraint
+        (with `irreps`, only the ones which keep the irrep of the determinant)"""
 
         # |Determinant_tuple| and |Determinant_bitstring| each have this method
         haa, paa, hbb, pbb, hab, pab = self.get_holes_particles_for_constrained_doubles(
@@ -654,6 +822,8 @@ class Determinant(tuple):
         # Excitations of argument `spin`
         # Same-spin doubles, for argument `spin`
         for holes, particles in product(haa, paa):
+            if not self.symmetry_allowed(irreps, *holes, *particles):
+                continue
             if spin == "alpha":
                 # Then, det_a is alpha spindet
                 excited_det = self.apply_excitation((holes, particles), ((), ()))
@@ -665,6 +835,8 @@ class Determinant(tuple):
 
         # Same-spin doubles, for opposite-spin to `spin`
         for holes, particles in product(hbb, pbb):
+            if not self.symmetry_allowed(irreps, *holes, *particles):
+                continue
             if spin == "alpha":
                 # Then, det_b is beta spindet
                 excited_det = self.apply_excitation(((), ()), (holes, particles))
@@ -678,6 +850,8 @@ class Determinant(tuple):
         for holes, particles in product(hab, pab):
             ha, hb = holes
             pa, pb = particles
+            if not self.symmetry_allowed(irreps, ha, hb, pa, pb):
+                continue
             if spin == "alpha":
                 # det_a is alpha, det_b is beta
                 excited_det = self.apply_excitation(((ha,), (pa,)), ((hb,), (pb,)))
@@ -718,6 +892,10 @@ class Determinant(tuple):
         else:
             det_a = getattr(self, spin)  # Get |Spin_determinant| of inputted |Determinant|, |D>
             det_b = getattr(self, "alpha")
+        if isinstance(det_a, int):
+            # Bitstrings: the same sets as masks (all the orbitals, the ones above a1)
+            all_orbs = (1 << n_orb) - 1
+            B = all_orbs & ~((1 << (a1 + 1)) - 1)
 
         # Some things can be pre-computed:
         #   Which of the `constraint` (spin) orbitals {a1, a2, a3} are occupied in |D_a>? (If any)
@@ -812,6 +990,10 @@ class Determinant(tuple):
         else:
             det_a = getattr(self, spin)  # Get |Spin_determinant| of inputted |Determinant|, |D>
             det_b = getattr(self, "alpha")
+        if isinstance(det_a, int):
+            # Bitstrings: the same sets as masks (all the orbitals, the ones above a1)
+            all_orbs = (1 << n_orb) - 1
+            B = all_orbs & ~((1 << (a1 + 1)) - 1)
 
         # Some things can be pre-computed:
         #   Which of the `constraint` (spin) orbitals {a1, a2, a3} are occupied in |D>? (If any)
@@ -913,8 +1095,7 @@ class Determinant(tuple):
     #    (_| | | (_|   |  (_| |   |_ | (_ | (/_
 
     # Driver functions for computing phase, hole and particle between determinant pairs
-    # TODO: These are ONLY implemented for |Spin_determinant_tuple| at the moment;
-    # So, might just keep as is
+    # For |Spin_determinant_bitstring|, the phase is the popcount of a mask
 
     def single_phase(
         self,
@@ -949,15 +1130,12 @@ class Determinant(tuple):
 
         if isinstance(sdet, tuple):
             pmask = tuple((i for i in range(j + 1, k)))
+            parity = (sdet & pmask).popcnt() % 2
         elif isinstance(sdet, int):
-            # Strings immutable -> Work with lists for ON assignment, convert to |str| -> |int| when done
-            pmask = ["0", "b"]
-            pmask.extend(["0"] * k)
-            for i in range(j + 1, k):
-                pmask[-(i + 1)] = "1"
-            pmask = int(("".join(pmask)), 2)
-
-        parity = (sdet & pmask).popcnt() % 2
+            # Bits j+1, ..., k-1 set
+            pmask = ((1 << k) - 1) ^ ((1 << (j + 1)) - 1)
+            parity = (int(sdet) & pmask).bit_count() % 2
+
         return -1 if parity else 1
 
     def double_phase(self, holes: Tuple[OrbitalIdx, ...], particles: Tuple[OrbitalIdx, ...], spin):
@@ -994,11 +1172,16 @@ class Determinant(tuple):
         (-1, 4, 22)
         >>> Determinant((), (0, 1, 8)).single_exc((0, 8, 17), "beta")
         (-1, 1, 17)
+        >>> Determinant(0b1010001, 0b0).single_exc(0b1100001, "alpha")
+        (1, 4, 5)
         """
         # Get holes, particle in exc
         sdet_i = getattr(self, spin)
-        (h,) = sdet_i - sdet_j
-        (p,) = sdet_j - sdet_i
+        if isinstance(sdet_i, int):
+            (h,), (p,) = sdet_i.holes_particles(sdet_j)
+        else:
+            (h,) = sdet_i - sdet_j
+            (p,) = sdet_j - sdet_i
 
         return self.single_phase(h, p, spin), h, p
 
@@ -1015,10 +1198,13 @@ class Determinant(tuple):
         (-1, 2, 8, 11, 17)
         """
         sdet_i = getattr(self, spin)
-        # Holes
-        h1, h2 = sorted(sdet_i - sdet_j)
-        # Particles
-        p1, p2 = sorted(sdet_j - sdet_i)
+        if isinstance(sdet_i, int):
+            (h1, h2), (p1, p2) = sdet_i.holes_particles(sdet_j)
+        else:
+            # Holes
+            h1, h2 = sorted(sdet_i - sdet_j)
+            # Particles
+            p1, p2 = sorted(sdet_j - sdet_i)
 
         return self.double_phase((h1, h2), (p1, p2), spin), h1, h2, p1, p2
 
@@ -1034,7 +1220,12 @@ class Determinant(tuple):
         (5, 23)
         >>> Determinant.single_exc_no_phase((1, 2, 9), (1, 9, 18))
         (2, 18)
+        >>> Determinant.single_exc_no_phase(Spin_determinant_bitstring(0b10100010), 0b1010000010)
+        (5, 9)
         """
+        if isinstance(sdet_i, int):
+            ((h,), (p,)) = Spin_determinant_bitstring(sdet_i).holes_particles(sdet_j)
+            return h, p
         (h,) = set(sdet_i) - set(sdet_j)
         (p,) = set(sdet_j) - set(sdet_i)
 
@@ -1052,7 +1243,12 @@ class Determinant(tuple):
         (3, 4, 12, 13)
         >>> Determinant.double_exc_no_phase((1, 2, 3, 4, 5, 6, 7, 8, 9), (1, 2, 4, 5, 6, 7, 8, 12, 18))
         (3, 9, 12, 18)
+        >>> Determinant.double_exc_no_phase(Spin_determinant_bitstring(0b11110), 0b101010010)
+        (2, 3, 6, 8)
         """
+        if isinstance(sdet_i, int):
+            (h1, h2), (p1, p2) = Spin_determinant_bitstring(sdet_i).holes_particles(sdet_j)
+            return h1, h2, p1, p2
 
         # Holes
         h1, h2 = sorted(set(sdet_i) - set(sdet_j))
@@ -1063,9 +1259,280 @@ class Determinant(tuple):
         return h1, h2, p1, p2
 
 
+#    _                          _
+#   |_) _.  _ |   _   _|   |_) _ o    _|  _ _|_
+#   |  (_| (_ |< (/_ (_|   |  _> |   (_| (/_ |_
+#
+
+# Number of bits set in each byte, used when `np.bitwise_count` is not available (numpy < 2.0)
+_POPCOUNT_TABLE = np.array([bin(i).count("1") for i in range(256)], dtype=np.uint8)
+
+
+def popcount(words: np.ndarray) -> np.ndarray:
+    """Number of bits set in each element of an uint64 array
+    >>> popcount(np.array([0, 1, 3, 2**63 + 7], dtype=np.uint64))
+    array([0, 1, 2, 4])
+    """
+    words = np.ascontiguousarray(words, dtype=np.uint64)
+    if hasattr(np, "bitwise_count"):
+        return np.bitwise_count(words).astype(np.int64)
+    bytes_ = _POPCOUNT_TABLE[words.view(np.uint8)].reshape(*words.shape, 8)
+    return bytes_.sum(axis=-1, dtype=np.int64)
+
+
+class Psi_det_packed(object):
+    """Determinants of a wave function, as two (N_det x n_words) arrays of uint64 occupation words:
+    bit `o % 64` of word `o // 64` is set when orbital `o` is occupied.
+    16 bytes per determinant (for n_orb <= 64), and excitation degrees of many determinants computed
+    at once with popcounts of XORs, instead of one `Determinant.exc_degree` call per pair.
+
+    >>> psi = Psi_det_packed.from_psi_det([Determinant((0, 1), (0,)), Determinant((0, 2), (1,))], 4)
+    >>> psi.alpha
+    array([[3],
+           [5]], dtype=uint64)
+    >>> psi.exc_degree(Determinant((0, 1), (1,)))
+    (array([0, 1]), array([1, 0]))
+    >>> psi[:1].is_connected(Determinant((0, 1), (1,)))
+    array([ True])
+    >>> psi[1]
+    Determinant(alpha=5, beta=2)
+    >>> pairs = psi.connected_pairs(psi)
+    >>> sorted(pairs)
+    [(0, 0), (1, 1)]
+    >>> pairs[(1, 1)]
+    (array([0, 1]), array([1, 0]))
+    """
+
+    # (ed_up, ed_dn) of the pairs of determinants with a non-zero <I|H|J>
+    connected_degrees = ((0, 0), (1, 0), (0, 1), (2, 0), (0, 2), (1, 1))
+
+    def __init__(self, alpha: np.ndarray, beta: np.ndarray):
+        self.alpha = alpha
+        self.beta = beta
+
+    @staticmethod
+    def n_words(n_orb: int) -> int:
+        return (n_orb + 63) // 64
+
+    @staticmethod
+    def spindet_to_words(sdet, n_words: int) -> List[int]:
+        """Split a |Spin_determinant| (tuple or bitstring) in 64 bits words, lowest first"""
+        if isinstance(sdet, int):
+            bits = int(sdet)
+        else:
+            bits = Spin_determinant_bitstring.create_bitmask(tuple(sdet))
+        return [(bits >> (64 * w)) & 0xFFFFFFFFFFFFFFFF for w in range(n_words)]
+
+    @classmethod
+    def from_psi_det(cls, psi_det: List[Determinant], n_orb: int):
+        n_words = cls.n_words(n_orb)
+
+        def pack(spin):
+            words = [cls.spindet_to_words(getattr(det, spin), n_words) for det in psi_det]
+            return np.array(words, dtype=np.uint64).reshape(len(psi_det), n_words)
+
+        return cls(pack("alpha"), pack("beta"))
+
+    def __len__(self):
+        return len(self.alpha)
+
+    def __getitem__(self, key):
+        """Slices stay packed, a single index is unpacked to a bitstring |Determinant|"""
+        if isinstance(key, slice):
+            return Psi_det_packed(self.alpha[key], self.beta[key])
+
+        def unpack(words):
+            return sum(int(w) << (64 * i) for i, w in enumerate(words))
+
+        return Determinant(unpack(self.alpha[key]), unpack(self.beta[key]))
+
+    @property
+    def nbytes(self):
+        return self.alpha.nbytes + self.beta.nbytes
+
+    @property
+    def keys(self) -> np.ndarray:
+        """One fixed-size bytes key per determinant (alpha then beta words, big-endian),
+        so that arrays of determinants can be sorted, searched (`np.searchsorted`) and
+        compared with numpy, without one Python object per determinant.
+        >>> psi = Psi_det_packed.from_psi_det(
+        ...     [Determinant((0, 2), (0,)), Determinant((0, 1), (1,)), Determinant((0, 2), (0,))], 4
+        ... )
+        >>> keys = psi.keys
+        >>> keys.dtype
+        dtype('S16')
+        >>> [bool(keys[0] == keys[2]), bool(keys[0] == keys[1])]
+        [True, False]
+        >>> np.argsort(keys, kind="stable")
+        array([1, 0, 2])
+        """
+        words = np.ascontiguousarray(np.c_[self.alpha, self.beta], dtype=">u8")
+        return words.view(f"S{words.itemsize * words.shape[1]}").reshape(len(self))
+
+    def exc_degree(self, det_J: Determinant) -> Tuple[np.ndarray, np.ndarray]:
+        """Excitation degrees (alpha, beta) between each determinant of self and det_J"""
+        n_words = self.alpha.shape[1]
+        J_a = np.array(self.spindet_to_words(det_J.alpha, n_words), dtype=np.uint64)
+        J_b = np.array(self.spindet_to_words(det_J.beta, n_words), dtype=np.uint64)
+        ed_up = popcount(self.alpha ^ J_a).sum(axis=1) // 2
+        ed_dn = popcount(self.beta ^ J_b).sum(axis=1) // 2
+        return ed_up, ed_dn
+
+    def is_connected(self, det_J: Determinant) -> np.ndarray:
+        """`Determinant.is_connected` of each determinant of self with det_J, as a bool array"""
+        ed_up, ed_dn = self.exc_degree(det_J)
+        ed = ed_up + ed_dn
+        return (ed >= 1) & (ed <= 2)
+
+    def connected_pairs(
+        self, other, chunk_size: int = None
+    ) -> Dict[Tuple[int, int], Tuple[np.ndarray, np.ndarray]]:
+        """Screen all the (I, J) pairs, I in self and J in other, in one call.
+        Return the pairs of excitation degree <= 2 (the only ones where <I|H|J> can be non zero),
+        grouped by (ed_up, ed_dn): {(ed_up, ed_dn): (I, J) arrays}. Empty groups are omitted.
+
+        The degrees are computed for `chunk_size` rows of self at a time against all of other,
+        as popcounts of the XOR of the words (by default, ~1M pairs per chunk).
+        """
+        if chunk_size is None:
+            chunk_size = max(1, 2**20 // max(1, len(other)))
+        l_I = {degree: [] for degree in self.connected_degrees}
+        l_J = {degree: [] for degree in self.connected_degrees}
+        for begin in range(0, len(self), chunk_size):
+            end = begin + chunk_size
+            ed_up = popcount(self.alpha[begin:end, np.newaxis] ^ other.alpha).sum(axis=-1) // 2
+            ed_dn = popcount(self.beta[begin:end, np.newaxis] ^ other.beta).sum(axis=-1) // 2
+            I, J = np.nonzero(ed_up + ed_dn <= 2)
+            ed_up, ed_dn = ed_up[I, J], ed_dn[I, J]
+            for degree in self.connected_degrees:
+                mask = (ed_up == degree[0]) & (ed_dn == degree[1])
+                l_I[degree].append(I[mask] + begin)
+                l_J[degree].append(J[mask])
+        return {
+            degree: (np.concatenate(l_I[degree]), np.concatenate(l_J[degree]))
+            for degree in self.connected_degrees
+            if sum(map(len, l_I[degree]))
+        }
+
+
 Psi_det = List[Determinant]
 Psi_coef = List[float]
 # We have two type of energy.
 # The varitional Energy who correpond Psi_det
 # The pt2 Energy who correnpond to the pertubative energy induce by each determinant connected to Psi_det
 Energy = NewType("Energy", float)
+
+
+#    _                          _
+#   |_) _.  _ |   _   _|   | ._ _|_  _   _  ._ _. |  _
+#   |  (_| (_ |< (/_ (_|   | | | |_ (/_ (_| | (_| | _>
+#                                       _|
+
+
+class Two_electron_integral_packed(Mapping):
+    """Two-electron integrals stored in one contiguous float64 array, indexed by `compound_idx4`.
+    For real orbitals, <ij|kl> has an 8-fold permutation symmetry, and `compound_idx4` maps
+    the 8 equivalent (i, j, k, l) to the same canonical index: we only store those.
+
+    It is a read-only `Dict[compound_idx4, float]` of the non-zero integrals, so it can be used
+    in place of the `d_two_e_integral` dictionary. (Missing indices read as 0.)
+    On top of that, `gather` fetches a whole array of integrals with a single numpy call.
+
+    >>> d = Two_electron_integral_packed.from_dict(
+    ...     {compound_idx4(0, 1, 0, 1): 0.5, compound_idx4(1, 1, 1, 1): 2.0}
+    ... )
+    >>> d.n_orb, len(d)
+    (2, 2)
+    >>> d[compound_idx4(1, 0, 1, 0)]
+    0.5
+    >>> d[compound_idx4(0, 0, 1, 1)]
+    0.0
+    >>> sorted(d.items())
+    [(3, 0.5), (5, 2.0)]
+    >>> d.gather(np.array([0, 1]), np.array([1, 1]), np.array([0, 1]), np.array([1, 1]))
+    array([0.5, 2. ])
+    """
+
+    def __init__(self, n_orb: int, data=None):
+        n_pair = (n_orb * (n_orb + 1)) // 2
+        size = (n_pair * (n_pair + 1)) // 2
+        self.n_orb = n_orb
+        if data is None:
+            data = np.zeros(size, dtype=np.float64)
+        self.data = np.asarray(data, dtype=np.float64)
+        assert self.data.shape == (size,)
+
+    @classmethod
+    def from_indices(cls, n_orb: int, idx4, values):
+        """Build from arrays of compound indices and of the corresponding integrals"""
+        d = cls(n_orb)
+        d.data[np.asarray(idx4, dtype=np.int64)] = values
+        return d
+
+    @classmethod
+    def from_dict(cls, d_two_e_integral: Dict[int, float], n_orb: int = None):
+        """Convert a `d_two_e_integral` dictionary"""
+        if n_orb is None:
+            n_orb = max(compound_idx4_reverse(max(d_two_e_integral))) + 1
+        n = len(d_two_e_integral)
+        idx4 = np.fromiter(d_two_e_integral.keys(), dtype=np.int64, count=n)
+        values = np.fromiter(d_two_e_integral.values(), dtype=np.float64, count=n)
+        return cls.from_indices(n_orb, idx4, values)
+
+    # ~
+    # Mapping interface, over the non-zero integrals
+    # ~
+    def __getitem__(self, idx4: int) -> float:
+        if not 0 <= idx4 < len(self.data):
+            raise KeyError(idx4)
+        return float(self.data[idx4])
+
+    def __contains__(self, idx4) -> bool:
+        return 0 <= idx4 < len(self.data) and self.data[idx4] != 0.0
+
+    def __iter__(self):
+        return iter(self.nonzero_idx4.tolist())
+
+    def __len__(self):
+        return len(self.nonzero_idx4)
+
+    def items(self):
+        return zip(self.nonzero_idx4.tolist(), self.data[self.nonzero_idx4].tolist())
+
+    # ~
+    # Batched access
+    # ~
+    @cached_property
+    def nonzero_idx4(self) -> np.ndarray:
+        return np.flatnonzero(self.data)
+
+    @cached_property
+    def nonzero_idx4_reverse(self) -> Tuple[np.ndarray, np.ndarray, np.ndarray, np.ndarray]:
+        """Canonical (i, j, k, l) of the non-zero integrals, precomputed once
+        (this is the reverse lookup done for every integral in the integral-driven code)"""
+        return compound_idx4_reverse_array(self.nonzero_idx4)
+
+    def gather(self, i, j, k, l) -> np.ndarray:
+        """<ij|kl> for arrays of orbital indices"""
+        return self.data[compound_idx4_array(i, j, k, l)]
+
+    # ~
+    # Shared memory
+    # ~
+    # MPI window holding `data`, when it is shared by the ranks of a node
+    # (see `drivers.bcast_integrals_shared`)
+    win = None
+
+    def close(self):
+        """Free the shared window, if any. Collective over the ranks of the node,
+        and the integrals (and any view of `data`) can't be used afterwards"""
+        if self.win is not None:
+            self.data = None
+            self.win.Free()
+            self.win = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
@@ -0,0 +1,198 @@
+from collections import defaultdict
+from contextlib import contextmanager
+import pickle
+import time
+from mpi4py import MPI
+
+#   ___          _                              _        _   _
+#  |_ _|_ _  ___| |_ _ _ _  _ _ __  ___ _ _  __| |_ __ _| |_(_)___ _ _
+#   | || ' \(_-<  _| '_| || | '  \/ -_) ' \|  _/ _` |  _| / _ \ ' \
+#  |___|_||_/__/\__|_|  \_,_|_|_|_\___|_||_|\__\__,_|\__|_\___/_||_|
+#
+# Where does a CIPSI iteration spend its time, on which rank?
+# `profiler` accumulates, per rank, timers (seconds), counters (integrals visited, elements
+# emitted, constraints...) and peaks (cache sizes...). It is off by default, and then costs one
+# attribute test per call: the timers and counters are placed around whole phases or loops,
+# never per matrix element.
+# Timers are inclusive: "H matrix elements" is also in "H_i * M", itself in "Davidson".
+# `Instrumented_comm` is a communicator which records the time and size of its collectives
+# (the size of the pickled ones only if `profiler.pickled_bytes`: it costs one more pickle.dumps
+# of every payload).
+# `Profiler.report` gathers everything and shows min / avg / max over the ranks
+# (a large max / avg is a load imbalance).
+
+
+class Profiler(object):
+    """
+    >>> p = Profiler()
+    >>> p.enabled = True
+    >>> with p.timer("phase"):
+    ...     p.count("items", 3)
+    ...     p.peak("size", 10)
+    ...     p.peak("size", 4)
+    >>> p.counters["items"], p.counters["phase calls"], p.peaks["size"]
+    (3, 1, 10)
+    >>> stats = p.drain()
+    >>> p.counters["items"]
+    0
+    >>> p.merge(stats)
+    >>> p.counters["items"]
+    3
+    """
+
+    def __init__(self):
+        self.enabled = False
+        # Measure the lower-case (pickled) collectives too, see `Instrumented_comm`
+        self.pickled_bytes = False
+        self.reset()
+
+    def reset(self):
+        self.times = defaultdict(float)
+        self.counters = defaultdict(int)
+        self.peaks = defaultdict(int)
+
+    @contextmanager
+    def timer(self, name):
+        if not self.enabled:
+            yield
+            return
+        start = time.perf_counter()
+        try:
+            yield
+        finally:
+            self.times[name] += time.perf_counter() - start
+            self.counters[f"{name} calls"] += 1
+
+    def count(self, name, n=1):
+        if self.enabled:
+            self.counters[name] += n
+
+    def peak(self, name, value):
+        if self.enabled:
+            self.peaks[name] = max(self.peaks[name], value)
+
+    def drain(self):
+        """What was recorded since the last `drain` (None if disabled), and reset"""
+        if not self.enabled:
+            return None
+        stats = (dict(self.times), dict(self.counters), dict(self.peaks))
+        self.reset()
+        return stats
+
+    def merge(self, stats):
+        """Add the `drain` of another process (e.g. a worker of `Worker_pool`)"""
+        if stats is None:
+            return
+        times, counters, peaks = stats
+        for name, t in times.items():
+            self.times[name] += t
+        for name, n in counters.items():
+            self.counters[name] += n
+        for name, value in peaks.items():
+            self.peaks[name] = max(self.peaks[name], value)
+
+    def report(self, comm, title=""):
+        """Collective. min / avg / max over the ranks of all that was recorded since the last
+        report (and reset). Returns the formatted table on rank 0, None on the others."""
+        enabled, self.enabled = self.enabled, False  # (don't count the report itself)
+        all_stats = comm.gather((dict(self.times), dict(self.counters), dict(self.peaks)), root=0)
+        self.enabled = enabled
+        self.reset()
+        if comm.Get_rank() != 0:
+            return None
+
+        lines = [f"{title} ({len(all_stats)} ranks)", f"{'':<50}{'min':>14}{'avg':>14}{'max':>14}"]
+        # Timers (in s), then counters, then peaks
+        formats = [(" (s)", "{:>14.4f}"), ("", "{:>14.6g}"), ("", "{:>14.6g}")]
+        for kind, (suffix, fmt) in enumerate(formats):
+            for name in sorted(set().union(*(stats[kind] for stats in all_stats))):
+                values = [stats[kind].get(name, 0) for stats in all_stats]
+                row = (min(values), sum(values) / len(values), max(values))
+                lines.append(f"  {name + suffix:<48}" + "".join(fmt.format(x) for x in row))
+        return "\n".join(lines)
+
+
+profiler = Profiler()
+
+
+def _message_size(message, pickled):
+    """Bytes sent by this rank: the buffer of `[array, ...]` messages, the pickle of objects"""
+    if pickled:
+        return len(pickle.dumps(message, pickle.HIGHEST_PROTOCOL))
+    if isinstance(message, (list, tuple)):
+        message = message[0]
+    return getattr(message, "nbytes", 0)
+
+
+# Position of the `op' argument of the reductions
+_OP_POSITION = {"allreduce": 1, "reduce": 1, "Allreduce": 2, "Reduce": 2, "Reduce_scatter": 3}
+
+
+def _instrumented(name):
+    base = getattr(MPI.Intracomm, name)
+    pickled = name.islower()
+
+    def method(self, *args, **kwargs):
+        if not profiler.enabled:
+            return base(self, *args, **kwargs)
+        key = f"MPI {name}"
+        position = _OP_POSITION.get(name, len(args))
+        op = kwargs.get("op", args[position] if position < len(args) else None)
+        for loc in ("MINLOC", "MAXLOC"):
+            if op is not None and op == getattr(MPI, loc):
+                key += f" {loc}"
+        # (the first argument is the message: sendobj, sendbuf or buf)
+        message = args[0] if args else next(iter(kwargs.values()), None)
+        if not pickled or profiler.pickled_bytes:
+            profiler.count(f"{key} bytes", _message_size(message, pickled))
+        with profiler.timer(key):
+            return base(self, *args, **kwargs)
+
+    method.__name__ = name
+    method.__doc__ = base.__doc__
+    return method
+
+
+class Instrumented_comm(MPI.Intracomm):
+    """The same communicator as `comm` (same handle, not a duplicate), whose collectives are
+    timed ("MPI <name>", "MPI allreduce MINLOC"...) and measured ("MPI <name> bytes")
+    in `profiler`. Communicators derived from it (Split...) are not instrumented.
+    The pickled collectives are only measured with `profiler.pickled_bytes`
+    (their payload is pickled once more, just to be measured).
+
+    >>> comm = Instrumented_comm(MPI.COMM_WORLD)
+    >>> profiler.enabled = True
+    >>> comm.allreduce(1) == comm.Get_size()
+    True
+    >>> profiler.counters["MPI allreduce calls"], "MPI allreduce bytes" in profiler.counters
+    (1, False)
+    >>> profiler.pickled_bytes = True
+    >>> comm.allreduce(1) == comm.Get_size()
+    True
+    >>> profiler.counters["MPI allreduce bytes"] > 0
+    True
+    >>> profiler.enabled = profiler.pickled_bytes = False
+    >>> profiler.reset()
+    """
+
+
+INSTRUMENTED_COLLECTIVES = [
+    "Allreduce",
+    "Allgather",
+    "Allgatherv",
+    "Alltoall",
+    "Alltoallv",
+    "Bcast",
+    "Reduce",
+    "Reduce_scatter",
+    "Gather",
+    "Gatherv",
+    "Barrier",
+    "allreduce",
+    "allgather",
+    "bcast",
+    "gather",
+    "reduce",
+]
+for _name in INSTRUMENTED_COLLECTIVES:
+    setattr(Instrumented_comm, _name, _instrumented(_name))
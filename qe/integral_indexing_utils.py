@@ -1,5 +1,6 @@
 from functools import cache
 import math
+import numpy as np
 
 # _____          _           _               _   _ _   _ _
 # |_  _|        | |         (_)             | | | | | (_) |
@@ -165,3 +166,56 @@ def canonical_idx4(i, j, k, l):
         return i, j, k, l
     else:
         return j, i, l, k
+
+
+# ~
+# Vectorized versions, for numpy arrays of indices
+# ~
+
+
+def compound_idx2_array(i, j):
+    """
+    compound_idx2 for arrays of indices
+    >>> compound_idx2_array(np.array([0, 1, 2]), np.array([1, 1, 1]))
+    array([1, 2, 4])
+    """
+    i, j = np.asarray(i, dtype=np.int64), np.asarray(j, dtype=np.int64)
+    p, q = np.minimum(i, j), np.maximum(i, j)
+    return (q * (q + 1)) // 2 + p
+
+
+def compound_idx4_array(i, j, k, l):
+    """
+    compound_idx4 for arrays of indices
+    >>> compound_idx4_array([0, 1, 1], [1, 0, 0], [0, 1, 1], [0, 0, 1])
+    array([1, 3, 4])
+    """
+    return compound_idx2_array(compound_idx2_array(i, k), compound_idx2_array(j, l))
+
+
+def compound_idx2_reverse_array(ij):
+    """
+    compound_idx2_reverse for an array of compound indices
+    >>> compound_idx2_reverse_array(np.array([0, 1, 2, 3]))
+    (array([0, 0, 1, 0]), array([0, 1, 1, 2]))
+    """
+    ij = np.asarray(ij, dtype=np.int64)
+    j = ((np.sqrt(8 * ij + 1) - 1) // 2).astype(np.int64)
+    # The floating point square root can be off by one, fix it
+    j -= (j * (j + 1)) // 2 > ij
+    j += ((j + 1) * (j + 2)) // 2 <= ij
+    i = ij - (j * (j + 1)) // 2
+    return i, j
+
+
+def compound_idx4_reverse_array(ijkl):
+    """
+    compound_idx4_reverse for an array of compound indices
+    returns (i, j, k, l) arrays, in canonical ordering
+    >>> compound_idx4_reverse_array(np.array([0, 1, 2, 3, 37]))
+    (array([0, 0, 0, 0, 0]), array([0, 0, 0, 1, 2]), array([0, 0, 1, 0, 1]), array([0, 1, 1, 1, 3]))
+    """
+    ik, jl = compound_idx2_reverse_array(ijkl)
+    i, k = compound_idx2_reverse_array(ik)
+    j, l = compound_idx2_reverse_array(jl)
+    return i, j, k, l
@@ -5,11 +5,17 @@ from qe.fundamental_types import (
     Determinant,
     Energy,
     List,
+    Two_electron_integral_packed,
+    Psi_det_packed,
 )
+from qe.sparse_matrix import CSR_matrix
 from collections import defaultdict
 from qe.integral_indexing_utils import compound_idx4
 import math
-from itertools import takewhile
+import os
+import threading
+from itertools import takewhile, islice
+import numpy as np
 
 #   _____      _ _   _       _ _          _   _
 #  |_   _|    (_) | (_)     | (_)        | | (_)
@@ -29,14 +35,20 @@ def manipulate_line(raw_line, used_zip):
 # Integrals of the Hamiltonian over molecular orbitals
 # ~
 def load_integrals(
-    fcidump_path,
+    fcidump_path, two_e_representation="dict"
 ) -> Tuple[int, float, One_electron_integral, Two_electron_integral]:
     """Read all the Hamiltonian integrals from the data file.
     Returns: (E0, d_one_e_integral, d_two_e_integral).
     E0 : a float containing the nuclear repulsion energy (V_nn),
     d_one_e_integral : a dictionary of one-electron integrals,
-    d_two_e_integral : a dictionary of two-electron integrals.
+    d_two_e_integral : a dictionary of two-electron integrals,
+        or a |Two_electron_integral_packed| if `two_e_representation` is "packed".
+
+    `fcidump_path` can also be a binary integral file (see `convert_fcidump`),
+    which is memory-mapped instead of parsed.
     """
+    if two_e_representation not in ("dict", "packed"):
+        raise NotImplementedError
     import glob
 
     if len(glob.glob(fcidump_path)) == 1:
@@ -48,29 +60,70 @@ def load_integrals(
         for i in glob.glob(fcidump_path):
             print(i)
 
-    # Add used_zip boolean so we know if we need to decode the lines.
-    used_zip = True
+    if fcidump_path.endswith(BINARY_INTEGRALS_SUFFIX):
+        return load_integrals_binary(fcidump_path, two_e_representation)
+
+    n_orb, E0, d_one_e_integral, d_two_e_integral, _ = read_fcidump(fcidump_path)
+
+    if two_e_representation == "packed":
+        d_two_e_integral = Two_electron_integral_packed.from_dict(d_two_e_integral, n_orb)
+
+    return n_orb, E0, d_one_e_integral, d_two_e_integral
 
+
+def open_fcidump(fcidump_path):
+    """(file, whether its lines are bytes to decode) of a (possibly gz/bz2 compressed) FCIDUMP"""
     # Use an iterator to avoid storing everything in memory twice.
     if fcidump_path.split(".")[-1] == "gz":
         import gzip
 
-        f = gzip.open(fcidump_path)
+        return gzip.open(fcidump_path), True
     elif fcidump_path.split(".")[-1] == "bz2":
         import bz2
 
-        f = bz2.open(fcidump_path)
-    else:
-        f = open(fcidump_path)
-        used_zip = False
+        return bz2.open(fcidump_path), True
+    return open(fcidump_path), False
 
-    # Only non-zero integrals are stored in the fci_dump.
-    # Hence we use a defaultdict to handle the sparsity
-    n_orb = int(next(f).split()[2])
+
+def read_fcidump_header(f, used_zip) -> Tuple[int, List[int]]:
+    """(n_orb, orbsym) from the namelist header of an open FCIDUMP, which is left at its first
+    integral. ORBSYM is all 1 (no symmetry) if missing.
+    ISYM (irrep of the target state) is not needed: the excitations allowed by symmetry keep the
+    irrep of the determinant they come from, so the one of the wave function is set by its
+    input determinants."""
+    first_line = manipulate_line(next(f), used_zip)
+    n_orb = int(first_line.split()[2])
 
     # Using takewhile we 'take lines from the file' while '/' has not been found
     # Needed so we can start reading data on the integrals.
     lines = list(takewhile(lambda line: "/" not in manipulate_line(line, used_zip), f))
+    orbsym = parse_orbsym(" ".join([first_line] + [manipulate_line(l, used_zip) for l in lines]))
+    if len(orbsym) != n_orb:
+        orbsym = [1] * n_orb
+    return n_orb, orbsym
+
+
+def load_orbsym(fcidump_path) -> List[int]:
+    """Irreps of the orbitals (ORBSYM, numbered from 1) of a FCIDUMP, of which only the header
+    is read, or of a binary integral file"""
+    if fcidump_path.endswith(BINARY_INTEGRALS_SUFFIX):
+        return load_orbsym_binary(fcidump_path)
+    f, used_zip = open_fcidump(fcidump_path)
+    with f:
+        _, orbsym = read_fcidump_header(f, used_zip)
+    return orbsym
+
+
+def read_fcidump(fcidump_path):
+    """Parse a (possibly gz/bz2 compressed) FCIDUMP.
+    Returns: (n_orb, E0, d_one_e_integral, d_two_e_integral, orbsym)
+    """
+    # Add used_zip boolean so we know if we need to decode the lines.
+    f, used_zip = open_fcidump(fcidump_path)
+
+    # Only non-zero integrals are stored in the fci_dump.
+    # Hence we use a defaultdict to handle the sparsity
+    n_orb, orbsym = read_fcidump_header(f, used_zip)
 
     d_one_e_integral = defaultdict(int)
     d_two_e_integral = defaultdict(int)
@@ -100,13 +153,158 @@ def load_integrals(
 
     f.close()
 
+    return n_orb, E0, d_one_e_integral, d_two_e_integral, orbsym
+
+
+def parse_orbsym(header) -> List[int]:
+    """Irreps of the orbitals, from the namelist header of a FCIDUMP
+    >>> parse_orbsym("&FCI NORB= 4, NELEC= 2, MS2= 0, ORBSYM=1,1,2, 3, ISYM=0,")
+    [1, 1, 2, 3]
+    >>> parse_orbsym("&FCI NORB= 4, NELEC= 2,")
+    []
+    """
+    import re
+
+    m = re.search(r"ORBSYM\s*=\s*([\d\s,]*)", header, re.IGNORECASE)
+    if m is None:
+        return []
+    return [int(x) for x in re.split(r"[\s,]+", m.group(1)) if x]
+
+
+#  ___ _                        _     _                     _
+# | _ |_)_ _  __ _ _ _ _  _    (_)_ _| |_ ___ __ _ _ _ __ _| |___
+# | _ \ | ' \/ _` | '_| || |   | | ' \  _/ -_) _` | '_/ _` | (_-<
+# |___/_|_||_\__,_|_|  \_, |   |_|_||_\__\___\__, |_| \__,_|_/__/
+#                      |__/                  |___/
+#
+# Parsing a text FCIDUMP line by line is (by far) the start-up bottleneck of small runs.
+# `convert_fcidump` writes the integrals once in a binary file, that `load_integrals_binary`
+# opens with `np.memmap`: nothing is parsed, and the pages are shared by all the processes
+# of a node through the OS page cache.
+#
+# Layout (native endianness, everything is 8 bytes, so every section is aligned):
+#    magic                            8 bytes
+#    n_orb, n_two_e, has_index        int64
+#    E0                               float64
+#    ORBSYM                           int64[n_orb]
+#    one-electron integrals           float64[n_orb, n_orb]
+#    two-electron integrals           float64[n_two_e]
+#    (if has_index) compound_idx4     int64[n_two_e]
+# Without index the two-electron values are the whole `Two_electron_integral_packed.data`
+# array, with index only the non-zero integrals are stored (how sparse files stay small).
+
+BINARY_INTEGRALS_MAGIC = b"QEINT\x00\x00\x01"
+BINARY_INTEGRALS_SUFFIX = ".qeint"
+
+
+def write_integrals_binary(
+    path, n_orb, E0, d_one_e_integral, d_two_e_integral, orbsym=None, sparse=None
+):
+    """Write the integrals in the binary format.
+    `sparse`: store an index array with the non-zero integrals only.
+        By default, whichever is smaller (the index cost 8 bytes per integral).
+    """
+    if not isinstance(d_two_e_integral, Two_electron_integral_packed):
+        d_two_e_integral = Two_electron_integral_packed.from_dict(d_two_e_integral, n_orb)
+    if orbsym is None:
+        orbsym = [1] * n_orb
+    if sparse is None:
+        sparse = 2 * len(d_two_e_integral.nonzero_idx4) < len(d_two_e_integral.data)
+
+    one_e = np.zeros((n_orb, n_orb), dtype=np.float64)
+    for (i, j), v in d_one_e_integral.items():
+        one_e[i, j] = v
+
+    if sparse:
+        idx4 = d_two_e_integral.nonzero_idx4
+        two_e = d_two_e_integral.data[idx4]
+    else:
+        two_e = d_two_e_integral.data
+
+    with open(path, "wb") as f:
+        f.write(BINARY_INTEGRALS_MAGIC)
+        np.array([n_orb, len(two_e), int(sparse)], dtype=np.int64).tofile(f)
+        np.array([E0], dtype=np.float64).tofile(f)
+        np.asarray(orbsym, dtype=np.int64).tofile(f)
+        one_e.tofile(f)
+        np.asarray(two_e, dtype=np.float64).tofile(f)
+        if sparse:
+            np.asarray(idx4, dtype=np.int64).tofile(f)
+
+
+def convert_fcidump(fcidump_path, binary_path=None, sparse=None) -> str:
+    """One-time conversion of a FCIDUMP into the binary format.
+    By default, the binary file is written next to the FCIDUMP (compression extension stripped).
+    Returns the path of the binary file.
+    """
+    if binary_path is None:
+        root = fcidump_path
+        for ext in (".gz", ".bz2"):
+            if root.endswith(ext):
+                root = root[: -len(ext)]
+        binary_path = root + BINARY_INTEGRALS_SUFFIX
+    n_orb, E0, d_one_e_integral, d_two_e_integral, orbsym = read_fcidump(fcidump_path)
+    write_integrals_binary(
+        binary_path, n_orb, E0, d_one_e_integral, d_two_e_integral, orbsym, sparse
+    )
+    return binary_path
+
+
+def load_integrals_binary(path, two_e_representation="packed"):
+    """Memory-map a binary integral file. Same return value as `load_integrals`.
+    With the dense layout and the "packed" representation, nothing is copied:
+    the |Two_electron_integral_packed| is a read-only view of the file."""
+    with open(path, "rb") as f:
+        if f.read(len(BINARY_INTEGRALS_MAGIC)) != BINARY_INTEGRALS_MAGIC:
+            raise ValueError(f"{path} is not a binary integral file")
+        n_orb, n_two_e, has_index = np.fromfile(f, dtype=np.int64, count=3).tolist()
+        (E0,) = np.fromfile(f, dtype=np.float64, count=1).tolist()
+
+    def section(dtype, shape, offset):
+        return np.memmap(path, dtype=dtype, mode="r", offset=offset, shape=shape)
+
+    offset = len(BINARY_INTEGRALS_MAGIC) + 4 * 8
+    offset += n_orb * 8  # ORBSYM, not needed here
+    one_e = section(np.float64, (n_orb, n_orb), offset)
+    offset += n_orb * n_orb * 8
+    two_e = section(np.float64, (n_two_e,), offset)
+    offset += n_two_e * 8
+
+    d_one_e_integral = defaultdict(int)
+    for i, j in zip(*np.nonzero(one_e)):
+        d_one_e_integral[(int(i), int(j))] = float(one_e[i, j])
+
+    if has_index:
+        idx4 = section(np.int64, (n_two_e,), offset)
+        d_two_e_integral = Two_electron_integral_packed.from_indices(n_orb, idx4, two_e)
+    else:
+        d_two_e_integral = Two_electron_integral_packed(n_orb, two_e)
+
+    if two_e_representation == "dict":
+        d_two_e_integral = defaultdict(int, d_two_e_integral.items())
+    elif two_e_representation != "packed":
+        raise NotImplementedError
+
     return n_orb, E0, d_one_e_integral, d_two_e_integral
 
 
+def load_orbsym_binary(path) -> List[int]:
+    """ORBSYM stored in a binary integral file"""
+    with open(path, "rb") as f:
+        f.seek(len(BINARY_INTEGRALS_MAGIC))
+        n_orb = int(np.fromfile(f, dtype=np.int64, count=1)[0])
+    offset = len(BINARY_INTEGRALS_MAGIC) + 4 * 8
+    return np.memmap(path, dtype=np.int64, mode="r", offset=offset, shape=(n_orb,)).tolist()
+
+
 def load_wf(path_wf, det_representation="tuple") -> Tuple[List[float], List[Determinant]]:
     """Read the input file :
     Representation of the Slater determinants (basis) and
-    vector of coefficients in this basis (wave function)."""
+    vector of coefficients in this basis (wave function).
+
+    `path_wf` can also be a binary wf file (see `convert_wf`).
+    Both are decoded into packed words first (`read_wf_packed`, `load_wf_binary`),
+    then one |Determinant| is made per packed determinant (`unpack_psi_det`)."""
 
     import glob
 
@@ -119,61 +317,177 @@ def load_wf(path_wf, det_representation="tuple") -> Tuple[List[float], List[Dete
         for i in glob.glob(path_wf):
             print(i)
 
-    if path_wf.split(".")[-1] == "gz":
+    if path_wf.endswith(BINARY_WF_SUFFIX):
+        psi_coef, psi_det_packed = load_wf_binary(path_wf)
+    else:
+        psi_coef, psi_det_packed = read_wf_packed(path_wf)
+    return psi_coef.tolist(), unpack_psi_det(psi_det_packed, det_representation)
+
+
+def open_text(path):
+    """Open a (possibly gzip or bz2 compressed) text file, to be read line by line"""
+    if path.split(".")[-1] == "gz":
         import gzip
 
-        with gzip.open(path_wf) as f:
-            data = f.read().decode().split()
-    elif path_wf.split(".")[-1] == "bz2":
+        return gzip.open(path, "rt")
+    elif path.split(".")[-1] == "bz2":
         import bz2
 
-        with bz2.open(path_wf) as f:
-            data = f.read().decode().split()
-    else:
-        with open(path_wf) as f:
-            data = f.read().split()
-
-    def decode_det(str_, representation="tuple"):
-        for i, v in enumerate(str_):
-            if v == "+":
-                if representation == "tuple":
-                    yield i
-                elif representation == "bitstring":
-                    yield "1"
-            else:
-                if representation == "bitstring":
-                    yield "0"
-
-    def grouper(iterable, n):
-        "Collect data into fixed-length chunks or blocks"
-        args = [iter(iterable)] * n
-        return zip(*args)
-
-    det = []
-    psi_coef = []
-    for coef, det_i, det_j in grouper(data, 3):
-        psi_coef.append(float(coef))
-        # Depending on representation specified, yield |Determinant| as |tuple| or |int| (bitstring)
-        if det_representation == "tuple":
-            det.append(
-                Determinant(
-                    tuple(decode_det(det_i, det_representation)),
-                    tuple(decode_det(det_j, det_representation)),
-                )
-            )
-        elif det_representation == "bitstring":
-            alpha_str = ["0", "b"] + [bit for bit in decode_det(det_i, det_representation)][::-1]
-            beta_str = ["0", "b"] + [bit for bit in decode_det(det_j, det_representation)][::-1]
-            det.append(Determinant(int(("".join(alpha_str)), 2), int(("".join(beta_str)), 2)))
-        else:
-            raise NotImplementedError
-
-    # Normalize psi_coef
+        return bz2.open(path, "rt")
+    return open(path)
 
-    norm = math.sqrt(sum(c * c for c in psi_coef))
-    psi_coef = [c / norm for c in psi_coef]
 
-    return psi_coef, det
+def decode_dets(strings, n_words) -> np.ndarray:
+    """Spin determinants of a wf file ("+" occupied, "-" empty; orbital 0 first)
+    -> (len(strings) x n_words) array of uint64 words, as in `Psi_det_packed`
+    >>> decode_dets(["++-+", "-+"], 1)
+    array([[11],
+           [ 2]], dtype=uint64)
+    >>> decode_dets(["+" + "-" * 63 + "+"], 1)
+    Traceback (most recent call last):
+        ...
+    ValueError: determinant occupies orbital 64 or above, which doesn't fit in 1 word(s)
+    """
+    width = 64 * n_words
+    # (Trailing empty orbitals past the words are fine, occupied ones would be lost)
+    if max(map(len, strings), default=0) > width and any("+" in s[width:] for s in strings):
+        raise ValueError(
+            f"determinant occupies orbital {width} or above, which doesn't fit in {n_words} word(s)"
+        )
+    buffer = "".join(s.ljust(width, "-")[:width] for s in strings).encode()
+    occupied = np.frombuffer(buffer, dtype=np.uint8).reshape(len(strings), width) == ord("+")
+    # Bit `o % 64' of word `o // 64' is orbital o: little-endian bits and bytes
+    return np.packbits(occupied, axis=1, bitorder="little").view("<u8").astype(np.uint64)
+
+
+def read_wf_packed(path_wf, chunk_size=1 << 16, n_orb=None) -> Tuple[np.ndarray, Psi_det_packed]:
+    """Streaming parser of a (text) wf file: (normalized coefficients, |Psi_det_packed|).
+    The file is read line by line, and the determinants are decoded by chunks of `chunk_size`
+    straight into packed words; so neither the whole file, its tokens,
+    nor one Python object per determinant are kept in memory.
+    The number of words is the one of `n_orb` orbitals (e.g. NORB of the FCIDUMP) if given,
+    otherwise of the longest determinant string of the first chunk (padded to 64 orbitals);
+    a later determinant which doesn't fit raises a ValueError (see `decode_dets`)."""
+
+    def tokens():
+        with open_text(path_wf) as f:
+            for line in f:
+                yield from line.split()
+
+    stream = tokens()
+    coefs, alpha, beta = [], [], []
+    while chunk := list(islice(stream, 3 * chunk_size)):
+        # (coefficient, alpha, beta) triplets; an incomplete last one is ignored
+        chunk = chunk[: len(chunk) - len(chunk) % 3]
+        if not alpha:
+            n_orb_words = n_orb or max(map(len, chunk[1::3] + chunk[2::3]), default=0)
+            n_words = Psi_det_packed.n_words(n_orb_words)
+        coefs.append(np.array(chunk[0::3], dtype=np.float64))
+        alpha.append(decode_dets(chunk[1::3], n_words))
+        beta.append(decode_dets(chunk[2::3], n_words))
+    if not coefs:
+        raise ValueError(f"{path_wf} has no determinant")
+
+    psi_coef = np.concatenate(coefs)
+    psi_coef /= np.sqrt(np.dot(psi_coef, psi_coef))
+    return psi_coef, Psi_det_packed(np.concatenate(alpha), np.concatenate(beta))
+
+
+def unpack_psi_det(psi_det_packed: Psi_det_packed, det_representation="tuple") -> List[Determinant]:
+    """One |Determinant| per packed determinant, in the representation `det_representation`"""
+    psi_det = [psi_det_packed[i] for i in range(len(psi_det_packed))]
+    if det_representation == "tuple":
+        return [det.convert_repr() for det in psi_det]
+    elif det_representation != "bitstring":
+        raise NotImplementedError
+    return psi_det
+
+
+#  ___ _                                __
+# | _ |_)_ _  __ _ _ _ _  _  __ __ __ / _|
+# | _ \ | ' \/ _` | '_| || | \ V  V /|  _|
+# |___/_|_||_\__,_|_|  \_, |  \_/\_/ |_|
+#                      |__/
+#
+# A wf file in binary, written once by `convert_wf`. The determinants are stored packed,
+# (alpha words, beta words) side by side, so that the rows of any slice of determinants are
+# contiguous: each rank can read its own block (`load_wf_binary(path, begin, end)`),
+# or all of them when the wave function is replicated.
+#
+# Layout (native endianness, 8 bytes items):
+#    magic                                    8 bytes
+#    n_det, n_words                           int64
+#    coefficients (normalized)                float64[n_det]
+#    determinants (alpha, beta words)         uint64[n_det, 2, n_words]
+
+BINARY_WF_MAGIC = b"QEWF\x00\x00\x00\x01"
+BINARY_WF_SUFFIX = ".qewf"
+BINARY_WF_HEADER_SIZE = len(BINARY_WF_MAGIC) + 2 * 8
+
+
+def write_wf_binary(path, psi_coef, psi_det_packed: Psi_det_packed):
+    n_det, n_words = psi_det_packed.alpha.shape
+    with open(path, "wb") as f:
+        f.write(BINARY_WF_MAGIC)
+        np.array([n_det, n_words], dtype=np.int64).tofile(f)
+        np.asarray(psi_coef, dtype=np.float64).tofile(f)
+        np.stack([psi_det_packed.alpha, psi_det_packed.beta], axis=1).astype(np.uint64).tofile(f)
+
+
+def convert_wf(path_wf, binary_path=None, sort_by_alpha=False) -> str:
+    """One-time conversion of a (text) wf file into the binary format.
+    By default, the binary file is written next to it (compression extension stripped).
+    With `sort_by_alpha`, the determinants (and their coefficients) are grouped by alpha
+    string, so that each rank can be given whole alpha strings (`alpha_block_distribution`).
+    Returns the path of the binary file.
+    """
+    if binary_path is None:
+        root = path_wf
+        for ext in (".gz", ".bz2"):
+            if root.endswith(ext):
+                root = root[: -len(ext)]
+        binary_path = root + BINARY_WF_SUFFIX
+    psi_coef, psi_det_packed = read_wf_packed(path_wf)
+    if sort_by_alpha:
+        order = np.lexsort(psi_det_packed.alpha.T[::-1])
+        psi_coef = psi_coef[order]
+        psi_det_packed = Psi_det_packed(psi_det_packed.alpha[order], psi_det_packed.beta[order])
+    write_wf_binary(binary_path, psi_coef, psi_det_packed)
+    return binary_path
+
+
+def load_wf_binary_header(path) -> Tuple[int, int]:
+    """(n_det, n_words) of a binary wf file"""
+    with open(path, "rb") as f:
+        if f.read(len(BINARY_WF_MAGIC)) != BINARY_WF_MAGIC:
+            raise ValueError(f"{path} is not a binary wf file")
+        n_det, n_words = np.fromfile(f, dtype=np.int64, count=2).tolist()
+    return n_det, n_words
+
+
+def load_wf_binary_alpha(path) -> np.ndarray:
+    """Alpha words (N_det x n_words) of all the determinants of a binary wf file, memory-mapped:
+    only what is accessed is read (e.g. around the boundaries of `alpha_block_distribution`)"""
+    n_det, n_words = load_wf_binary_header(path)
+    offset = BINARY_WF_HEADER_SIZE + n_det * 8
+    words = np.memmap(path, dtype=np.uint64, mode="r", offset=offset, shape=(n_det, 2, n_words))
+    return words[:, 0]
+
+
+def load_wf_binary(path, begin=0, end=None) -> Tuple[np.ndarray, Psi_det_packed]:
+    """Determinants [begin, end) of a binary wf file (default: all of them),
+    as (coefficients, |Psi_det_packed|). Only this slice is read."""
+    n_det, n_words = load_wf_binary_header(path)
+    end = n_det if end is None else min(end, n_det)
+    count = max(end - begin, 0)
+    with open(path, "rb") as f:
+        f.seek(BINARY_WF_HEADER_SIZE + begin * 8)
+        psi_coef = np.fromfile(f, dtype=np.float64, count=count)
+        f.seek(BINARY_WF_HEADER_SIZE + n_det * 8 + begin * 2 * n_words * 8)
+        words = np.fromfile(f, dtype=np.uint64, count=count * 2 * n_words)
+    words = words.reshape(count, 2, n_words)
+    alpha, beta = np.ascontiguousarray(words[:, 0]), np.ascontiguousarray(words[:, 1])
+    return psi_coef, Psi_det_packed(alpha, beta)
 
 
 def load_eref(path_ref) -> Energy:
@@ -209,3 +523,189 @@ def load_eref(path_ref) -> Energy:
     import re
 
     return float(re.search(r"E +=.+", data).group(0).strip().split()[-1])
+
+
+#   ___ _           _               _     _
+#  / __| |_  ___ __| |___ __  ___ (_)_ _| |_
+# | (__| ' \/ -_) _| / / '_ \/ _ \| | ' \  _|
+#  \___|_||_\___\__|_\_\ .__/\___/|_|_||_\__|
+#                      |_|
+#
+# State of the CIPSI loop after a selection step, to restart a killed run where it stopped.
+# The wave function is replicated on all the ranks: the master writes it.
+# Each rank can also write its (local) rows of H, so that a restart on the same number of ranks
+# doesn't recompute any matrix element.
+# Files are written to `path.tmp', then renamed: a run killed while writing keeps the previous one.
+# Both files carry the selection step they were written at: the rows of H are only reused with
+# the wave function of the same step (a run killed between the two writes leaves them apart).
+#
+# Layout of the wave function file (native endianness, 8 bytes items):
+#    magic                                                  8 bytes
+#    n_orb, n_det, n_words, n_roots, n_ranks, bitstring,    int64
+#    step
+#    E_var, E_pt2 (nan if unknown)                          float64
+#    distribution (determinants per rank)                   int64[n_ranks]
+#    alpha, beta words (`Psi_det_packed`)                   uint64[n_det, n_words] (each)
+#    coefficients (the Ritz vectors, Davidson warm start)   float64[n_det, n_roots]
+# Layout of the H_i file of a rank:
+#    magic                                                  8 bytes
+#    n_rows, n_cols, nnz, step, symmetric, point_group      int64
+#    integral_eps                                           float64
+#    indptr, indices, data (`CSR_matrix`)     int64[n_rows + 1], int32[nnz], float64[nnz]
+
+CHECKPOINT_MAGIC = b"QECKP\x00\x00\x02"
+CHECKPOINT_H_MAGIC = b"QECKH\x00\x00\x03"
+
+
+def checkpoint_H_path(path, rank) -> str:
+    return f"{path}.H{rank}"
+
+
+def _replace_atomically(path, write):
+    with open(f"{path}.tmp", "wb") as f:
+        write(f)
+    os.replace(f"{path}.tmp", path)
+
+
+def write_checkpoint(
+    path, n_orb, psi_coef, psi_det, E_var, E_pt2=None, distribution=None, step=0
+):
+    """Write the wave function (and energies) reached by the CIPSI loop.
+    `psi_coef`: one (N_det) or several (N_det x n_roots) coefficient vectors.
+    `distribution`: number of determinants of each rank (`Hamiltonian_generator.distribution`).
+    `step`: selection step of the CIPSI loop, the same as the one of `write_checkpoint_H`."""
+    coef = np.array(psi_coef, dtype=np.float64).reshape(len(psi_det), -1)
+    if distribution is None:
+        distribution = [len(psi_det)]
+    bitstring = bool(psi_det) and isinstance(psi_det[0].alpha, int)
+    packed = Psi_det_packed.from_psi_det(psi_det, n_orb)
+    n_words = Psi_det_packed.n_words(n_orb)
+    header = [n_orb, len(psi_det), n_words, coef.shape[1], len(distribution), int(bitstring), step]
+
+    def write(f):
+        f.write(CHECKPOINT_MAGIC)
+        np.array(header, dtype=np.int64).tofile(f)
+        np.array([E_var, np.nan if E_pt2 is None else E_pt2], dtype=np.float64).tofile(f)
+        np.asarray(distribution, dtype=np.int64).tofile(f)
+        packed.alpha.tofile(f)
+        packed.beta.tofile(f)
+        coef.tofile(f)
+
+    _replace_atomically(path, write)
+
+
+def load_checkpoint(path):
+    """Read a file of `write_checkpoint`.
+    Returns (psi_coef, psi_det, E_var, E_pt2, distribution, step), with psi_coef
+    (N_det x n_roots), E_pt2 None if unknown, and the determinants in the representation they
+    were written in."""
+    with open(path, "rb") as f:
+        if f.read(len(CHECKPOINT_MAGIC)) != CHECKPOINT_MAGIC:
+            raise ValueError(f"{path} is not a checkpoint file (of this version)")
+        n_orb, n_det, n_words, n_roots, n_ranks, bitstring, step = np.fromfile(
+            f, dtype=np.int64, count=7
+        ).tolist()
+        E_var, E_pt2 = np.fromfile(f, dtype=np.float64, count=2).tolist()
+        distribution = np.fromfile(f, dtype=np.int64, count=n_ranks)
+        alpha = np.fromfile(f, dtype=np.uint64, count=n_det * n_words).reshape(n_det, n_words)
+        beta = np.fromfile(f, dtype=np.uint64, count=n_det * n_words).reshape(n_det, n_words)
+        psi_coef = np.fromfile(f, dtype=np.float64, count=n_det * n_roots).reshape(n_det, n_roots)
+
+    psi_det = unpack_psi_det(Psi_det_packed(alpha, beta), "bitstring" if bitstring else "tuple")
+    return psi_coef, psi_det, E_var, None if math.isnan(E_pt2) else E_pt2, distribution, step
+
+
+def write_checkpoint_H(
+    path, rank, H_i: CSR_matrix, step=0, symmetric=False, point_group=False, integral_eps=0.0
+):
+    """Write the local rows of H of `rank` at selection `step`, next to the checkpoint `path`.
+    The settings of the `Hamiltonian_generator` which change what is stored (`symmetric`: only
+    the upper triangle; `point_group`, `integral_eps`: integrals skipped) go with them."""
+
+    def write(f):
+        f.write(CHECKPOINT_H_MAGIC)
+        header = [*H_i.shape, H_i.nnz, step, int(symmetric), int(point_group)]
+        np.array(header, dtype=np.int64).tofile(f)
+        np.array([integral_eps], dtype=np.float64).tofile(f)
+        np.asarray(H_i.indptr, dtype=np.int64).tofile(f)
+        np.asarray(H_i.indices, dtype=np.int32).tofile(f)
+        np.asarray(H_i.data, dtype=np.float64).tofile(f)
+
+    _replace_atomically(checkpoint_H_path(path, rank), write)
+
+
+def load_checkpoint_H(
+    path, rank, shape, step=0, symmetric=False, point_group=False, integral_eps=0.0
+) -> CSR_matrix:
+    """Local rows of H of `rank` saved with the checkpoint `path`,
+    None if there are none of this `shape`, `step` (the one of `load_checkpoint`) and settings
+    (see `write_checkpoint_H`): not saved, of another step, distribution or H"""
+    path_H = checkpoint_H_path(path, rank)
+    if not os.path.exists(path_H):
+        return None
+    with open(path_H, "rb") as f:
+        if f.read(len(CHECKPOINT_H_MAGIC)) != CHECKPOINT_H_MAGIC:
+            raise ValueError(f"{path_H} is not a checkpoint file of H (of this version)")
+        header = np.fromfile(f, dtype=np.int64, count=6).tolist()
+        (integral_eps_H,) = np.fromfile(f, dtype=np.float64, count=1).tolist()
+        n_rows, n_cols, nnz = header[:3]
+        settings = (step, int(symmetric), int(point_group), float(integral_eps))
+        if (n_rows, n_cols) != tuple(shape) or (*header[3:], integral_eps_H) != settings:
+            return None
+        indptr = np.fromfile(f, dtype=np.int64, count=n_rows + 1)
+        indices = np.fromfile(f, dtype=np.int32, count=nnz)
+        data = np.fromfile(f, dtype=np.float64, count=nnz)
+    return CSR_matrix((n_rows, n_cols), indptr, indices, data)
+
+
+class Checkpoint_writer(object):
+    """Run the writes of checkpoints in a background thread, so that the next selection step
+    starts at once. One write at a time: a new one first waits for the previous one.
+    The arguments are not copied, they must not be modified in place while being written
+    (the CIPSI loop creates new arrays at each step).
+    An error in the thread is raised by the next `submit` or `wait`.
+
+    >>> done = []
+    >>> writer = Checkpoint_writer()
+    >>> writer.submit(done.append, 1)
+    >>> writer.submit(done.append, 2)
+    >>> writer.wait()
+    >>> done
+    [1, 2]
+    """
+
+    def __init__(self):
+        self.thread = None
+        self.error = None
+
+    def wait(self):
+        if self.thread is not None:
+            self.thread.join()
+            self.thread = None
+        if self.error is not None:
+            error, self.error = self.error, None
+            raise error
+
+    def submit(self, f, *args, **kwargs):
+        self.wait()
+
+        def target():
+            try:
+                f(*args, **kwargs)
+            except Exception as e:
+                self.error = e
+
+        self.thread = threading.Thread(target=target, daemon=True)
+        self.thread.start()
+
+
+if __name__ == "__main__":
+    import argparse
+
+    parser = argparse.ArgumentParser(description="Convert a FCIDUMP into a binary integral file")
+    parser.add_argument("fcidump_path", help="path/filename of the FCIDUMP file")
+    parser.add_argument("binary_path", nargs="?", default=None, help="output file")
+    parser.add_argument("--sparse", choices=["auto", "yes", "no"], default="auto")
+    args = parser.parse_args()
+    sparse = {"auto": None, "yes": True, "no": False}[args.sparse]
+    print(convert_fcidump(args.fcidump_path, args.binary_path, sparse))
@@ -0,0 +1,141 @@
+from dataclasses import dataclass
+from typing import Tuple
+import numpy as np
+
+#   _____                              ___  ___      _        _
+#  /  ___|                             |  \/  |     | |      (_)
+#  \ `--. _ __   __ _ _ __ ___  ___    | .  . | __ _| |_ _ __ ___  __
+#   `--. \ '_ \ / _` | '__/ __|/ _ \   | |\/| |/ _` | __| '__| \ \/ /
+#  /\__/ / |_) | (_| | |  \__ \  __/   | |  | | (_| | |_| |  | |>  <
+#  \____/| .__/ \__,_|_|  |___/\___|   \_|  |_/\__,_|\__|_|  |_/_/\_\
+#        | |
+#        |_|
+
+
+@dataclass
+class CSR_matrix(object):
+    """Compressed sparse row (CSR) storage of a (local) block of the Hamiltonian.
+
+    Row `I` has its non-zero elements in `data[indptr[I]:indptr[I+1]]`, and their column
+    indices in `indices[indptr[I]:indptr[I+1]]`. Columns are sorted inside each row.
+    With int32 columns and float64 values, one element costs 12 bytes
+    (instead of the ~200 bytes of a `dict` entry keyed by `(I, J)`).
+
+    >>> A = CSR_matrix.from_coo([0, 2, 0, 0], [1, 0, 1, 2], [1., 4., 2., 3.], (3, 3))
+    >>> A.indptr
+    array([0, 2, 2, 3])
+    >>> A.indices
+    array([1, 2, 0], dtype=int32)
+    >>> A.data
+    array([3., 3., 4.])
+    >>> A.dot(np.array([1., 10., 100.]))
+    array([[330.],
+           [  0.],
+           [  4.]])
+    """
+
+    shape: Tuple[int, int]
+    indptr: np.ndarray
+    indices: np.ndarray
+    data: np.ndarray
+
+    @classmethod
+    def from_coo(cls, rows, cols, values, shape, drop_zeros=True):
+        """Build a CSR matrix from coordinate (COO) triplets.
+        Duplicated (I, J) entries are summed (the 1e and 2e contributions
+        of a given matrix element are merged this way).
+        If `drop_zeros`, elements which sum to exactly zero are not stored.
+        """
+        rows = np.asarray(rows, dtype=np.int64)
+        cols = np.asarray(cols, dtype=np.int64)
+        values = np.asarray(values, dtype=np.float64)
+        n_rows, _ = shape
+
+        if len(rows):
+            # Sort by row, then by column
+            order = np.lexsort((cols, rows))
+            rows, cols, values = rows[order], cols[order], values[order]
+            # Sum the duplicate entries
+            is_first = np.ones(len(rows), dtype=bool)
+            is_first[1:] = (rows[1:] != rows[:-1]) | (cols[1:] != cols[:-1])
+            (starts,) = np.nonzero(is_first)
+            values = np.add.reduceat(values, starts)
+            rows, cols = rows[starts], cols[starts]
+
+        if drop_zeros:
+            mask = values != 0.0
+            rows, cols, values = rows[mask], cols[mask], values[mask]
+
+        indptr = np.zeros(n_rows + 1, dtype=np.int64)
+        np.cumsum(np.bincount(rows, minlength=n_rows), out=indptr[1:])
+        return cls(shape, indptr, cols.astype(np.int32), values)
+
+    @property
+    def nnz(self):
+        return len(self.data)
+
+    @property
+    def nbytes(self):
+        return self.indptr.nbytes + self.indices.nbytes + self.data.nbytes
+
+    def to_coo(self):
+        """Return the (rows, cols, values) triplets of the non-zero elements"""
+        rows = np.repeat(np.arange(self.shape[0], dtype=np.int64), np.diff(self.indptr))
+        return rows, self.indices.astype(np.int64), self.data
+
+    def to_dense(self):
+        A = np.zeros(self.shape, dtype="float")
+        rows, cols, values = self.to_coo()
+        A[rows, cols] = values
+        return A
+
+    def dot(self, M, chunk_nnz=2**22):
+        """Sparse-times-dense product W = A * M.
+        M is (shape[1] x k) or a vector of size shape[1]; W is always (shape[0] x k).
+
+        The product is computed by gathering the needed rows of M (one row per non-zero),
+        scaling them, and reducing them segment-wise (`np.add.reduceat`) over each row of A.
+        Rows of A are processed by blocks of ~`chunk_nnz` non-zeros to bound the size of the temporary.
+        """
+        if M.ndim == 1:  # Handle case when M is a vector
+            M = M.reshape(len(M), 1)
+        n_rows, k = self.shape[0], M.shape[1]
+        W = np.zeros((n_rows, k), dtype="float")
+        if not self.nnz:
+            return W
+
+        # Split the rows in blocks containing about `chunk_nnz` elements each
+        bounds = np.searchsorted(self.indptr, np.arange(0, self.nnz, chunk_nnz), side="right") - 1
+        bounds = np.unique(np.append(bounds, n_rows))
+        for row_begin, row_end in zip(bounds[:-1], bounds[1:]):
+            begin, end = self.indptr[row_begin], self.indptr[row_end]
+            # `reduceat` doesn't handle empty segments, only keep the non-empty rows
+            row_counts = np.diff(self.indptr[row_begin : row_end + 1])
+            (local_rows,) = np.nonzero(row_counts)
+            if not len(local_rows):
+                continue
+            product = self.data[begin:end, np.newaxis] * M[self.indices[begin:end]]
+            W[row_begin + local_rows] = np.add.reduceat(
+                product, self.indptr[row_begin + local_rows] - begin, axis=0
+            )
+        return W
+
+    def transpose_dot(self, M):
+        """Sparse-times-dense product W = A^T * M, without forming A^T.
+        M is (shape[0] x k) or a vector of size shape[0]; W is always (shape[1] x k).
+        The scaled rows of M are summed per column of A (`np.bincount`), one column of M at a time.
+
+        >>> A = CSR_matrix.from_coo([0, 2, 0], [1, 0, 2], [1., 4., 3.], (3, 3))
+        >>> A.transpose_dot(np.array([1., 10., 100.]))
+        array([[400.],
+               [  1.],
+               [  3.]])
+        """
+        if M.ndim == 1:  # Handle case when M is a vector
+            M = M.reshape(len(M), 1)
+        n_cols, k = self.shape[1], M.shape[1]
+        W = np.zeros((n_cols, k), dtype="float")
+        rows = np.repeat(np.arange(self.shape[0], dtype=np.int64), np.diff(self.indptr))
+        for c in range(k):
+            W[:, c] = np.bincount(self.indices, weights=self.data * M[rows, c], minlength=n_cols)
+        return W
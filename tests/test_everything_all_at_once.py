@@ -14,24 +14,58 @@ from qe.integral_indexing_utils import (
     compound_idx2,
     compound_idx2_reverse,
     compound_idx4_reverse_all,
+    compound_idx4_array,
+    compound_idx4_reverse_array,
 )
 from qe.drivers import (
     integral_category,
+    Hamiltonian_one_electron,
     Hamiltonian_two_electrons_integral_driven,
     Hamiltonian_two_electrons_determinant_driven,
+    Hamiltonian_two_electrons_compiled,
     H_indices_generator,
+    Spin_string_index,
     Hamiltonian_generator,
+    Det_range,
     Powerplant_manager,
+    Davidson_manager,
     selection_step,
+    local_sort_pt2_energies,
+    global_sort_pt2_energies,
+    global_top_n_packed,
+    alpha_block_distribution,
     generate_all_constraints,
+    constraint_costs,
     check_constraint,
+    bcast_integrals_shared,
+)
+from qe.io import (
+    load_eref,
+    load_integrals,
+    load_wf,
+    convert_fcidump,
+    load_orbsym_binary,
+    BINARY_INTEGRALS_SUFFIX,
+    read_wf_packed,
+    unpack_psi_det,
+    convert_wf,
+    load_wf_binary,
+    load_wf_binary_alpha,
+    BINARY_WF_SUFFIX,
+    write_checkpoint,
+    load_checkpoint,
+    write_checkpoint_H,
+    load_checkpoint_H,
 )
-from qe.io import load_eref, load_integrals, load_wf
 from collections import defaultdict
 from itertools import product, chain
 from functools import cached_property
-from qe.fundamental_types import Determinant
+from qe.fundamental_types import Determinant, Two_electron_integral_packed, Psi_det_packed
+from qe.device import HAS_CUPY
+from qe.instrumentation import profiler, Instrumented_comm
+from qe.sparse_matrix import CSR_matrix
 from mpi4py import MPI
+import numpy as np
 
 
 class Timing:
@@ -105,6 +139,13 @@ class Test_Index(Timing, unittest.TestCase):
         for ijkl in random.sample(range(nmax), k=n):
             check_compound_idx4_reverse_is_canonical(ijkl)
 
+    def test_idx4_reverse_array(self, n=10000, nmax=1 << 48):
+        # Vectorized versions agree with the scalar ones
+        ijkl = random.sample(range(nmax), k=n)
+        i, j, k, l = compound_idx4_reverse_array(np.array(ijkl))
+        self.assertListEqual(list(zip(i, j, k, l)), [compound_idx4_reverse(x) for x in ijkl])
+        self.assertListEqual(compound_idx4_array(i, j, k, l).tolist(), ijkl)
+
 
 class Test_Category:
     def check_pair_idx_A(self, dadb, idx):
@@ -803,6 +844,905 @@ class Test_Integral_Driven_Categories(Test_Minimal):
 
             self.assertListEqual((indices_PT2_con), (ref_indices_PT2_con))
 
+    def check_compiled(self, psi_i, psi_j, d_two_e_integral):
+        # The compiled engine against the Python categories
+        # Random integrals, so that wrong phases don't cancel
+        rng = np.random.default_rng(0)
+        d_two_e_integral = {idx: rng.random() - 0.5 for idx in sorted(d_two_e_integral)}
+        h = Hamiltonian_two_electrons_integral_driven(d_two_e_integral)
+        H_ref = np.zeros((len(psi_i), len(psi_j)))
+        for (a, b), (i, j, k, l), phase in h.H_indices(psi_i, psi_j):
+            H_ref[a, b] += phase * h.H_ijkl_orbital(i, j, k, l)
+        h_compiled = Hamiltonian_two_electrons_compiled(d_two_e_integral)
+        rows, cols, values = h_compiled.H_matrix_elements(psi_i, psi_j)
+        H = np.zeros((len(psi_i), len(psi_j)))
+        np.add.at(H, (rows, cols), values)
+        np.testing.assert_allclose(H, H_ref, atol=1e-12)
+
+    def test_compiled(self):
+        psi, d_two_e_integral = self.psi_and_integral
+        self.check_compiled(psi, psi, d_two_e_integral)
+
+    def test_compiled_PT2(self):
+        psi_i, psi_j, d_two_e_integral = self.psi_and_integral_PT2
+        self.check_compiled(psi_i, psi_j, d_two_e_integral)
+
+
+class Test_One_Electron(Timing, unittest.TestCase):
+    def check_connectivity_driven(self, fcidump_path, wf_path):
+        n_ord, E0, d_one_e_integral, _ = load_integrals(f"data/{fcidump_path}")
+        _, psi_det = load_wf(f"data/{wf_path}")
+        h = Hamiltonian_one_electron(d_one_e_integral, E0)
+        # psi_i == psi_j, and psi_i != psi_j (as for an off-diagonal block of H_i)
+        for psi_i, psi_j in ((psi_det, psi_det), (psi_det[::2], psi_det[1::3])):
+            H_ref = np.array([[h.H_ij(det_i, det_j) for det_j in psi_j] for det_i in psi_i])
+            np.testing.assert_allclose(h.H(psi_i, psi_j), H_ref, atol=1e-12)
+            # Only non-zero elements are generated, and each of them once
+            elements = list(h.H_indices(psi_i, psi_j))
+            self.assertTrue(all(matrix_elt != 0 for _, matrix_elt in elements))
+            self.assertEqual(len(elements), len(set(ab for ab, _ in elements)))
+
+    def test_f2_631g_30det(self):
+        self.check_connectivity_driven("f2_631g.FCIDUMP", "f2_631g.30det.wf")
+
+    def test_f2_631g_161det(self):
+        self.check_connectivity_driven("f2_631g.161det.fcidump", "f2_631g.161det.wf")
+
+
+class Test_Sparse_Hamiltonian(Timing, unittest.TestCase):
+    def load(self, fcidump_path, wf_path, driven_by):
+        n_ord, E0, d_one_e_integral, d_two_e_integral = load_integrals(f"data/{fcidump_path}")
+        psi_coef, psi_det = load_wf(f"data/{wf_path}")
+        return Hamiltonian_generator(
+            MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by
+        )
+
+    def check_sparse_vs_dense(self, driven_by):
+        lewis = self.load("f2_631g.FCIDUMP", "f2_631g.10det.wf", driven_by)
+        H_i = lewis.H_i
+        np.testing.assert_allclose(lewis.H_i_sparse.to_dense(), H_i, atol=1e-12)
+        # Block of vectors, and a single vector
+        V = np.random.default_rng(0).standard_normal((lewis.full_problem_size, 3))
+        np.testing.assert_allclose(lewis.H_i_implicit_matrix_product(V), H_i @ V, atol=1e-10)
+        np.testing.assert_allclose(
+            lewis.H_i_implicit_matrix_product(V[:, 0]), H_i @ V[:, :1], atol=1e-10
+        )
+
+    def test_sparse_vs_dense_determinant(self):
+        self.check_sparse_vs_dense("determinant")
+
+    def test_sparse_vs_dense_integral(self):
+        self.check_sparse_vs_dense("integral")
+
+    def test_extend(self):
+        n_ord, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        _, psi_det = load_wf("data/f2_631g.30det.wf")
+        psi_old, psi_new = psi_det[:20], psi_det[20:]
+        lewis = Hamiltonian_generator(
+            MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_old, "integral"
+        )
+        # Build the caches that `extend` re-uses
+        lewis.H_i_sparse, lewis.D_i
+        lewis_extended = lewis.extend(psi_new)
+        self.assertEqual(sorted(lewis_extended.psi_internal), sorted(psi_det))
+        for I, det in enumerate(psi_old):
+            self.assertEqual(lewis_extended.psi_internal[lewis_extended.old_to_new[I]], det)
+        # Same as building everything from scratch
+        lewis_ref = Hamiltonian_generator(
+            MPI.COMM_WORLD,
+            E0,
+            d_one_e_integral,
+            d_two_e_integral,
+            lewis_extended.psi_internal,
+            "integral",
+        )
+        lewis_ref.distribution = lewis_extended.distribution
+        np.testing.assert_allclose(lewis_extended.H_i_sparse.to_dense(), lewis_ref.H_i, atol=1e-12)
+        np.testing.assert_allclose(lewis_extended.D_i, lewis_ref.D_i, atol=1e-12)
+
+
+class Test_Packed_Integrals(Timing, unittest.TestCase):
+    def load(self, fcidump_path):
+        _, _, _, d_dict = load_integrals(f"data/{fcidump_path}")
+        n_ord, E0, d_one_e_integral, d_packed = load_integrals(
+            f"data/{fcidump_path}", two_e_representation="packed"
+        )
+        return n_ord, E0, d_one_e_integral, d_dict, d_packed
+
+    def test_lookup(self):
+        n_ord, _, _, d_dict, d_packed = self.load("f2_631g.FCIDUMP")
+        self.assertEqual(d_packed.n_orb, n_ord)
+        self.assertDictEqual(dict(d_packed.items()), {k: v for k, v in d_dict.items() if v})
+        idx = np.random.default_rng(0).integers(n_ord, size=(4, 1000))
+        ref = [d_dict.get(compound_idx4(*ijkl), 0) for ijkl in idx.T.tolist()]
+        np.testing.assert_array_equal(d_packed.gather(*idx), ref)
+
+    def test_H_ii_batch(self):
+        _, E0, d_one_e_integral, d_dict, d_packed = self.load("f2_631g.FCIDUMP")
+        _, psi_det = load_wf("data/f2_631g.30det.wf")
+        h_1e = Hamiltonian_one_electron(d_one_e_integral, E0)
+        h_2e = Hamiltonian_two_electrons_determinant_driven(d_dict)
+        D_ref = [
+            h_1e.H_ii(det)
+            + sum(phase * h_2e.H_ijkl_orbital(*idx) for idx, phase in h_2e.H_ii_indices(det))
+            for det in psi_det
+        ]
+        for d_two_e_integral in (d_dict, d_packed):
+            lewis = Hamiltonian_generator(
+                MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det
+            )
+            np.testing.assert_allclose(lewis.H_ii_batch(psi_det, chunk_size=7), D_ref, atol=1e-10)
+
+    def test_bcast_shared(self):
+        comm = MPI.COMM_WORLD
+        n_ord, E0, d_one_e_integral, _, d_packed = self.load("f2_631g.FCIDUMP")
+        if comm.rank == 0:
+            args = (n_ord, E0, d_one_e_integral, d_packed)
+        else:
+            args = (None, None, None, None)
+        n_ord_s, E0_s, d_one_e_s, d_shared = bcast_integrals_shared(comm, *args)
+        self.assertEqual((n_ord_s, E0_s), (n_ord, E0))
+        self.assertDictEqual(dict(d_one_e_s), dict(d_one_e_integral))
+        np.testing.assert_array_equal(d_shared.data, d_packed.data)
+        self.assertIsNotNone(d_shared.win)
+        d_shared.close()
+        self.assertIsNone(d_shared.win)
+
+    def check_packed_vs_dict(self, driven_by):
+        _, E0, d_one_e_integral, d_dict, d_packed = self.load("f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf("data/f2_631g.10det.wf")
+        comm = MPI.COMM_WORLD
+        E, E_pt2 = [], []
+        for d_two_e_integral in (d_dict, d_packed):
+            lewis = Hamiltonian_generator(
+                comm, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by
+            )
+            E.append(Powerplant_manager(comm, lewis).E(psi_coef))
+            E_pt2.append(Powerplant_manager(comm, lewis).E_pt2(psi_coef))
+        self.assertAlmostEqual(*E, places=8)
+        self.assertAlmostEqual(*E_pt2, places=8)
+
+    def test_packed_vs_dict_determinant(self):
+        self.check_packed_vs_dict("determinant")
+
+    def test_packed_vs_dict_integral(self):
+        self.check_packed_vs_dict("integral")
+
+
+class Test_Binary_Integrals(Timing, unittest.TestCase):
+    def check_roundtrip(self, fcidump_path, sparse):
+        import tempfile
+
+        n_ord, E0, d_one_e_integral, d_packed = load_integrals(
+            f"data/{fcidump_path}", two_e_representation="packed"
+        )
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = convert_fcidump(
+                f"data/{fcidump_path}", f"{tmpdir}/int{BINARY_INTEGRALS_SUFFIX}", sparse
+            )
+            n_ord_b, E0_b, d_one_e_b, d_two_e_b = load_integrals(path, "packed")
+            self.assertEqual((n_ord_b, E0_b), (n_ord, E0))
+            self.assertDictEqual(
+                {k: v for k, v in d_one_e_b.items() if v},
+                {k: v for k, v in d_one_e_integral.items() if v},
+            )
+            np.testing.assert_array_equal(d_two_e_b.data, d_packed.data)
+            self.assertEqual(load_orbsym_binary(path), [1] * n_ord)
+            _, _, _, d_dict = load_integrals(path)
+            self.assertDictEqual(dict(d_dict), dict(d_packed.items()))
+
+    def test_dense(self):
+        self.check_roundtrip("f2_631g.FCIDUMP", sparse=False)
+
+    def test_sparse(self):
+        self.check_roundtrip("f2_631g.FCIDUMP", sparse=True)
+
+
+class Test_Binary_Wf(Timing, unittest.TestCase):
+    def test_streaming(self):
+        with open("data/f2_631g.10det.wf") as f:
+            tokens = f.read().split()
+        occupied = lambda s: tuple(i for i, c in enumerate(s) if c == "+")
+        psi_det_ref = [
+            Determinant(occupied(a), occupied(b)) for a, b in zip(tokens[1::3], tokens[2::3])
+        ]
+        psi_coef_ref = np.array(tokens[0::3], dtype=float)
+        psi_coef, psi_det = load_wf("data/f2_631g.10det.wf")
+        self.assertEqual(psi_det, psi_det_ref)
+        np.testing.assert_allclose(psi_coef, psi_coef_ref / np.linalg.norm(psi_coef_ref))
+        # Chunks don't change anything
+        coef_ref, packed_ref = read_wf_packed("data/c2_eq_hf_dz_3.22det.wf.gz")
+        coef, packed = read_wf_packed("data/c2_eq_hf_dz_3.22det.wf.gz", chunk_size=5)
+        np.testing.assert_array_equal(coef, coef_ref)
+        np.testing.assert_array_equal(packed.keys, packed_ref.keys)
+
+    def test_wider_later_chunk(self):
+        import tempfile
+
+        # The second determinant needs a second word: with one determinant per chunk, the words
+        # sized from the first chunk are too short and it is refused (not truncated); with n_orb,
+        # or with both determinants in the first chunk, it fits
+        lines = ["1.0\n++--\n++--\n", "0.5\n" + "+" * 70 + "\n++--\n"]
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = f"{tmpdir}/wide.wf"
+            with open(path, "w") as f:
+                f.writelines(lines)
+            with self.assertRaises(ValueError):
+                read_wf_packed(path, chunk_size=1)
+            _, packed = read_wf_packed(path, chunk_size=1, n_orb=70)
+            _, packed_ref = read_wf_packed(path)
+        np.testing.assert_array_equal(packed.alpha, packed_ref.alpha)
+        self.assertEqual(packed.alpha.shape, (2, 2))
+
+    def test_roundtrip(self):
+        import tempfile
+
+        psi_coef, psi_det = load_wf("data/c2_eq_hf_dz_3.22det.wf.gz", "bitstring")
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = convert_wf("data/c2_eq_hf_dz_3.22det.wf.gz", f"{tmpdir}/wf{BINARY_WF_SUFFIX}")
+            psi_coef_b, psi_det_b = load_wf(path, "bitstring")
+            self.assertEqual(psi_det_b, psi_det)
+            np.testing.assert_array_equal(psi_coef_b, psi_coef)
+            # Slices, as read by each rank
+            bounds = [0, 7, 15, 22, 30]
+            for begin, end in zip(bounds[:-1], bounds[1:]):
+                coef, packed = load_wf_binary(path, begin, end)
+                self.assertEqual(unpack_psi_det(packed, "bitstring"), psi_det[begin:end])
+                np.testing.assert_array_equal(coef, psi_coef[begin:end])
+
+
+class Test_Checkpoint(Timing, unittest.TestCase):
+    def test_roundtrip(self):
+        import tempfile
+
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = f"{tmpdir}/cipsi.ckp"
+            for det_representation in ("tuple", "bitstring"):
+                psi_coef, psi_det = load_wf("data/f2_631g.10det.wf", det_representation)
+                write_checkpoint(path, 18, psi_coef, psi_det, -198.7, -0.1, [6, 4], step=3)
+                coef, dets, E_var, E_pt2, distribution, step = load_checkpoint(path)
+                self.assertEqual(dets, psi_det)
+                self.assertEqual(type(dets[0].alpha), type(psi_det[0].alpha))
+                np.testing.assert_array_equal(coef[:, 0], psi_coef)
+                self.assertEqual((E_var, E_pt2), (-198.7, -0.1))
+                self.assertEqual(distribution.tolist(), [6, 4])
+                self.assertEqual(step, 3)
+            write_checkpoint(path, 18, psi_coef, psi_det, -198.7)
+            self.assertIsNone(load_checkpoint(path)[3])
+
+            lewis = Hamiltonian_generator(
+                MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det
+            )
+            H_i = lewis.H_i_sparse
+            write_checkpoint_H(path, 0, H_i, step=3)
+            H_i_b = load_checkpoint_H(path, 0, H_i.shape, step=3)
+            np.testing.assert_array_equal(H_i_b.to_dense(), H_i.to_dense())
+            # Another step (or distribution) is not reused, even with the same shape
+            self.assertIsNone(load_checkpoint_H(path, 0, (H_i.shape[0], H_i.shape[1] + 1), 3))
+            self.assertIsNone(load_checkpoint_H(path, 0, H_i.shape, step=2))
+            self.assertIsNone(load_checkpoint_H(path, 1, H_i.shape, step=3))
+            # Nor the rows of another H: upper triangle only, other integrals skipped
+            write_checkpoint_H(path, 0, H_i, step=3, symmetric=True, integral_eps=1e-8)
+            self.assertIsNone(load_checkpoint_H(path, 0, H_i.shape, step=3))
+            self.assertIsNone(load_checkpoint_H(path, 0, H_i.shape, step=3, symmetric=True))
+            H_i_b = load_checkpoint_H(path, 0, H_i.shape, 3, symmetric=True, integral_eps=1e-8)
+            self.assertIsNotNone(H_i_b)
+
+
+class Test_Integral_Streams(Timing, unittest.TestCase):
+    def load(self, integral_eps):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf("data/f2_631g.10det.wf")
+        lewis = Hamiltonian_generator(
+            MPI.COMM_WORLD,
+            E0,
+            d_one_e_integral,
+            d_two_e_integral,
+            psi_det,
+            "integral",
+            integral_eps=integral_eps,
+        )
+        return d_two_e_integral, psi_coef, lewis
+
+    def test_categories(self):
+        d_two_e_integral, _, lewis = self.load(0.0)
+        streams = lewis.Hamiltonian_2e_driver.category_streams
+        n_nonzero = sum(v != 0.0 for v in d_two_e_integral.values())
+        self.assertEqual(sum(len(values) for _, values in streams.values()), n_nonzero)
+        self.assertEqual(lewis.Hamiltonian_2e_driver.n_screened_integrals, 0)
+        for category, (indices, values) in streams.items():
+            self.assertEqual((indices.dtype, indices.shape[1:]), (np.int64, (4,)))
+            for idx, value in zip(map(tuple, indices.tolist()), values.tolist()):
+                self.assertEqual(integral_category(*idx), category)
+                self.assertEqual(d_two_e_integral[compound_idx4(*idx)], value)
+
+    def test_screening(self):
+        eps = 1e-4
+        d_two_e_integral, psi_coef, lewis_ref = self.load(0.0)
+        _, _, lewis = self.load(eps)
+        n_small = sum(0.0 < abs(v) < eps for v in d_two_e_integral.values())
+        self.assertEqual(lewis.Hamiltonian_2e_driver.n_screened_integrals, n_small)
+        E_ref = Powerplant_manager(MPI.COMM_WORLD, lewis_ref).E(psi_coef)
+        E = Powerplant_manager(MPI.COMM_WORLD, lewis).E(psi_coef)
+        self.assertAlmostEqual(E_ref, E, places=3)
+        # The diagonal elements are screened too
+        for X in lewis.Hamiltonian_2e_driver.coulomb_exchange:
+            self.assertTrue(((X == 0.0) | (np.abs(X) >= eps)).all())
+
+
+class Test_Bitstring(Timing, unittest.TestCase):
+    def load(self, wf_path, det_representation, driven_by):
+        n_ord, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf(f"data/{wf_path}", det_representation)
+        lewis = Hamiltonian_generator(
+            MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by
+        )
+        return n_ord, psi_coef, psi_det, lewis
+
+    def test_packed_exc_degree(self):
+        _, psi_det = load_wf("data/f2_631g.30det.wf", "bitstring")
+        _, psi_det_tuple = load_wf("data/f2_631g.30det.wf")
+        psi_det_packed = Psi_det_packed.from_psi_det(psi_det_tuple, 18)
+        for det_J in psi_det:
+            ed_up, ed_dn = psi_det_packed.exc_degree(det_J)
+            ref = [det_I.exc_degree(det_J) for det_I in psi_det]
+            self.assertListEqual(list(zip(ed_up.tolist(), ed_dn.tolist())), ref)
+        self.assertListEqual([psi_det_packed[I] for I in range(len(psi_det))], psi_det)
+
+    def test_connected_pairs(self):
+        _, psi_det = load_wf("data/f2_631g.30det.wf", "bitstring")
+        psi_i, psi_j = psi_det, psi_det[::3]
+        ref = defaultdict(list)
+        for I, det_I in enumerate(psi_i):
+            for J, det_J in enumerate(psi_j):
+                if sum(det_I.exc_degree(det_J)) <= 2:
+                    ref[det_I.exc_degree(det_J)].append((I, J))
+        packed_i = Psi_det_packed.from_psi_det(psi_i, 18)
+        packed_j = Psi_det_packed.from_psi_det(psi_j, 18)
+        # Chunks smaller than psi_i
+        pairs = packed_i.connected_pairs(packed_j, chunk_size=7)
+        self.assertDictEqual(
+            {degree: sorted(zip(I.tolist(), J.tolist())) for degree, (I, J) in pairs.items()},
+            dict(ref),
+        )
+
+    def check_bitstring_vs_tuple(self, driven_by):
+        energies = []
+        for det_representation in ("tuple", "bitstring"):
+            n_ord, psi_coef, psi_det, lewis = self.load(
+                "f2_631g.10det.wf", det_representation, driven_by
+            )
+            PP_manager = Powerplant_manager(lewis.comm, lewis)
+            E_selection, _, _ = selection_step(lewis.comm, lewis, n_ord, psi_coef, psi_det, 5)
+            energies.append((PP_manager.E(psi_coef), PP_manager.E_pt2(psi_coef), E_selection))
+        np.testing.assert_allclose(*energies, rtol=1e-10)
+
+    def test_bitstring_vs_tuple_determinant(self):
+        self.check_bitstring_vs_tuple("determinant")
+
+    def test_bitstring_vs_tuple_integral(self):
+        self.check_bitstring_vs_tuple("integral")
+
+
+class Test_Spin_String_Index(Timing, unittest.TestCase):
+    def check_index(self, det_representation):
+        _, psi_det = load_wf("data/f2_631g.161det.wf", det_representation)
+        spindet_occ = H_indices_generator.get_spindet_a_occ_spindet_b_occ(psi_det)
+        for spin, ref in zip(["alpha", "beta"], spindet_occ):
+            index = Spin_string_index(psi_det, spin)
+            # Same as the occupancy dictionaries
+            for o in range(index.n_orb + 1):
+                self.assertListEqual(index[o].tolist(), sorted(ref[o]))
+            # Factorization
+            for s, sdet in enumerate(index.strings):
+                dets = [I for I, det in enumerate(psi_det) if getattr(det, spin) == sdet]
+                self.assertListEqual(index.dets_of_string(s).tolist(), dets)
+
+    def test_index_tuple(self):
+        self.check_index("tuple")
+
+    def test_index_bitstring(self):
+        self.check_index("bitstring")
+
+
+class Test_Accumulate_Nominators(Timing, unittest.TestCase):
+    def test_vs_dict(self):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        for det_representation in ("tuple", "bitstring"):
+            psi_coef, psi_det = load_wf("data/f2_631g.10det.wf", det_representation)
+            lewis = Hamiltonian_generator(
+                MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det
+            )
+            PP_manager = Powerplant_manager(MPI.COMM_WORLD, lewis)
+            # Connected determinants (with repetitions), and some internal ones
+            dets_J = [
+                det_J for det in psi_det[:3] for det_J in det.gen_all_connected_det(lewis.N_orb)
+            ]
+            dets_J += psi_det[::-1]
+            conts = np.random.default_rng(0).random(len(dets_J))
+            ref = defaultdict(float)
+            for det_J, cont in zip(dets_J, conts.tolist()):
+                ref[det_J] += cont
+            for det in psi_det:
+                ref.pop(det, None)
+            dets, nominators = PP_manager.accumulate_nominators(dets_J, conts)
+            self.assertEqual(dets, list(ref))
+            np.testing.assert_allclose(nominators, list(ref.values()))
+
+
+class Test_Diagonal_Engine(Timing, unittest.TestCase):
+    def test_vs_H_ii_batch(self):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        for det_representation, driven_by in product(
+            ("tuple", "bitstring"), ("determinant", "integral")
+        ):
+            psi_coef, psi_det = load_wf("data/f2_631g.10det.wf", det_representation)
+            lewis = Hamiltonian_generator(
+                MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by
+            )
+            # All the singles and doubles of some internal determinants
+            sources, psi_J = zip(
+                *(
+                    (I, det_J)
+                    for I in (0, 3, 9)
+                    for det_J in psi_det[I].gen_all_connected_det(lewis.N_orb)
+                )
+            )
+            np.testing.assert_allclose(
+                lewis.diagonal_engine.H_jj(sources, psi_J), lewis.H_ii_batch(psi_J), rtol=1e-12
+            )
+
+
+class Test_Worker_Pool(Timing, unittest.TestCase):
+    def check_vs_serial(self, driven_by):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf("data/f2_631g.10det.wf")
+        results = []
+        for n_workers in (1, 3):
+            lewis = Hamiltonian_generator(
+                MPI.COMM_WORLD,
+                E0,
+                d_one_e_integral,
+                d_two_e_integral,
+                psi_det,
+                driven_by,
+                n_workers=n_workers,
+            )
+            D_i = lewis.D_i
+            pool = lewis.worker_pool.pool
+            _, E_pt2, best_dets = Powerplant_manager(MPI.COMM_WORLD, lewis).selection_pass(
+                psi_coef, 5
+            )
+            results.append((lewis.H_i, D_i, E_pt2, set(best_dets)))
+            # The workers are forked once, at the first parallel loop
+            self.assertIs(lewis.worker_pool.pool, pool)
+            self.assertEqual(pool is None, n_workers == 1)
+            lewis.close()
+            self.assertIsNone(lewis.worker_pool.pool)
+        (H_i, D_i, E_pt2, dets), (H_i_ref, D_i_ref, E_pt2_ref, dets_ref) = results
+        np.testing.assert_allclose(H_i, H_i_ref, atol=1e-12)
+        np.testing.assert_allclose(D_i, D_i_ref, rtol=1e-12)
+        self.assertAlmostEqual(E_pt2, E_pt2_ref, places=10)
+        self.assertEqual(dets, dets_ref)
+
+    def test_determinant(self):
+        self.check_vs_serial("determinant")
+
+    def test_integral(self):
+        self.check_vs_serial("integral")
+
+    def test_shares(self):
+        # The shares of the workers (rows, or integral streams) are the whole block; the
+        # determinants can be given as ranges of the generator, or packed
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        _, psi_det = load_wf("data/f2_631g.10det.wf")
+        shape = (len(psi_det), len(psi_det))
+        for driven_by in ("determinant", "integral"):
+            lewis = Hamiltonian_generator(
+                MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by
+            )
+            H_ref = lewis.H_i_matrix_elements_worker(psi_det, psi_det)
+            H_ref = CSR_matrix.from_coo(*H_ref, shape).to_dense()
+            packed = Psi_det_packed.from_psi_det(psi_det, lewis.N_orb)
+            parts = [
+                lewis.H_i_matrix_elements_worker(Det_range("psi_internal"), packed, worker, 3)
+                for worker in range(3)
+            ]
+            H = CSR_matrix.from_coo(*(np.concatenate(a) for a in zip(*parts)), shape).to_dense()
+            np.testing.assert_allclose(H, H_ref, atol=1e-12)
+
+
+class Test_Constraint_Scheduling(Timing, unittest.TestCase):
+    def load(self, wf_path="f2_631g.10det.wf"):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf(f"data/{wf_path}")
+        lewis = Hamiltonian_generator(
+            MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det
+        )
+        return psi_coef, psi_det, lewis
+
+    def test_dynamic_vs_static(self):
+        psi_coef, _, lewis = self.load()
+        E_pt2 = [
+            Powerplant_manager(lewis.comm, lewis, scheduling).E_pt2(psi_coef)
+            for scheduling in ("static", "dynamic")
+        ]
+        self.assertAlmostEqual(*E_pt2, places=10)
+
+    def test_quadruplets(self):
+        psi_coef, psi_det, lewis = self.load()
+        PP_manager = Powerplant_manager(lewis.comm, lewis)
+        E_var = PP_manager.E(psi_coef)
+        na = len(psi_det[0].alpha)
+        costs = constraint_costs(psi_det, lewis.N_orb, generate_all_constraints(na, lewis.N_orb))
+        C = generate_all_constraints(na, lewis.N_orb)[int(np.argmax(costs))]
+        dets, E_pt2_C = PP_manager.psi_external_pt2(C, psi_coef, E_var)
+        dets_q, E_pt2_q = [], []
+        for q in range(na - 4, C[0]):
+            d, e = PP_manager.psi_external_pt2((q,) + C, psi_coef, E_var)
+            dets_q += d
+            E_pt2_q += e.tolist()
+        self.assertEqual(sorted(dets), sorted(dets_q))
+        self.assertAlmostEqual(sum(E_pt2_C), sum(E_pt2_q), places=10)
+
+
+class Test_Instrumentation(Timing, unittest.TestCase):
+    def counters(self, n_workers):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf("data/f2_631g.10det.wf")
+        comm = Instrumented_comm(MPI.COMM_WORLD)
+        lewis = Hamiltonian_generator(
+            comm, E0, d_one_e_integral, d_two_e_integral, psi_det, n_workers=n_workers
+        )
+        profiler.reset()
+        profiler.enabled = True
+        try:
+            Powerplant_manager(comm, lewis, "static").E_pt2(psi_coef)
+            counters = dict(profiler.counters)
+            report = profiler.report(comm, "E_pt2")
+        finally:
+            profiler.enabled = False
+            profiler.reset()
+        if comm.Get_rank() == 0:
+            self.assertIn("connected dets generated", report)
+        return counters
+
+    def test_workers(self):
+        # What the forked workers recorded is merged back, and not counted twice
+        counters = self.counters(1)
+        self.assertGreater(counters["MPI Allreduce calls"], 0)
+        self.assertGreater(counters["PT2 integrals visited, category C"], 0)
+        counters_workers = self.counters(2)
+        for name in ("constraints", "connected dets generated", "PT2 elements emitted, category D"):
+            self.assertEqual(counters[name], counters_workers[name])
+
+
+class Test_Point_Group_Symmetry(Timing, unittest.TestCase):
+    # The F2 FCIDUMP has no symmetry (ORBSYM all 1): the integrals which are not allowed by
+    # made-up D2 irreps are zeroed, so that the reference is the same H without the screening
+    orbsym = [1, 2, 3, 4] * 4 + [1, 2]
+
+    def E_pt2_and_generated(self, driven_by, orbsym):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        irreps = [o - 1 for o in self.orbsym]
+        d_one_e_integral = defaultdict(
+            int, {(i, j): v for (i, j), v in d_one_e_integral.items() if irreps[i] == irreps[j]}
+        )
+        d_two_e_integral = defaultdict(
+            int,
+            {
+                key: v
+                for key, v in d_two_e_integral.items()
+                if Determinant.symmetry_allowed(irreps, *compound_idx4_reverse(key))
+            },
+        )
+        psi_coef, psi_det = load_wf("data/f2_631g.10det.wf")
+        comm = MPI.COMM_WORLD
+        lewis = Hamiltonian_generator(
+            comm, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by, orbsym=orbsym
+        )
+        profiler.reset()
+        profiler.enabled = True
+        try:
+            E_pt2 = Powerplant_manager(comm, lewis, "static").E_pt2(psi_coef)
+            generated = comm.allreduce(profiler.counters["connected dets generated"])
+        finally:
+            profiler.enabled = False
+            profiler.reset()
+        return E_pt2, generated
+
+    def test_pt2(self):
+        for driven_by in ("integral", "determinant"):
+            E_pt2_ref, generated_ref = self.E_pt2_and_generated(driven_by, None)
+            E_pt2, generated = self.E_pt2_and_generated(driven_by, self.orbsym)
+            self.assertAlmostEqual(E_pt2, E_pt2_ref, places=10)
+            self.assertLess(generated, generated_ref)
+
+    def test_connected(self):
+        irreps = [o - 1 for o in self.orbsym]
+        det = Determinant((0, 1, 2), (0, 1, 3))
+        connected = list(det.gen_all_connected_det(len(irreps), irreps))
+        self.assertTrue(connected)
+        self.assertEqual({det_J.irrep(irreps) for det_J in connected}, {det.irrep(irreps)})
+        all_connected = list(det.gen_all_connected_det(len(irreps)))
+        self.assertEqual(
+            sorted(det_J for det_J in all_connected if det_J.irrep(irreps) == det.irrep(irreps)),
+            sorted(connected),
+        )
+
+    def test_costs(self):
+        # `constraint_costs' counts the connected determinants (allowed by symmetry) of each one
+        _, psi_det = load_wf("data/f2_631g.10det.wf")
+        n_orb = len(self.orbsym)
+        constraints = generate_all_constraints(len(psi_det[0].alpha), n_orb)
+        for irreps in (None, [o - 1 for o in self.orbsym]):
+            count = dict.fromkeys(constraints, 0)
+            for det in psi_det[:3]:
+                for det_J in det.gen_all_connected_det(n_orb, irreps):
+                    count[tuple(det_J.alpha[-3:])] += 1
+            costs = constraint_costs(psi_det[:3], n_orb, constraints, irreps=irreps)
+            self.assertEqual(costs.tolist(), [count[C] for C in constraints])
+
+
+class Test_Distributed_Determinants(Timing, unittest.TestCase):
+    def load(self, wf_path, driven_by="integral"):
+        # The same wave function, with replicated and with distributed determinants
+        comm = MPI.COMM_WORLD
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf(f"data/{wf_path}")
+        replicated = Hamiltonian_generator(
+            comm, E0, d_one_e_integral, d_two_e_integral, psi_det, driven_by
+        )
+        distributed = Hamiltonian_generator(
+            comm,
+            E0,
+            d_one_e_integral,
+            d_two_e_integral,
+            replicated.psi_local,
+            driven_by,
+            det_storage="distributed",
+        )
+        return psi_coef, replicated, distributed
+
+    def test_H(self):
+        for driven_by in ("integral", "determinant"):
+            _, replicated, distributed = self.load("f2_631g.30det.wf", driven_by)
+            self.assertEqual(distributed.gather_psi_internal(), replicated.psi_internal)
+            np.testing.assert_allclose(
+                distributed.H_i_sparse.to_dense(), replicated.H_i_sparse.to_dense(), atol=1e-12
+            )
+            V = np.random.default_rng(0).standard_normal((replicated.full_problem_size, 2))
+            begin = replicated.offsets[replicated.rank]
+            np.testing.assert_allclose(
+                distributed.H_i_halo_product(V[begin : begin + replicated.local_size]),
+                replicated.H_i_implicit_matrix_product(V),
+                atol=1e-10,
+            )
+
+    def test_pt2_and_selection(self):
+        psi_coef, replicated, distributed = self.load("f2_631g.10det.wf")
+        comm = MPI.COMM_WORLD
+        E_pt2 = [
+            Powerplant_manager(comm, lewis).E_pt2(psi_coef) for lewis in (replicated, distributed)
+        ]
+        self.assertAlmostEqual(*E_pt2, places=10)
+        (E_r, _, _, lewis_r), (E_d, _, _, lewis_d) = [
+            selection_step(comm, lewis, None, psi_coef, None, 10, return_generator=True)
+            for lewis in (replicated, distributed)
+        ]
+        self.assertAlmostEqual(E_r, E_d, places=8)
+        self.assertEqual(sorted(lewis_d.gather_psi_internal()), sorted(lewis_r.psi_internal))
+
+    def test_alpha_blocks(self):
+        import tempfile
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = convert_wf("data/f2_631g.30det.wf", f"{tmpdir}/f2.qewf", sort_by_alpha=True)
+            alpha = load_wf_binary_alpha(path)
+            distribution = alpha_block_distribution(alpha, 4)
+            self.assertEqual(distribution.sum(), 30)
+            for boundary in np.cumsum(distribution)[:-1].tolist():
+                if 0 < boundary < 30:
+                    self.assertFalse((alpha[boundary] == alpha[boundary - 1]).all())
+            # The same wave function, reordered
+            psi_coef, psi_det_packed = load_wf_binary(path)
+            psi_det = unpack_psi_det(psi_det_packed, "bitstring")
+            psi_coef_ref, psi_det_ref = load_wf("data/f2_631g.30det.wf", "bitstring")
+            self.assertEqual(dict(zip(psi_det, psi_coef)), dict(zip(psi_det_ref, psi_coef_ref)))
+
+
+class Test_Symmetric_H(Timing, unittest.TestCase):
+    def load(self, psi_det, symmetric, driven_by="integral"):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        return Hamiltonian_generator(
+            MPI.COMM_WORLD,
+            E0,
+            d_one_e_integral,
+            d_two_e_integral,
+            psi_det,
+            driven_by,
+            symmetric=symmetric,
+        )
+
+    def test_product(self):
+        _, psi_det = load_wf("data/f2_631g.30det.wf")
+        for driven_by in ("integral", "determinant"):
+            upper = self.load(psi_det, True, driven_by)
+            full = self.load(psi_det, False, driven_by)
+            full.distribution = upper.distribution
+            rows, cols, _ = upper.H_i_sparse.to_coo()
+            self.assertTrue((cols >= rows + upper.offsets[upper.rank]).all())
+            V = np.random.default_rng(0).standard_normal((len(psi_det), 3))
+            np.testing.assert_allclose(
+                upper.H_i_implicit_matrix_product(V),
+                full.H_i_implicit_matrix_product(V),
+                atol=1e-10,
+            )
+
+    def test_extend(self):
+        _, psi_det = load_wf("data/f2_631g.30det.wf")
+        upper = self.load(psi_det[:20], True)
+        upper.H_i_sparse
+        extended = upper.extend(psi_det[20:])
+        reference = self.load(extended.psi_internal, True)
+        reference.distribution = extended.distribution
+        np.testing.assert_allclose(
+            extended.H_i_sparse.to_dense(), reference.H_i_sparse.to_dense(), atol=1e-12
+        )
+
+    def test_davidson(self):
+        _, psi_det = load_wf("data/f2_631g.30det.wf")
+        E = [
+            Powerplant_manager(MPI.COMM_WORLD, self.load(psi_det, symmetric)).E_and_psi_coef[0]
+            for symmetric in (True, False)
+        ]
+        self.assertAlmostEqual(*E, places=8)
+
+
+class Test_Semistochastic_PT2(Timing, unittest.TestCase):
+    def load(self, wf_path):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf(f"data/{wf_path}")
+        lewis = Hamiltonian_generator(
+            MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det
+        )
+        return psi_coef, Powerplant_manager(MPI.COMM_WORLD, lewis)
+
+    def test_all_deterministic(self):
+        psi_coef, PP_manager = self.load("f2_631g.10det.wf")
+        E_pt2 = PP_manager.E_pt2(psi_coef)
+        E, error = PP_manager.E_pt2_semistochastic(psi_coef, deterministic_fraction=1.0)
+        self.assertEqual(error, 0.0)
+        self.assertAlmostEqual(E_pt2, E, places=10)
+
+    def test_error_bar(self):
+        psi_coef, PP_manager = self.load("f2_631g.30det.wf")
+        E_pt2 = PP_manager.E_pt2(psi_coef)
+        E, error = PP_manager.E_pt2_semistochastic(psi_coef, relative_error=1e-2, max_batches=50)
+        # Generous, to not be flaky: 5 sigma (error is 0 if all constraints have been computed)
+        self.assertLessEqual(abs(E - E_pt2), 5 * error + 1e-10)
+        self.assertLess(error, 0.05 * abs(E_pt2))
+
+
+class Test_Memory_Budget(Timing, unittest.TestCase):
+    def load(self, **kwargs):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        psi_coef, psi_det = load_wf("data/f2_631g.30det.wf")
+        lewis = Hamiltonian_generator(
+            MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det, **kwargs
+        )
+        return psi_coef, lewis
+
+    def test_hybrid_product(self):
+        psi_coef, lewis_ref = self.load()
+        M = np.c_[psi_coef, np.random.default_rng(0).random((len(psi_coef), 2))]
+        W_ref = lewis_ref.H_i_implicit_matrix_product(M)
+        # (Blocks have their own `indptr`, so they take a bit more than H_i_sparse)
+        full_bytes = 2 * lewis_ref.H_i_sparse.nbytes
+        reports = []
+        for memory_budget in (0, full_bytes // 4, full_bytes):
+            _, lewis = self.load(memory_budget=memory_budget, row_block_size=4)
+            for _ in range(2):  # First product fills the cache, the second one re-uses it
+                np.testing.assert_allclose(lewis.H_i_implicit_matrix_product(M), W_ref)
+            self.assertNotIn("H_i_sparse", lewis.__dict__)
+            self.assertLessEqual(lewis.H_i_memory_report["cached_bytes"], memory_budget)
+            reports.append(lewis.memory_report())
+        self.assertEqual(reports[0]["cached_blocks"], 0)
+        self.assertEqual(reports[-1]["direct_blocks"], 0)
+        for report in reports:
+            self.assertEqual(
+                report["cached_blocks"] + report["direct_blocks"], reports[0]["direct_blocks"]
+            )
+
+
+class Test_Davidson(Timing, unittest.TestCase):
+    def load(self, wf_path="f2_631g.30det.wf"):
+        _, E0, d_one_e_integral, d_two_e_integral = load_integrals("data/f2_631g.FCIDUMP")
+        _, psi_det = load_wf(f"data/{wf_path}")
+        return Hamiltonian_generator(
+            MPI.COMM_WORLD, E0, d_one_e_integral, d_two_e_integral, psi_det
+        )
+
+    def test_block_cgs2(self):
+        DM = Davidson_manager(MPI.COMM_WORLD, self.load())
+        rng = np.random.default_rng(MPI.COMM_WORLD.rank)
+        V_ik = DM.block_cgs2(np.zeros((DM.local_size, 0)), rng.random((DM.local_size, 4)))
+        # Last new vector is a combination of the basis and of the other ones: dropped
+        T_ik = rng.random((DM.local_size, 3))
+        T_ik = np.c_[T_ik, V_ik[:, 0] - 2 * T_ik[:, 1]]
+        Q_ik = DM.block_cgs2(V_ik, T_ik)
+        self.assertEqual(Q_ik.shape, (DM.local_size, 3))
+        V_ik = np.c_[V_ik, Q_ik]
+        np.testing.assert_allclose(DM.allreduce_gram(V_ik, V_ik), np.eye(7), atol=1e-12)
+
+    def test_block_vs_mgs(self):
+        lewis = self.load()
+        L = [
+            Davidson_manager(MPI.COMM_WORLD, lewis, orthogonalization).distributed_davidson(
+                n_eig=2, m=2
+            )[0]
+            for orthogonalization in ("block", "mgs")
+        ]
+        np.testing.assert_allclose(*L, rtol=1e-10)
+
+    @unittest.skipUnless(HAS_CUPY, "needs CuPy")
+    def test_cupy_backend(self):
+        lewis = self.load()
+        L, X = zip(
+            *(
+                Davidson_manager(MPI.COMM_WORLD, lewis, backend=backend).distributed_davidson(
+                    n_eig=2, m=2
+                )
+                for backend in ("numpy", "cupy")
+            )
+        )
+        np.testing.assert_allclose(*L, rtol=1e-10)
+        # Ritz vectors are back on the host, up to their sign
+        self.assertIsInstance(X[1], np.ndarray)
+        np.testing.assert_allclose(np.abs(X[0].T @ X[1]), np.eye(2), atol=1e-8)
+
+    def test_warm_start(self):
+        psi_coef, psi_det = load_wf("data/f2_631g.10det.wf")
+        lewis = self.load("f2_631g.10det.wf")
+        comm, n_ord = lewis.comm, lewis.N_orb
+        E_cold, _, _, lewis_new = selection_step(
+            comm, lewis, n_ord, psi_coef, psi_det, 10, return_generator=True, warm_start=False
+        )
+        E_warm, _, _ = selection_step(comm, lewis, n_ord, psi_coef, psi_det, 10)
+        self.assertAlmostEqual(E_cold, E_warm, places=8)
+
+        n_iterations = []
+        for warm_start in (False, True):
+            PP_manager = Powerplant_manager(comm, lewis_new)
+            V_iguess = PP_manager.warm_start_guess(psi_coef) if warm_start else None
+            PP_manager.diagonalize(V_iguess)
+            n_iterations.append(PP_manager.DM.n_iterations)
+        self.assertLess(n_iterations[1], n_iterations[0])
+
+    def test_preconditioners(self):
+        lewis = self.load("f2_631g.30det.wf")
+        names = ("diagonal", "block")
+        profiler.reset()
+        profiler.enabled = True
+        try:
+            L = [
+                Davidson_manager(MPI.COMM_WORLD, lewis, preconditioner=name).distributed_davidson(
+                    n_eig=2, m=2
+                )[0]
+                for name in names
+            ]
+            counters = dict(profiler.counters)
+        finally:
+            profiler.enabled = False
+            profiler.reset()
+        np.testing.assert_allclose(*L, rtol=1e-10)
+        iterations = [counters[f"Davidson iterations, {name} preconditioner"] for name in names]
+        self.assertEqual(sum(iterations), counters["Davidson iterations"])
+        if MPI.COMM_WORLD.Get_size() == 1:
+            # The block is the whole H: (nearly) inverse iteration
+            self.assertLess(iterations[1], iterations[0])
+
 
 class Test_VariationalPowerplant:
     def test_c2_eq_dz_3(self):
@@ -876,6 +1816,11 @@ class Test_VariationalPowerplant_Integral(Timing, unittest.TestCase, Test_Variat
         return load_and_compute(fcidump_path, wf_path, "integral")
 
 
+class Test_VariationalPowerplant_Compiled(Timing, unittest.TestCase, Test_VariationalPowerplant):
+    def load_and_compute(self, fcidump_path, wf_path):
+        return load_and_compute(fcidump_path, wf_path, "compiled")
+
+
 class Test_VariationalPT2Powerplant:
     def test_f2_631g_1det(self):
         fcidump_path = "f2_631g.FCIDUMP"
@@ -927,6 +1872,11 @@ class Test_VariationalPT2_Integral(Timing, unittest.TestCase, Test_VariationalPT
         return load_and_compute_pt2(fcidump_path, wf_path, "integral")
 
 
+class Test_VariationalPT2_Compiled(Timing, unittest.TestCase, Test_VariationalPT2Powerplant):
+    def load_and_compute_pt2(self, fcidump_path, wf_path):
+        return load_and_compute_pt2(fcidump_path, wf_path, "compiled")
+
+
 class Test_Selection(Timing, unittest.TestCase):
     def load(self, fcidump_path, wf_path):
         # Load integrals
@@ -984,6 +1934,51 @@ class Test_Selection(Timing, unittest.TestCase):
 
         self.assertAlmostEqual(E_ref, E, places=6)
 
+    def test_f2_631g_10det_selection_pass(self):
+        n_ord, psi_coef, psi_det, lewis = self.load("f2_631g.FCIDUMP", "f2_631g.10det.wf")
+        PP_manager = Powerplant_manager(lewis.comm, lewis)
+        E_var, E_pt2, best_dets = PP_manager.selection_pass(psi_coef, 5)
+        self.assertAlmostEqual(E_var, PP_manager.E(psi_coef), places=10)
+        self.assertAlmostEqual(E_pt2, PP_manager.E_pt2(psi_coef), places=10)
+        self.assertEqual(len(set(best_dets)), 5)
+        self.assertFalse(set(best_dets) & set(psi_det))
+
+        # Same selection, with the variational energy given
+        E_ref, _, _ = selection_step(lewis.comm, lewis, n_ord, psi_coef, psi_det, 5)
+        E, _, _, E_pt2_selection = selection_step(
+            lewis.comm, lewis, n_ord, psi_coef, psi_det, 5, E_var=E_var, return_pt2=True
+        )
+        self.assertAlmostEqual(E_ref, E, places=10)
+        self.assertAlmostEqual(E_pt2, E_pt2_selection, places=10)
+
+        # Converged: psi is returned as is, H isn't extended
+        E, psi_coef_same, psi_det_same, lewis_same, _ = selection_step(
+            lewis.comm,
+            lewis,
+            n_ord,
+            psi_coef,
+            psi_det,
+            5,
+            return_generator=True,
+            return_pt2=True,
+            E_pt2_threshold=2 * abs(E_pt2),
+        )
+        self.assertAlmostEqual(E, E_var, places=10)
+        self.assertIs(lewis_same, lewis)
+        self.assertIs(psi_det_same, psi_det)
+
+    def test_global_top_n_packed(self):
+        n_ord, psi_coef, psi_det, lewis = self.load("f2_631g.FCIDUMP", "f2_631g.10det.wf")
+        comm = lewis.comm
+        dets, energies = local_sort_pt2_energies(
+            Powerplant_manager(comm, lewis), psi_coef, psi_det, 20
+        )
+        ref = global_sort_pt2_energies(comm, dets, energies, 10)
+        # Every candidate twice: the duplicates are discarded by the merge
+        top = global_top_n_packed(comm, dets + dets, np.r_[energies, energies], 10, n_ord)
+        self.assertEqual(len(top), 10)
+        self.assertEqual(set(top), set(ref))
+
 
 if __name__ == "__main__":
     try: